@@ -4,48 +4,80 @@
  */
 #include <stdio.h>
 #include <math.h>
+#include <time.h>
 #include "btui.h"
 
-int main(void)
+static void draw_rainbow(btui_t *bt, double t)
 {
-    btui_t *bt = btui_enable();
-    if (!bt) return 1;
-    int done = 0;
-    double t = 0;
     double a1 = 1.13, a2 = 1.23, a3 = 1.37;
-    double dt = 0.1;
-    char buf[1<<20];
-    setvbuf(bt->out, buf, _IOFBF, sizeof(buf));
-    btui_puts(bt, T_OFF(T_WRAP));
     const char *title = " 24 BIT COLOR SUPPORT! ";
-    while (!done) {
-        int y = bt->height-1;
-        btui_move_cursor(bt, 0, y);
-        for (int x = 0; x < bt->width; x++) {
-            int r = (int)(255.0 * (0.5 + 0.5*sin(t*a1 + (double)(x) / 50.0)));
-            int g = (int)(255.0 * (0.5 + 0.5*sin(0.8 + t*a2 + (double)(x) / 50.0)));
-            int b = (int)(255.0 * (0.5 + 0.5*sin(1.3 + t*a3 + (double)(x) / 50.0)));
-            btui_set_bg(bt,
-                        (r < 0 ? 0 : (r > 255 ? 255 : r)),
-                        (g < 0 ? 0 : (g > 255 ? 255 : g)),
-                        (b < 0 ? 0 : (b > 255 ? 255 : b)));
-            btui_puts(bt, " ");
-        }
-        btui_puts(bt, "\n");
-        btui_move_cursor(bt, (bt->width - (int)strlen(title)) / 2, 0);
-        btui_set_attributes(bt, BTUI_NORMAL | BTUI_BOLD);
-        btui_puts(bt, title);
-        btui_flush(bt);
-        usleep(10000);
-        t += dt;
+    int y = bt->height-1;
+    btui_move_cursor(bt, 0, y);
+    for (int x = 0; x < bt->width; x++) {
+        int r = (int)(255.0 * (0.5 + 0.5*sin(t*a1 + (double)(x) / 50.0)));
+        int g = (int)(255.0 * (0.5 + 0.5*sin(0.8 + t*a2 + (double)(x) / 50.0)));
+        int b = (int)(255.0 * (0.5 + 0.5*sin(1.3 + t*a3 + (double)(x) / 50.0)));
+        btui_set_bg(bt,
+                    (r < 0 ? 0 : (r > 255 ? 255 : r)),
+                    (g < 0 ? 0 : (g > 255 ? 255 : g)),
+                    (b < 0 ? 0 : (b > 255 ? 255 : b)));
+        btui_puts(bt, " ");
+    }
+    btui_puts(bt, "\n");
+    btui_move_cursor(bt, (bt->width - (int)strlen(title)) / 2, 0);
+    btui_set_attributes(bt, BTUI_NORMAL | BTUI_BOLD);
+    btui_puts(bt, title);
+}
+
+typedef struct {
+    btui_t *bt;
+    struct timespec start;
+} rainbow_t;
+
+// Draw a frame of the animation (unless the terminal is still busy with the
+// last one):
+static void on_frame(btui_loop_t *loop, btui_timer_t *timer, void *data)
+{
+    (void)loop, (void)timer;
+    rainbow_t *rainbow = data;
+    if (!btui_frame_begin(rainbow->bt)) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double t = 6.0*((double)(now.tv_sec - rainbow->start.tv_sec) + 1e-9*(double)(now.tv_nsec - rainbow->start.tv_nsec));
+    draw_rainbow(rainbow->bt, t);
+    btui_frame_end(rainbow->bt);
+}
+
+static void on_key(btui_loop_t *loop, btui_t *bt, const btui_event_t *event, void *data)
+{
+    (void)bt, (void)data;
+    switch (event->modifiers | event->key) {
+        case 'q': case KEY_CTRL_C: btui_loop_stop(loop); break;
+        default: break;
+    }
+}
+
+int main(void)
+{
+    rainbow_t rainbow = {.bt = btui_enable()};
+    if (!rainbow.bt) return 1;
+    clock_gettime(CLOCK_MONOTONIC, &rainbow.start);
+    btui_set_synchronized(rainbow.bt, 1);
+    // If the terminal can't keep up, frames get skipped instead of piling up:
+    btui_set_nonblocking(rainbow.bt, 1);
+    btui_puts(rainbow.bt, T_OFF(T_WRAP));
 
-        int mouse_x = -1, mouse_y = -1;
-        int key = btui_getkey(bt, 0, &mouse_x, &mouse_y);
-        switch (key) {
-            case 'q': case KEY_CTRL_C: done = 1; break;
-            default: break;
-        }
+    // Input and a 60 fps animation timer, with no busy waiting in between:
+    btui_loop_t *loop = btui_loop_create();
+    if (!loop || btui_loop_add_btui(loop, rainbow.bt, on_key, NULL)
+        || !btui_loop_add_timer(loop, 0, 1000/60, on_frame, &rainbow)) {
+        btui_loop_free(loop);
+        btui_disable(rainbow.bt);
+        return 1;
     }
-    btui_disable(bt);
+    btui_loop_run(loop);
+    btui_loop_remove_btui(loop, rainbow.bt);
+    btui_loop_free(loop);
+    btui_disable(rainbow.bt);
     return 0;
 }
@@ -69,7 +69,7 @@ int main(void)
                 btui_printf(bt, " Pressed: %s ", buf);
 
                 btui_set_attributes(bt, BTUI_NORMAL);
-                fflush(bt->out);
+                btui_flush(bt);
                 break;
             }
         }
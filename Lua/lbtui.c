@@ -86,6 +86,36 @@ static int Lbtui_getkey(lua_State *L)
     return 1;
 }
 
+static int Lbtui_getkeys(lua_State *L)
+{
+    btui_t **bt = (btui_t**)lua_touserdata(L, 1);
+    if (bt == NULL) luaL_error(L, "Not a BTUI object");
+    if (*bt == NULL) luaL_error(L, "BTUI object not initialized");
+    int timeout = lua_gettop(L) <= 1 ? -1 : (int)luaL_checkinteger(L, 2);
+    btui_event_t events[64];
+    int n = btui_getkeys(*bt, events, sizeof(events)/sizeof(events[0]), timeout);
+    lua_createtable(L, n < 0 ? 0 : n, 0);
+    for (int i = 0; i < n; i++) {
+        char buf[256] = {0};
+        btui_keyname(events[i].modifiers | events[i].key, buf);
+        lua_createtable(L, 0, 5);
+        lua_pushstring(L, buf);
+        lua_setfield(L, -2, "key");
+        if (events[i].x != -1 || events[i].y != -1) {
+            lua_pushinteger(L, events[i].x);
+            lua_setfield(L, -2, "x");
+            lua_pushinteger(L, events[i].y);
+            lua_setfield(L, -2, "y");
+        }
+        lua_pushinteger(L, events[i].count);
+        lua_setfield(L, -2, "count");
+        lua_pushnumber(L, (lua_Number)events[i].timestamp / 1e6);
+        lua_setfield(L, -2, "time");
+        lua_rawseti(L, -2, i+1);
+    }
+    return 1;
+}
+
 static int Lbtui_write(lua_State *L)
 {
     btui_t **bt = (btui_t**)lua_touserdata(L, 1);
@@ -385,6 +415,42 @@ static int Lbtui_height(lua_State *L)
     return 1;
 }
 
+static int Lbtui_stats(lua_State *L)
+{
+    btui_t **bt = (btui_t**)lua_touserdata(L, 1);
+    if (bt == NULL) luaL_error(L, "Not a BTUI object");
+    if (*bt == NULL) luaL_error(L, "BTUI object not initialized");
+    btui_stats_t stats;
+    if (btui_stats(*bt, &stats) != 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_createtable(L, 0, 10);
+#define STAT(name) lua_pushinteger(L, (lua_Integer)stats.name); lua_setfield(L, -2, #name)
+    STAT(bytes_written); STAT(flushes); STAT(writes); STAT(cursor_moves); STAT(sgr);
+    STAT(colors); STAT(scrolls); STAT(bytes_read); STAT(events); STAT(wait_us);
+#undef STAT
+    return 1;
+}
+
+static int Lbtui_resetstats(lua_State *L)
+{
+    btui_t **bt = (btui_t**)lua_touserdata(L, 1);
+    if (bt == NULL) luaL_error(L, "Not a BTUI object");
+    if (*bt == NULL) luaL_error(L, "BTUI object not initialized");
+    btui_stats_reset(*bt);
+    return 0;
+}
+
+static int Lbtui_latency(lua_State *L)
+{
+    btui_t **bt = (btui_t**)lua_touserdata(L, 1);
+    if (bt == NULL) luaL_error(L, "Not a BTUI object");
+    if (*bt == NULL) luaL_error(L, "BTUI object not initialized");
+    lua_pushnumber(L, (lua_Number)btui_latency(*bt, luaL_checknumber(L, 2)) / 1e6);
+    return 1;
+}
+
 static int Lbtui_wrap(lua_State *L)
 {
     if (lua_gettop(L) < 1) luaL_error(L, "expected a callable object");
@@ -510,16 +576,20 @@ static const luaL_Reg Rclass_metamethods[] =
     {"fillbox",         Lbtui_fillbox},
     {"flush",           Lbtui_flush},
     {"getkey",          Lbtui_getkey},
+    {"getkeys",         Lbtui_getkeys},
     {"height",          Lbtui_height},
     {"hidecursor",      Lbtui_hidecursor},
+    {"latency",         Lbtui_latency},
     {"linebox",         Lbtui_linebox},
     {"move",            Lbtui_move},
+    {"resetstats",      Lbtui_resetstats},
     {"scroll",          Lbtui_scroll},
     {"setattributes",   Lbtui_setattributes},
     {"setcursor",       Lbtui_setcursor},
     {"setmode",         Lbtui_setmode},
     {"shadow",          Lbtui_shadow},
     {"showcursor",      Lbtui_showcursor},
+    {"stats",           Lbtui_stats},
     {"suspend",         Lbtui_suspend},
     {"unsetattributes", Lbtui_unsetattributes},
     {"width",           Lbtui_width},
@@ -1,3 +1,4 @@
+import collections
 import ctypes
 import enum
 import functools
@@ -23,6 +24,24 @@ class BTUI_struct(ctypes.Structure):
     ]
 
 libbtui.btui_create.restype = ctypes.POINTER(BTUI_struct)
+libbtui.btui_latency.restype = ctypes.c_uint64
+
+class BTUI_event(ctypes.Structure):
+    _fields_ = [
+        ('key', ctypes.c_int),
+        ('modifiers', ctypes.c_int),
+        ('x', ctypes.c_int),
+        ('y', ctypes.c_int),
+        ('count', ctypes.c_int),
+        ('timestamp', ctypes.c_uint64),
+    ]
+
+Event = collections.namedtuple('Event', ['key', 'x', 'y', 'count', 'time'])
+
+class BTUI_stats(ctypes.Structure):
+    _fields_ = [(name, ctypes.c_uint64) for name in (
+        'bytes_written', 'flushes', 'writes', 'cursor_moves', 'sgr',
+        'colors', 'scrolls', 'bytes_read', 'events', 'wait_us')]
 
 attr = lambda name: ctypes.c_longlong.in_dll(libbtui, name).value
 attr_t = ctypes.c_longlong
@@ -218,6 +237,22 @@ class BTUI:
         else:
             return key, mouse_x.value, mouse_y.value
 
+    def getkeys(self, timeout=None):
+        assert self._btui
+        timeout = -1 if timeout is None else int(timeout)
+        events = (BTUI_event * 64)()
+        n = libbtui.btui_getkeys(self._btui, events, ctypes.c_size_t(len(events)), timeout)
+        buf = ctypes.create_string_buffer(64)
+        keys = []
+        for event in events[:n]:
+            libbtui.btui_keyname(event.modifiers | event.key, buf)
+            key = buf.value.decode('utf8')
+            if event.x == -1:
+                keys.append(Event(key, None, None, event.count, event.timestamp / 1e6))
+            else:
+                keys.append(Event(key, event.x, event.y, event.count, event.timestamp / 1e6))
+        return keys
+
     @property
     def height(self):
         assert self._btui
@@ -281,6 +316,21 @@ class BTUI:
         assert self._btui
         libbtui.btui_set_fg(self._btui, int(r*255), int(g*255), int(b*255))
 
+    def stats(self):
+        assert self._btui
+        stats = BTUI_stats()
+        if libbtui.btui_stats(self._btui, ctypes.byref(stats)) != 0:
+            return None
+        return {name: getattr(stats, name) for name, _ in BTUI_stats._fields_}
+
+    def reset_stats(self):
+        assert self._btui
+        libbtui.btui_stats_reset(self._btui)
+
+    def latency(self, percentile):
+        assert self._btui
+        return libbtui.btui_latency(self._btui, ctypes.c_double(percentile)) / 1e6
+
     def suspend(self):
         assert self._btui
         libbtui.btui_suspend(self._btui)
@@ -0,0 +1 @@
+../btui.h
\ No newline at end of file
@@ -0,0 +1,383 @@
+/*
+ * This file contains regression checks for behavior that's easy to break
+ * without noticing. They mostly use headless BTUIs, so that what actually
+ * reaches the (virtual) terminal can be checked. It prints each failure and
+ * exits with a nonzero status if there were any.
+ *
+ * Usage: check
+ *
+ * It's also built as check-nostats, with -DBTUI_NO_STATS.
+ */
+#include <stdio.h>
+#include <sys/wait.h>
+#include "btui.h"
+
+static int failures = 0;
+
+static void check(const char *what, int ok)
+{
+    if (!ok) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        ++failures;
+    }
+}
+
+static const btui_cell_t *cell(btui_t *bt, int x, int y)
+{
+    return &bt->vt->cells[y * bt->vt->width + x];
+}
+
+// Text drawn after the overlay has to come out with the app's attributes,
+// even when BTUI didn't know what the terminal's attributes were:
+static void check_hud(void)
+{
+#ifdef BTUI_NO_STATS
+    // There's no overlay without stats:
+    return;
+#endif
+    for (int retained = 0; retained <= 1; retained++) {
+        btui_t *bt = btui_create_headless(60, 20);
+        if (!bt) exit(1);
+        btui_set_retained(bt, retained);
+        check("the overlay to be available", btui_set_hud(bt, 1) == 0);
+        btui_move_cursor(bt, 0, 10);
+        btui_puts(bt, "\033[31ma");
+        btui_flush(bt);
+        btui_flush(bt);
+        btui_set_attributes(bt, BTUI_FG_WHITE | BTUI_BG_BLACK);
+        btui_move_cursor(bt, 0, 12);
+        btui_puts(bt, "X");
+        btui_puts(bt, "Y");
+        btui_flush(bt);
+        const btui_cell_t *x = cell(bt, 0, 12), *y = cell(bt, 1, 12);
+        check("text after the overlay to have the app's colors",
+              x->pen.fg == (BTUI_COLOR_BASIC | 7) && x->pen.bg == BTUI_COLOR_BASIC);
+        check("text after the overlay to continue where the app left off", y->glyph == 'Y');
+        char line[128];
+        btui_vt_line(bt->vt, 1, line, sizeof(line));
+        check("the overlay to be drawn", strstr(line, "fps") != NULL);
+        btui_set_hud(bt, 0);
+        btui_disable(bt);
+    }
+}
+
+// Whether a box is filled with spaces, ECH or DECFRA, text written right
+// after it has to end up just past the end of its last row:
+static void check_fill_box(void)
+{
+    static const int capabilities[] = {0, BTUI_CAP_ECH, BTUI_CAP_RECT, BTUI_CAP_ECH | BTUI_CAP_RECT};
+    for (size_t i = 0; i < sizeof(capabilities)/sizeof(capabilities[0]); i++) {
+        btui_t *bt = btui_create_headless(40, 10);
+        if (!bt) exit(1);
+        btui_set_capabilities(bt, capabilities[i]);
+        btui_set_attributes(bt, BTUI_NORMAL);
+        btui_fill_box(bt, 5, 2, 20, 3);
+        btui_puts(bt, "Z");
+        btui_fill_box(bt, 0, 7, 10, 1);
+        btui_puts(bt, "W");
+        btui_flush(bt);
+        check("text after a box fill to be at the end of its last row", cell(bt, 25, 4)->glyph == 'Z');
+        check("text after a one row box fill to follow it", cell(bt, 10, 7)->glyph == 'W');
+        btui_disable(bt);
+    }
+}
+
+// A session on a pty, with output going somewhere else entirely:
+static void check_create_fd(void)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) || unlockpt(master)) {
+        printf("(skipping btui_create_fd() checks: no ptys)\n");
+        return;
+    }
+    const char *name = ptsname(master);
+    int slave = name ? open(name, O_RDWR | O_NOCTTY) : -1, out[2];
+    if (slave < 0 || pipe(out)) exit(1);
+    fcntl(out[0], F_SETFL, fcntl(out[0], F_GETFL) | O_NONBLOCK);
+
+    btui_t *bt = btui_create_fd(slave, out[1]);
+    check("btui_create_fd() to work with output that isn't a terminal", bt != NULL);
+    if (bt) {
+        struct termios settings;
+        check("the input terminal to be in raw mode",
+              tcgetattr(slave, &settings) == 0 && !(settings.c_lflag & ICANON));
+        if (write(master, "q", 1) != 1) exit(1);
+        check("a key typed on the pty to be read", btui_getkey(bt, 1000, NULL, NULL) == 'q');
+        check("btui_set_size() to work", btui_set_size(bt, 100, 30) == 0);
+        btui_event_t event;
+        check("a resize event for btui_set_size()",
+              btui_getkeys(bt, &event, 1, 0) == 1 && event.key == RESIZE_EVENT && bt->width == 100);
+        btui_disable(bt);
+        check("the terminal's settings to be restored",
+              tcgetattr(slave, &settings) == 0 && (settings.c_lflag & ICANON));
+    }
+    char buf[4096];
+    while (read(out[0], buf, sizeof(buf)) > 0)
+        continue;
+    close(out[0]);
+    close(out[1]);
+    close(slave);
+    close(master);
+}
+
+// Truncated lines have to end between characters, so they're still valid
+// UTF-8:
+static void check_vt_line(void)
+{
+    btui_vt_t *vt = btui_vt_create(10, 2);
+    if (!vt) exit(1);
+    btui_vt_feed(vt, "a\xc3\xa9\xe4\xb8\x96" "b", 8);
+    static const struct { size_t size; const char *text; } expected[] = {
+        {1, ""}, {2, "a"}, {3, "a"}, {4, "a\xc3\xa9"}, {6, "a\xc3\xa9"},
+        {7, "a\xc3\xa9\xe4\xb8\x96"}, {8, "a\xc3\xa9\xe4\xb8\x96" "b"}, {64, "a\xc3\xa9\xe4\xb8\x96" "b"},
+    };
+    for (size_t i = 0; i < sizeof(expected)/sizeof(expected[0]); i++) {
+        char buf[64];
+        int len = btui_vt_line(vt, 0, buf, expected[i].size);
+        check("btui_vt_line() to truncate between characters",
+              strcmp(buf, expected[i].text) == 0 && len == (int)strlen(expected[i].text));
+    }
+    btui_vt_free(vt);
+}
+
+typedef struct {
+    uint64_t start;
+    int fired, early, ticks;
+} timers_t;
+
+// The timers' delays, in the order they should go off:
+static const int due[] = {1, 3, 20, 45, 64, 70, 100, 130};
+
+static void on_timer(btui_loop_t *loop, btui_timer_t *timer, void *data)
+{
+    (void)loop, (void)timer;
+    timers_t *t = data;
+    int i = t->fired++;
+    if (btui_now() < t->start + (uint64_t)due[i] * 1000) ++t->early;
+}
+
+static void on_tick(btui_loop_t *loop, btui_timer_t *timer, void *data)
+{
+    timers_t *t = data;
+    if (++t->ticks == 5) btui_loop_cancel_timer(loop, timer);
+}
+
+static void on_readable(btui_loop_t *loop, int fd, int events, void *data)
+{
+    char buf[16];
+    ssize_t n = read(fd, buf, sizeof(buf));
+    *(int*)data += n > 0 && (events & BTUI_LOOP_READ);
+    if (n <= 0) btui_loop_remove_fd(loop, fd);
+}
+
+static void on_key(btui_loop_t *loop, btui_t *bt, const btui_event_t *event, void *data)
+{
+    ++*(int*)data;
+    if (event->key == 'q') btui_loop_remove_btui(loop, bt);
+}
+
+static void on_never(btui_loop_t *loop, btui_timer_t *timer, void *data)
+{
+    (void)timer, (void)data;
+    btui_loop_stop(loop);
+    ++failures;
+    fprintf(stderr, "FAILED: a cancelled timer went off\n");
+}
+
+// Timers have to go off in order and never early, cancelled timers never go
+// off, and the loop ends once there's nothing left to wait on:
+static void check_loop(void)
+{
+    btui_loop_t *loop = btui_loop_create();
+    if (!loop) exit(1);
+    timers_t t = {.start = btui_now()};
+    // Added out of order, and landing in different levels of the timer wheel:
+    static const int delays[] = {70, 3, 130, 20, 64, 1, 45, 100};
+    for (size_t i = 0; i < sizeof(delays)/sizeof(delays[0]); i++)
+        btui_loop_add_timer(loop, delays[i], 0, on_timer, &t);
+    btui_loop_add_timer(loop, 2, 10, on_tick, &t);
+    btui_loop_cancel_timer(loop, btui_loop_add_timer(loop, 5, 0, on_never, NULL));
+
+    int pipefd[2], reads = 0;
+    if (pipe(pipefd)) exit(1);
+    check("btui_loop_add_fd() to work", btui_loop_add_fd(loop, pipefd[0], BTUI_LOOP_READ, on_readable, &reads) == 0);
+    if (write(pipefd[1], "x", 1) != 1) exit(1);
+    close(pipefd[1]);
+
+    btui_t *bt = btui_create_headless(20, 5);
+    if (!bt) exit(1);
+    int keys = 0;
+    check("btui_loop_add_btui() to work", btui_loop_add_btui(loop, bt, on_key, &keys) == 0);
+    btui_vt_type(bt->vt, "ab\033[Aq", 6);
+
+    check("btui_loop_run() to finish", btui_loop_run(loop) == 0);
+    check("every key to be passed on", keys == 4);
+    check("every timer to go off", t.fired == (int)(sizeof(due)/sizeof(due[0])));
+    check("no timer to go off early", t.early == 0);
+    check("a repeating timer to stop once cancelled", t.ticks == 5);
+    check("the readable pipe to be passed on", reads == 1);
+    close(pipefd[0]);
+    btui_disable(bt);
+    btui_loop_free(loop);
+}
+
+// The counters have to count what was actually drawn and read, go back to zero
+// when reset, and report that they're missing when compiled out:
+static void check_stats(void)
+{
+    btui_t *bt = btui_create_headless(20, 5);
+    if (!bt) exit(1);
+    btui_stats_t stats, zero = {0};
+#ifdef BTUI_NO_STATS
+    check("btui_stats_reset() to fail without stats", btui_stats_reset(bt) == -1);
+    btui_puts(bt, "hi");
+    btui_flush(bt);
+    check("btui_stats() to fail without stats", btui_stats(bt, &stats) == -1);
+    check("no counters without stats", memcmp(&stats, &zero, sizeof(stats)) == 0);
+#else
+    check("btui_stats_reset() to work", btui_stats_reset(bt) == 0);
+    btui_move_cursor(bt, 2, 1);
+    btui_set_attributes(bt, BTUI_FG_RED);
+    btui_puts(bt, "hi");
+    btui_flush(bt);
+    btui_vt_type(bt->vt, "ab", 2);
+    check("typed keys to be read", btui_getkey(bt, 0, NULL, NULL) == 'a' && btui_getkey(bt, 0, NULL, NULL) == 'b');
+    check("btui_stats() to work", btui_stats(bt, &stats) == 0);
+    check("the output to be counted", stats.bytes_written > 2 && stats.flushes == 1 && stats.writes == 1);
+    check("escape sequences to be counted", stats.cursor_moves == 1 && stats.sgr == 1 && stats.scrolls == 0);
+    check("the input to be counted", stats.bytes_read == 2 && stats.events == 2);
+    btui_stats_reset(bt);
+    btui_stats(bt, &stats);
+    check("btui_stats_reset() to zero every counter", memcmp(&stats, &zero, sizeof(stats)) == 0);
+#endif
+    btui_disable(bt);
+}
+
+// A program killed while its output is stuck behind a terminal that isn't
+// reading has to die promptly instead of waiting on the writer thread:
+static void check_signal_writer(void)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY), ready[2];
+    if (master < 0 || grantpt(master) || unlockpt(master) || !ptsname(master)) {
+        printf("(skipping the writer thread signal check: no ptys)\n");
+        return;
+    }
+    if (pipe(ready)) exit(1);
+    pid_t pid = fork();
+    if (pid < 0) exit(1);
+    if (pid == 0) {
+        // Make the pty this process's terminal, and never read from it:
+        setsid();
+        int slave = open(ptsname(master), O_RDWR);
+        struct winsize size = {.ws_row = 24, .ws_col = 80};
+        if (slave < 0 || ioctl(slave, TIOCSWINSZ, &size)) _exit(2);
+        close(master);
+        btui_t *bt = btui_create(BTUI_MODE_TUI);
+        if (!bt || btui_set_writer_thread(bt, 1)) _exit(2);
+        if (write(ready[1], "", 1) != 1) _exit(2);
+        for (;;) {
+            for (int y = 0; y < bt->height; y++) {
+                btui_move_cursor(bt, 0, y);
+                btui_puts(bt, "The quick brown fox jumps over the lazy dog.");
+            }
+            btui_flush(bt);
+        }
+    }
+    close(ready[1]);
+    char c;
+    if (read(ready[0], &c, 1) != 1) {
+        printf("(skipping the writer thread signal check: no writer thread)\n");
+        waitpid(pid, NULL, 0);
+        close(ready[0]);
+        close(master);
+        return;
+    }
+    close(ready[0]);
+    // Long enough for the ring to fill up:
+    usleep(200000);
+    kill(pid, SIGTERM);
+    int status = 0;
+    uint64_t deadline = btui_now() + 2000000;
+    while (waitpid(pid, &status, WNOHANG) == 0) {
+        if (btui_now() > deadline) {
+            kill(pid, SIGKILL);
+            waitpid(pid, &status, 0);
+            break;
+        }
+        usleep(10000);
+    }
+    check("SIGTERM to kill a program with a full writer thread ring",
+          WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM);
+    close(master);
+}
+
+// Escape sequences in text drawn in retained mode have to apply to the frame
+// they're in, not go out ahead of it:
+static void check_retained_escapes(void)
+{
+    btui_t *bt = btui_create_headless(20, 5);
+    if (!bt) exit(1);
+    btui_set_retained(bt, 1);
+    btui_move_cursor(bt, 0, 0);
+    btui_puts(bt, "\033[31mred\033[0m");
+    btui_move_cursor(bt, 0, 1);
+    btui_puts(bt, "\033[38;5;200;48;2;1;2;3mx");
+    btui_flush(bt);
+    check("SGR in retained text to set the colors",
+          cell(bt, 0, 0)->pen.fg == (BTUI_COLOR_BASIC | 1) && cell(bt, 0, 0)->glyph == 'r');
+    check("256-color and RGB SGR in retained text to set the colors",
+          cell(bt, 0, 1)->pen.fg == (BTUI_COLOR_PALETTE | 200) && cell(bt, 0, 1)->pen.bg == (BTUI_COLOR_RGB | 0x010203));
+
+    // Clearing and then drawing the same thing again leaves it on the screen:
+    btui_puts(bt, "\033[2J");
+    btui_move_cursor(bt, 0, 0);
+    btui_puts(bt, "\033[31mred");
+    btui_flush(bt);
+    check("ED in retained text to clear the frame", cell(bt, 0, 1)->glyph == ' ');
+    check("text drawn after ED in retained text to be shown", cell(bt, 0, 0)->glyph == 'r');
+    btui_move_cursor(bt, 1, 0);
+    btui_puts(bt, "\033[K");
+    btui_flush(bt);
+    check("EL in retained text to clear the rest of the line", cell(bt, 0, 0)->glyph == 'r' && cell(bt, 1, 0)->glyph == ' ');
+
+    // Anything else gets passed through, so the whole frame gets redrawn:
+    btui_move_cursor(bt, 0, 0);
+    btui_puts(bt, "\033[1;1;5;20$zr");
+    btui_flush(bt);
+    check("a frame drawn after an escape sequence BTUI can't follow to be redrawn", cell(bt, 0, 0)->glyph == 'r');
+    btui_disable(bt);
+}
+
+// Closing a headless BTUI without cleaning up still has to close its files:
+static void check_force_close(void)
+{
+    int before = dup(0);
+    close(before);
+    btui_t *bt = btui_create_headless(20, 5);
+    if (!bt) exit(1);
+    btui_vt_type(bt->vt, "x", 1);
+    btui_force_close(bt);
+    int after = dup(0);
+    close(after);
+    check("btui_force_close() to close a headless BTUI's files", after == before);
+}
+
+int main(void)
+{
+    btui_init_tables();
+    check_hud();
+    check_fill_box();
+    check_create_fd();
+    check_vt_line();
+    check_loop();
+    check_stats();
+    check_signal_writer();
+    check_retained_escapes();
+    check_force_close();
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
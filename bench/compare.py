@@ -0,0 +1,48 @@
+#!/usr/bin/env python3
+"""
+Compare rendering benchmark results (from `./render --json`) against a stored
+baseline and report any regressions. Bytes, writes and escape sequences per
+frame are deterministic, so any increase is a regression. Timings are noisy,
+so they only count as a regression past a threshold (25% by default).
+
+Usage: compare.py baseline.json results.json [--threshold PERCENT]
+Exits with status 1 if anything regressed.
+"""
+import json
+import sys
+
+COUNTS = ("bytes_per_frame", "writes_per_frame", "sequences_per_frame")
+
+def main():
+    args = sys.argv[1:]
+    threshold = 25.0
+    if "--threshold" in args:
+        i = args.index("--threshold")
+        threshold = float(args[i + 1])
+        del args[i:i + 2]
+    if len(args) != 2:
+        print(__doc__.strip(), file=sys.stderr)
+        sys.exit(2)
+    with open(args[0]) as f:
+        baseline = {r["name"]: r for r in json.load(f)["results"]}
+    with open(args[1]) as f:
+        results = json.load(f)["results"]
+
+    regressed = False
+    print(f"{'workload':<12} {'metric':<20} {'baseline':>12} {'current':>12} {'change':>9}")
+    for result in results:
+        old = baseline.get(result["name"])
+        if old is None:
+            print(f"{result['name']:<12} (not in baseline)")
+            continue
+        for metric in ("ns_per_cell",) + COUNTS:
+            before, after = old[metric], result[metric]
+            change = (after - before) / before * 100.0 if before else (0.0 if after == before else float("inf"))
+            worse = change > threshold if metric == "ns_per_cell" else after > before
+            regressed = regressed or worse
+            print(f"{result['name']:<12} {metric:<20} {before:>12.3f} {after:>12.3f} {change:>+8.1f}%"
+                  + ("  REGRESSION" if worse else ""))
+    sys.exit(1 if regressed else 0)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,88 @@
+/*
+ * This file contains a microbenchmark that compares BTUI's escape sequence
+ * encoder against the fprintf() calls it replaced.
+ */
+#include <stdio.h>
+#include "btui.h"
+
+#define ITERATIONS 2000000
+
+// The fprintf() versions of the encoding functions:
+static int fprintf_move_cursor(FILE *out, int x, int y)
+{
+    return fprintf(out, "\033[%d;%dH", y+1, x+1);
+}
+
+static int fprintf_set_fg(FILE *out, unsigned char r, unsigned char g, unsigned char b)
+{
+    return fprintf(out, "\033[38;2;%d;%d;%dm", r, g, b);
+}
+
+static int fprintf_set_bg_hex(FILE *out, int hex)
+{
+    return fprintf(out, "\033[48;2;%d;%d;%dm", (hex >> 16) & 0xFF, (hex >> 8) & 0xFF, hex & 0xFF);
+}
+
+static int fprintf_scroll(FILE *out, int firstline, int lastline, int scroll_amount)
+{
+    return fprintf(out, "\033[%d;%dr\033[%dS\033[r", firstline+1, lastline+1, scroll_amount);
+}
+
+static int fprintf_set_cursor(FILE *out, cursor_t cur)
+{
+    return fprintf(out, "\033[%u q", cur);
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+static void report(const char *name, double fprintf_ns, double btui_ns)
+{
+    printf("%-18s %10.1f %10.1f %8.2fx\n", name, fprintf_ns / ITERATIONS,
+           btui_ns / ITERATIONS, fprintf_ns / btui_ns);
+}
+
+int main(void)
+{
+    FILE *devnull = fopen("/dev/null", "w");
+    if (!devnull) return 1;
+    btui_init_tables();
+    btui_t bt = {0};
+    bt.out = fopen("/dev/null", "w");
+    if (!bt.out) return 1;
+
+    printf("%-18s %10s %10s %9s\n", "function", "fprintf ns", "btui ns", "speedup");
+    double t0, t1, t2;
+    int x = 0;
+
+#define BENCH(name, old_call, new_call) \
+    t0 = now(); \
+    for (int i = 0; i < ITERATIONS; i++) x += old_call; \
+    t1 = now(); \
+    for (int i = 0; i < ITERATIONS; i++) { \
+        x += new_call; \
+        if (bt.outlen > (1 << 16)) btui_flush(&bt); \
+    } \
+    btui_flush(&bt); \
+    t2 = now(); \
+    report(name, t1 - t0, t2 - t1)
+
+    BENCH("btui_move_cursor", fprintf_move_cursor(devnull, i % 211, i % 61),
+          btui_move_cursor(&bt, i % 211, i % 61));
+    BENCH("btui_set_fg", fprintf_set_fg(devnull, (unsigned char)i, (unsigned char)(i >> 8), (unsigned char)(i >> 16)),
+          btui_set_fg(&bt, (unsigned char)i, (unsigned char)(i >> 8), (unsigned char)(i >> 16)));
+    BENCH("btui_set_bg_hex", fprintf_set_bg_hex(devnull, (int)((unsigned int)i * 7919u & 0xFFFFFFu)),
+          btui_set_bg_hex(&bt, (int)((unsigned int)i * 7919u & 0xFFFFFFu)));
+    BENCH("btui_scroll", fprintf_scroll(devnull, 1, 40 + i % 20, 1 + i % 3),
+          btui_scroll(&bt, 1, 40 + i % 20, 1 + i % 3));
+    BENCH("btui_set_cursor", fprintf_set_cursor(devnull, (cursor_t)(i % 7)), btui_set_cursor(&bt, (cursor_t)(i % 7)));
+
+    fclose(devnull);
+    fclose(bt.out);
+    free(bt.outbuf);
+    return x == 0;
+}
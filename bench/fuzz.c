@@ -0,0 +1,189 @@
+/*
+ * This file contains a fuzz target for BTUI's input parser (btui_getkeys()).
+ * Each input is fed through the parser, and every event that comes out is
+ * checked for sanity (a valid key code, only modifier bits in the modifiers,
+ * and a mouse position only for mouse events). Raw bytes above 0x7F share
+ * their codes with special keys, so they're allowed to look like mouse or
+ * resize events without a position. A hang is caught by the fuzzer's timeout
+ * (or an alarm() in standalone mode).
+ *
+ * Build with `make fuzz-libfuzzer` for libFuzzer, or `make fuzz CC=afl-cc` for
+ * AFL (which runs `./fuzz @@`). Without any arguments, `./fuzz` runs its own
+ * fuzzer: it generates streams of known key and mouse sequences and checks
+ * that they parse to exactly the expected events, then checks the same
+ * streams again with random bytes spliced in. Anything that fails is saved in
+ * `fuzz-crash` so it can be replayed with `./fuzz fuzz-crash`.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include "btui.h"
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#define MODMASK (MOD_META | MOD_CTRL | MOD_ALT | MOD_SHIFT)
+
+static FILE *input;
+static btui_event_t events[1 << 16];
+
+/*
+ * Parse `data` and store the events in `events`, returning how many there
+ * were. Any event that doesn't make sense is a bug, so it aborts.
+ */
+static size_t parse(const uint8_t *data, size_t size)
+{
+    // Input comes from a temporary file, which is as close to a terminal as
+    // the parser can tell, without the size limit of a pipe:
+    if (!input && !(input = tmpfile())) exit(1);
+    if (ftruncate(fileno(input), 0) || pwrite(fileno(input), data, size, 0) != (ssize_t)size
+        || lseek(fileno(input), 0, SEEK_SET) != 0)
+        exit(1);
+
+    btui_t bt = {0};
+    bt.in = input;
+    size_t n = 0;
+    int got;
+    while ((got = btui_getkeys(&bt, &events[n], sizeof(events)/sizeof(events[0]) - n, 0)) > 0) {
+        for (size_t i = n; i < n + (size_t)got; i++) {
+            btui_event_t *e = &events[i];
+            int is_mouse = MOUSE_LEFT_PRESS <= e->key && e->key <= MOUSE_WHEEL_PRESS;
+            if (e->key < 0 || e->key > 0xFF || (e->modifiers & ~MODMASK)
+                || e->count != 1 || (!is_mouse && (e->x != -1 || e->y != -1)) || e->x < -1 || e->y < -1)
+                abort();
+        }
+        n += (size_t)got;
+        if (n > size) abort(); // Every event takes at least one byte
+        if (n == sizeof(events)/sizeof(events[0])) n = 0;
+    }
+    return n;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    (void)parse(data, size);
+    return 0;
+}
+
+#ifndef BTUI_LIBFUZZER
+static uint8_t *current;
+static size_t current_size;
+
+// Save the input that caused a failure:
+static void save_crash(int sig)
+{
+    int fd = open("fuzz-crash", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        if (write(fd, current, current_size) < 0) {}
+        close(fd);
+    }
+    const char *msg = sig == SIGALRM ? "Hang! Input saved in fuzz-crash\n" : "Bad parse! Input saved in fuzz-crash\n";
+    if (write(STDERR_FILENO, msg, strlen(msg)) < 0) {}
+    _exit(1);
+}
+
+static unsigned int seed = 12345;
+static unsigned int rng(void)
+{
+    seed = seed * 1103515245u + 12345u;
+    return (seed >> 16) & 0x7FFF;
+}
+
+// Sequences with known meanings, to check that valid input parses correctly:
+static const struct {
+    const char *bytes;
+    int key, modifiers, x, y;
+} known[] = {
+    {"a", 'a', 0, -1, -1}, {"\r", KEY_ENTER, 0, -1, -1}, {"\x7f", KEY_BACKSPACE2, 0, -1, -1},
+    {"\xc3", 0xC3, 0, -1, -1}, {"\xff", 0xFF, 0, -1, -1},
+    {"\x1b[A", KEY_ARROW_UP, 0, -1, -1}, {"\x1b[D", KEY_ARROW_LEFT, 0, -1, -1},
+    {"\x1b[1;5C", KEY_ARROW_RIGHT, MOD_CTRL, -1, -1}, {"\x1b[H", KEY_HOME, 0, -1, -1},
+    {"\x1b[3~", KEY_DELETE, 0, -1, -1}, {"\x1b[3;5~", KEY_DELETE, MOD_CTRL, -1, -1},
+    {"\x1b[6~", KEY_PGDN, 0, -1, -1}, {"\x1b[15~", KEY_F5, 0, -1, -1},
+    {"\x1b[24~", KEY_F12, 0, -1, -1}, {"\x1bOP", KEY_F1, 0, -1, -1}, {"\x1b[Z", KEY_TAB, MOD_SHIFT, -1, -1},
+    {"\033x", 'x', MOD_ALT, -1, -1},
+    {"\x1b[<0;3;4M", MOUSE_LEFT_PRESS, 0, 2, 3}, {"\x1b[<16;1;1M", MOUSE_LEFT_PRESS, MOD_CTRL, 0, 0},
+    {"\x1b[<32;200;50M", MOUSE_LEFT_DRAG, 0, 199, 49}, {"\x1b[<64;9;9M", MOUSE_WHEEL_RELEASE, 0, 8, 8},
+    {"\x1b[<65;1;99999999999M", MOUSE_WHEEL_PRESS, 0, 0, BTUI_MAX_PARAM - 1},
+    {"\x1b[1;99999999999A", KEY_ARROW_UP, 0, -1, -1},
+};
+
+static void check(const char *what, int ok)
+{
+    if (!ok) {
+        fprintf(stderr, "Expected %s\n", what);
+        save_crash(0);
+    }
+}
+
+static void fuzz(long iterations)
+{
+    static uint8_t buf[1 << 14];
+    static size_t expected[1 << 12];
+    current = buf;
+    for (long iteration = 0; iteration < iterations; iteration++) {
+        // A stream of known sequences:
+        size_t len = 0, count = 0;
+        while (count < sizeof(expected)/sizeof(expected[0]) && len + 32 < sizeof(buf) && rng() % 64 != 0) {
+            size_t k = rng() % (sizeof(known)/sizeof(known[0]));
+            expected[count++] = k;
+            size_t n = strlen(known[k].bytes);
+            memcpy(&buf[len], known[k].bytes, n);
+            len += n;
+        }
+        current_size = len;
+        alarm(5);
+        size_t n = parse(buf, len);
+        check("the right number of events", n == count);
+        for (size_t i = 0; i < n; i++) {
+            check("the right key", events[i].key == known[expected[i]].key);
+            check("the right modifiers", events[i].modifiers == known[expected[i]].modifiers);
+            check("the right mouse position", events[i].x == known[expected[i]].x && events[i].y == known[expected[i]].y);
+        }
+
+        // The same stream with random mutations, which only has to parse
+        // sensibly:
+        for (int m = (int)(rng() % 8); m >= 0 && len > 0; m--) {
+            switch (rng() % 4) {
+                case 0: buf[rng() % len] = (uint8_t)rng(); break;
+                case 1: buf[rng() % len] = (uint8_t)"\x1b[;<0123456789~MmO"[rng() % 18]; break;
+                case 2: len = rng() % len; break;
+                default: {
+                    size_t i = rng() % len, j = rng() % len;
+                    buf[i] = buf[j];
+                    break;
+                }
+            }
+        }
+        current_size = len;
+        (void)parse(buf, len);
+        alarm(0);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    signal(SIGALRM, save_crash);
+    signal(SIGABRT, save_crash);
+    if (argc <= 1) {
+        long iterations = 200000;
+        fuzz(iterations);
+        printf("%ld inputs parsed without any problems\n", iterations);
+        return 0;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        FILE *f = strcmp(argv[i], "-") == 0 ? stdin : fopen(argv[i], "r");
+        if (!f) {
+            fprintf(stderr, "Couldn't open %s\n", argv[i]);
+            return 1;
+        }
+        static uint8_t buf[1 << 20];
+        size_t len = fread(buf, 1, sizeof(buf), f);
+        if (f != stdin) fclose(f);
+        current = buf, current_size = len;
+        alarm(5);
+        (void)parse(buf, len);
+        alarm(0);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,168 @@
+/*
+ * This file contains a benchmark of BTUI's input parser (btui_getkeys()). It
+ * feeds a few kinds of synthetic input streams (typing, keys with modifiers,
+ * floods of SGR mouse events, large pastes, and a mix of all of them) through
+ * the parser from a temporary file, and reports the throughput in MB/s and
+ * events per second. Any recorded input streams given as arguments (e.g. from
+ * `script -I`) are benchmarked too. For the synthetic streams, the number of
+ * events parsed is checked against the number that were generated, so a
+ * misparse shows up as a mismatch.
+ */
+#include <stdio.h>
+#include "btui.h"
+
+#define STREAM_SIZE (4 << 20)
+#define REPEATS 5
+
+typedef struct {
+    char *data;
+    size_t len, capacity;
+    long events;
+} stream_t;
+
+static void append(stream_t *s, const char *bytes, size_t len, long events)
+{
+    if (s->len + len > s->capacity) {
+        s->capacity = 2*(s->len + len);
+        s->data = realloc(s->data, s->capacity);
+        if (!s->data) exit(1);
+    }
+    memcpy(&s->data[s->len], bytes, len);
+    s->len += len;
+    s->events += events;
+}
+
+static unsigned int seed = 12345;
+static unsigned int rng(void)
+{
+    seed = seed * 1103515245u + 12345u;
+    return (seed >> 16) & 0x7FFF;
+}
+
+// Plain text with the occasional Enter, Backspace or Ctrl key:
+static void gen_typing(stream_t *s)
+{
+    static const char words[] = "the quick brown fox jumps over the lazy dog ";
+    size_t i = rng() % (sizeof(words) - 1);
+    append(s, &words[i], 1, 1);
+    switch (rng() % 40) {
+        case 0: append(s, "\r", 1, 1); break;
+        case 1: append(s, "\x7f", 1, 1); break;
+        case 2: append(s, "\x03", 1, 1); break;
+        default: break;
+    }
+}
+
+// Arrows, function keys and editing keys, with and without modifiers:
+static void gen_keys(stream_t *s)
+{
+    static const char *keys[] = {
+        "\x1b[A", "\x1b[B", "\x1b[C", "\x1b[D", "\x1b[H", "\x1b[F", "\x1b[1;5A", "\x1b[1;5D",
+        "\x1b[1;3C", "\x1b[1;2B", "\x1b[2~", "\x1b[3~", "\x1b[5~", "\x1b[6~", "\x1b[15~",
+        "\x1b[24~", "\x1b[3;5~", "\x1bOP", "\x1bOS", "\x1b[Z", "\033x", "\033b",
+    };
+    const char *key = keys[rng() % (sizeof(keys)/sizeof(keys[0]))];
+    append(s, key, strlen(key), 1);
+}
+
+// Mouse drags and wheel scrolls, as sent when the mouse moves quickly:
+static void gen_mouse(stream_t *s)
+{
+    char buf[64];
+    int buttons = (int[]){32, 32, 32, 34, 64, 65, 0, 48}[rng() % 8];
+    int len = sprintf(buf, "\x1b[<%d;%u;%uM", buttons, 1 + rng() % 300, 1 + rng() % 100);
+    append(s, buf, (size_t)len, 1);
+}
+
+// A large bracketed paste of multilingual text:
+static void gen_paste(stream_t *s)
+{
+    static const char text[] = "Lorem ipsum dolor sit amet, consectetur adipiscing elit.\n"
+        "Ça va très bien, merci. Привет, мир! こんにちは世界 🎉\n";
+    append(s, "\x1b[200~", 6, 0); // Unrecognized, so it produces no event
+    for (int i = 0; i < 100; i++)
+        append(s, text, sizeof(text) - 1, (long)sizeof(text) - 1);
+    append(s, "\x1b[201~", 6, 0);
+}
+
+static void gen_mixed(stream_t *s)
+{
+    switch (rng() % 10) {
+        case 0: case 1: case 2: case 3: gen_typing(s); break;
+        case 4: case 5: gen_keys(s); break;
+        case 6: case 7: case 8: gen_mouse(s); break;
+        default: if (rng() % 100 == 0) gen_paste(s); else gen_typing(s); break;
+    }
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+static void bench(const char *name, stream_t *s)
+{
+    // A temporary file stays in the page cache, so reads are just memcpy()s:
+    FILE *in = tmpfile();
+    if (!in || fwrite(s->data, 1, s->len, in) != s->len || fflush(in)) exit(1);
+
+    static btui_event_t events[256];
+    double best = -1;
+    long parsed = 0;
+    for (int i = 0; i < REPEATS; i++) {
+        btui_t bt = {0};
+        bt.in = in;
+        if (lseek(fileno(in), 0, SEEK_SET) != 0) exit(1);
+        parsed = 0;
+        double start = now();
+        int n;
+        while ((n = btui_getkeys(&bt, events, sizeof(events)/sizeof(events[0]), 0)) > 0)
+            parsed += n;
+        double elapsed = now() - start;
+        if (best < 0 || elapsed < best) best = elapsed;
+    }
+    fclose(in);
+
+    printf("%-12s %10.1f %10.2f %12.1f %12ld", name, (double)s->len / (best / 1e9) / (1 << 20),
+           (double)parsed / (best / 1e9) / 1e6, best / (double)parsed, parsed);
+    if (s->events >= 0 && parsed != s->events)
+        printf("  MISPARSED (expected %ld events)", s->events);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    static const struct { const char *name; void (*gen)(stream_t *s); } generators[] = {
+        {"typing", gen_typing}, {"keys", gen_keys}, {"mouse", gen_mouse},
+        {"paste", gen_paste}, {"mixed", gen_mixed},
+    };
+    printf("%-12s %10s %10s %12s %12s\n", "stream", "MB/s", "Mevents/s", "ns/event", "events");
+    for (size_t i = 0; i < sizeof(generators)/sizeof(generators[0]); i++) {
+        stream_t s = {0};
+        while (s.len < STREAM_SIZE)
+            generators[i].gen(&s);
+        bench(generators[i].name, &s);
+        free(s.data);
+    }
+
+    // Recorded input streams:
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "r");
+        if (!f) {
+            fprintf(stderr, "Couldn't open %s\n", argv[i]);
+            return 1;
+        }
+        stream_t s = {0};
+        char buf[1 << 16];
+        size_t len;
+        while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+            append(&s, buf, len, 0);
+        fclose(f);
+        s.events = -1;
+        bench(argv[i], &s);
+        free(s.data);
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * This file contains a microbenchmark that compares BTUI's table-based key
+ * name lookups (btui_keyname() and btui_keynamed()) against the linear scans
+ * over key_names[] that they replaced. This is the per-event cost that the
+ * Python and Lua bindings pay to turn key codes into names.
+ */
+#include <stdio.h>
+#include "btui.h"
+
+#define ITERATIONS 2000000
+
+// The linear scan versions of the lookup functions:
+static char *linear_keyname(int key, char *buf)
+{
+    if (key == -1) return buf + sprintf(buf, "<none>");
+    if (key & MOD_META) buf = stpcpy(buf, "Super-");
+    if (key & MOD_CTRL) buf = stpcpy(buf, "Ctrl-");
+    if (key & MOD_ALT) buf = stpcpy(buf, "Alt-");
+    if (key & MOD_SHIFT) buf = stpcpy(buf, "Shift-");
+    key &= ~(MOD_META | MOD_CTRL | MOD_ALT | MOD_SHIFT);
+    for (size_t i = 0; i < sizeof(key_names)/sizeof(key_names[0]); i++) {
+        if (key_names[i].key == key)
+            return stpcpy(buf, key_names[i].name);
+    }
+    if (' ' < key && key <= '~')
+        return buf + sprintf(buf, "%c", key);
+    else
+        return buf + sprintf(buf, "\\x%02X", (unsigned int)key);
+}
+
+static int linear_keynamed(const char *name)
+{
+    int modifiers = 0;
+    static const struct { const char *prefix; int modifier; } modnames[] = {
+        {"Super-", MOD_META}, {"Ctrl-", MOD_CTRL}, {"Alt-", MOD_ALT}, {"Shift-", MOD_SHIFT}
+    };
+  check_names:
+    for (size_t i = 0; i < sizeof(key_names)/sizeof(key_names[0]); i++) {
+        if (strcmp(key_names[i].name, name) == 0)
+            return modifiers | key_names[i].key;
+    }
+    for (size_t i = 0; i < sizeof(modnames)/sizeof(modnames[0]); i++) {
+        if (strncmp(name, modnames[i].prefix, strlen(modnames[i].prefix)) == 0) {
+            modifiers |= modnames[i].modifier;
+            name += strlen(modnames[i].prefix);
+            goto check_names;
+        }
+    }
+    return strlen(name) == 1 ? name[0] : -1;
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+static void report(const char *name, double linear_ns, double btui_ns)
+{
+    printf("%-18s %10.1f %10.1f %8.2fx\n", name, linear_ns / ITERATIONS,
+           btui_ns / ITERATIONS, linear_ns / btui_ns);
+}
+
+int main(void)
+{
+    // A typical mix of input events: typing, arrow keys, and mouse activity
+    static const int keys[] = {
+        'a', 'e', 'Q', KEY_SPACE, KEY_ENTER, KEY_BACKSPACE2, KEY_ARROW_UP, KEY_ARROW_DOWN,
+        MOD_CTRL | KEY_ARROW_LEFT, MOUSE_LEFT_DRAG, MOUSE_LEFT_DRAG, MOUSE_WHEEL_PRESS,
+        MOUSE_LEFT_PRESS, MOUSE_LEFT_RELEASE, KEY_F5, KEY_CTRL_C,
+    };
+    enum { NUM_KEYS = sizeof(keys)/sizeof(keys[0]) };
+    char names[NUM_KEYS][64];
+    for (int i = 0; i < NUM_KEYS; i++)
+        btui_keyname(keys[i], names[i]);
+
+    printf("%-18s %10s %10s %9s\n", "function", "linear ns", "btui ns", "speedup");
+    double t0, t1, t2;
+    int x = 0;
+    char buf[64];
+
+#define BENCH(name, old_call, new_call) \
+    t0 = now(); \
+    for (int i = 0; i < ITERATIONS; i++) x += (int)(old_call - buf); \
+    t1 = now(); \
+    for (int i = 0; i < ITERATIONS; i++) x += (int)(new_call - buf); \
+    t2 = now(); \
+    report(name, t1 - t0, t2 - t1)
+
+    BENCH("btui_keyname", linear_keyname(keys[i % NUM_KEYS], buf),
+          btui_keyname(keys[i % NUM_KEYS], buf));
+    BENCH("btui_keynamed", (buf + linear_keynamed(names[i % NUM_KEYS])),
+          (buf + btui_keynamed(names[i % NUM_KEYS])));
+
+    return x == 0;
+}
@@ -0,0 +1,196 @@
+/*
+ * This file contains a benchmark of BTUI's rendering for a few typical
+ * workloads. For each one, it reports the time per screen cell (drawing into
+ * /dev/null, best of several runs) and the bytes, writes and escape sequences
+ * per frame (counted by a headless virtual terminal). Results can be printed as
+ * a table, JSON or CSV, and bench/compare.py compares JSON results against a
+ * stored baseline.
+ */
+#include <stdio.h>
+#include "btui.h"
+
+#define WIDTH 200
+#define HEIGHT 50
+#define FRAMES 200
+#define REPEATS 5
+
+typedef struct {
+    const char *name;
+    int retained;
+    void (*draw)(btui_t *bt, int frame);
+} workload_t;
+
+// A full screen color gradient, like the rainbow demo:
+static void draw_rainbow(btui_t *bt, int frame)
+{
+    for (int y = 0; y < HEIGHT; y++) {
+        btui_move_cursor(bt, 0, y);
+        for (int x = 0; x < WIDTH; x++) {
+            btui_set_bg(bt, (unsigned char)(x + frame), (unsigned char)(y * 4 + frame), (unsigned char)(x + y));
+            btui_puts(bt, " ");
+        }
+    }
+}
+
+// Fill the whole screen with a different background color each frame:
+static void draw_fill_box(btui_t *bt, int frame)
+{
+    btui_set_bg_hex(bt, (frame * 0x123457) & 0xFFFFFF);
+    btui_fill_box(bt, 0, 0, WIDTH, HEIGHT);
+}
+
+// Text where nearly every character has different attributes:
+static void draw_attributes(btui_t *bt, int frame)
+{
+    static const attr_t attrs[] = {BTUI_BOLD, BTUI_UNDERLINE, BTUI_REVERSE, BTUI_ITALIC, BTUI_FAINT};
+    for (int y = 0; y < HEIGHT; y++) {
+        btui_move_cursor(bt, 0, y);
+        for (int x = 0; x < WIDTH; x++) {
+            int n = x * 7 + y * 13 + frame;
+            btui_set_attributes(bt, BTUI_NORMAL | attrs[n % 5] | (BTUI_FG_BLACK << (n % 8)));
+            char c = (char)('a' + n % 26);
+            btui_write(bt, &c, 1);
+        }
+    }
+    btui_set_attributes(bt, BTUI_NORMAL);
+}
+
+// A grid of outlined boxes with shadows:
+static void draw_linebox(btui_t *bt, int frame)
+{
+    btui_clear(bt, BTUI_CLEAR_SCREEN);
+    for (int y = 1; y + 6 < HEIGHT; y += 8) {
+        for (int x = 1 + frame % 3; x + 22 < WIDTH; x += 25) {
+            btui_set_attributes(bt, BTUI_NORMAL);
+            btui_draw_linebox(bt, x, y, 20, 4);
+            btui_set_attributes(bt, BTUI_FG_BLACK);
+            btui_draw_shadow(bt, x, y, 20, 4);
+        }
+    }
+    btui_set_attributes(bt, BTUI_NORMAL);
+}
+
+// A log that scrolls up by a line each frame:
+static void draw_scrolling(btui_t *bt, int frame)
+{
+    for (int y = 0; y < HEIGHT; y++) {
+        int line = frame + y;
+        btui_move_cursor(bt, 0, y);
+        btui_set_attributes(bt, BTUI_NORMAL | (line % 5 == 0 ? BTUI_FG_RED : BTUI_FG_NORMAL));
+        btui_printf(bt, "%08d [%s] request %d took %d ms", line, line % 5 == 0 ? "ERROR" : "info", line * 7919 % 10007, line % 97);
+        btui_clear(bt, BTUI_CLEAR_RIGHT);
+    }
+}
+
+// A mostly static screen where a few cells change each frame:
+static void draw_sparse(btui_t *bt, int frame)
+{
+    if (frame == 0) {
+        for (int y = 0; y < HEIGHT; y++) {
+            btui_move_cursor(bt, 0, y);
+            for (int x = 0; x < WIDTH; x += 10)
+                btui_puts(bt, "..........");
+        }
+    }
+    for (int i = 0; i < 20; i++) {
+        int n = (frame * 20 + i) * 7919;
+        btui_move_cursor(bt, n % WIDTH, (n / WIDTH) % HEIGHT);
+        btui_printf(bt, "%c", "*+o."[(frame + i) % 4]);
+    }
+}
+
+static const workload_t workloads[] = {
+    {"rainbow", 0, draw_rainbow},
+    {"fill_box", 0, draw_fill_box},
+    {"attributes", 0, draw_attributes},
+    {"linebox", 0, draw_linebox},
+    {"scrolling", 1, draw_scrolling},
+    {"sparse", 1, draw_sparse},
+};
+
+typedef struct {
+    double ns_per_cell, bytes_per_frame, writes_per_frame, sequences_per_frame;
+} result_t;
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+static void run(btui_t *bt, const workload_t *w)
+{
+    btui_set_retained(bt, w->retained);
+    for (int frame = 0; frame < FRAMES; frame++) {
+        w->draw(bt, frame);
+        btui_flush(bt);
+    }
+    btui_set_retained(bt, 0);
+}
+
+static void bench(const workload_t *w, result_t *result)
+{
+    // Timings are noisy, so the fastest run is the most representative:
+    result->ns_per_cell = -1;
+    for (int i = 0; i < REPEATS; i++) {
+        btui_t bt = {0};
+        bt.out = fopen("/dev/null", "w");
+        if (!bt.out) exit(1);
+        bt.width = WIDTH, bt.height = HEIGHT;
+        bt.cursor_x = bt.cursor_y = -1;
+        btui_set_color_depth(&bt, BTUI_COLORS_TRUECOLOR);
+        btui_set_capabilities(&bt, BTUI_CAP_ECH | BTUI_CAP_REP | BTUI_CAP_RECT);
+        double start = now();
+        run(&bt, w);
+        double ns = (now() - start) / FRAMES / (WIDTH * HEIGHT);
+        if (result->ns_per_cell < 0 || ns < result->ns_per_cell)
+            result->ns_per_cell = ns;
+        fclose(bt.out);
+        free(bt.outbuf);
+    }
+
+    btui_t *headless = btui_create_headless(WIDTH, HEIGHT);
+    if (!headless) exit(1);
+    uint64_t bytes = headless->vt->bytes, writes = headless->vt->writes, sequences = headless->vt->sequences;
+    run(headless, w);
+    result->bytes_per_frame = (double)(headless->vt->bytes - bytes) / FRAMES;
+    result->writes_per_frame = (double)(headless->vt->writes - writes) / FRAMES;
+    result->sequences_per_frame = (double)(headless->vt->sequences - sequences) / FRAMES;
+    btui_disable(headless);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *format = argc > 1 ? argv[1] : "--table";
+    if (strcmp(format, "--table") != 0 && strcmp(format, "--json") != 0 && strcmp(format, "--csv") != 0) {
+        fprintf(stderr, "Usage: %s [--table|--json|--csv]\n", argv[0]);
+        return 1;
+    }
+    btui_init_tables();
+    size_t n = sizeof(workloads)/sizeof(workloads[0]);
+    result_t results[sizeof(workloads)/sizeof(workloads[0])];
+    for (size_t i = 0; i < n; i++)
+        bench(&workloads[i], &results[i]);
+
+    if (strcmp(format, "--json") == 0) {
+        printf("{\"width\": %d, \"height\": %d, \"frames\": %d, \"results\": [\n", WIDTH, HEIGHT, FRAMES);
+        for (size_t i = 0; i < n; i++)
+            printf("  {\"name\": \"%s\", \"ns_per_cell\": %.3f, \"bytes_per_frame\": %.1f, "
+                   "\"writes_per_frame\": %.2f, \"sequences_per_frame\": %.1f}%s\n",
+                   workloads[i].name, results[i].ns_per_cell, results[i].bytes_per_frame,
+                   results[i].writes_per_frame, results[i].sequences_per_frame, i + 1 < n ? "," : "");
+        printf("]}\n");
+    } else if (strcmp(format, "--csv") == 0) {
+        printf("name,ns_per_cell,bytes_per_frame,writes_per_frame,sequences_per_frame\n");
+        for (size_t i = 0; i < n; i++)
+            printf("%s,%.3f,%.1f,%.2f,%.1f\n", workloads[i].name, results[i].ns_per_cell,
+                   results[i].bytes_per_frame, results[i].writes_per_frame, results[i].sequences_per_frame);
+    } else {
+        printf("%-12s %12s %12s %12s %12s\n", "workload", "ns/cell", "bytes/frame", "writes/frame", "seqs/frame");
+        for (size_t i = 0; i < n; i++)
+            printf("%-12s %12.3f %12.1f %12.2f %12.1f\n", workloads[i].name, results[i].ns_per_cell,
+                   results[i].bytes_per_frame, results[i].writes_per_frame, results[i].sequences_per_frame);
+    }
+    return 0;
+}
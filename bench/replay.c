@@ -0,0 +1,191 @@
+/*
+ * This file contains a tool that replays a trace recorded with BTUI_TRACE (or
+ * btui_trace_dump(), or any asciicast v2 file) through a headless BTUI: output
+ * is fed to the virtual terminal and input is parsed into events, either as
+ * fast as possible or at the recorded speed. It reports how much output and
+ * input there was, the busiest second of output (the bandwidth the session
+ * actually needed), and how long the replay took, and it can print the screen
+ * as it was at the end.
+ *
+ * Usage: replay [--realtime] [--screen] trace.cast
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include "btui.h"
+
+/*
+ * Parse the JSON string starting at `p` (just after the opening quote) into
+ * `out`, and return the number of bytes it decoded to. Escaped characters up
+ * to U+00FF are single bytes, since that's how btui_trace_dump() writes bytes
+ * that aren't valid UTF-8.
+ */
+static size_t parse_string(const char *p, char *out)
+{
+    char *start = out;
+    while (*p && *p != '"') {
+        if (*p != '\\') {
+            *out++ = *p++;
+            continue;
+        }
+        switch (*++p) {
+            case 'n': *out++ = '\n'; break;
+            case 'r': *out++ = '\r'; break;
+            case 't': *out++ = '\t'; break;
+            case 'b': *out++ = '\b'; break;
+            case 'f': *out++ = '\f'; break;
+            case 'u': {
+                unsigned int c = (unsigned int)strtoul((char[5]){p[1], p[2], p[3], p[4], '\0'}, NULL, 16);
+                p += 4;
+                if (0xD800 <= c && c < 0xDC00 && p[1] == '\\' && p[2] == 'u') {
+                    unsigned int low = (unsigned int)strtoul((char[5]){p[3], p[4], p[5], p[6], '\0'}, NULL, 16);
+                    c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                if (c < 0x100) {
+                    *out++ = (char)c;
+                } else if (c < 0x800) {
+                    *out++ = (char)(0xC0 | (c >> 6));
+                    *out++ = (char)(0x80 | (c & 0x3F));
+                } else if (c < 0x10000) {
+                    *out++ = (char)(0xE0 | (c >> 12));
+                    *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+                    *out++ = (char)(0x80 | (c & 0x3F));
+                } else {
+                    *out++ = (char)(0xF0 | (c >> 18));
+                    *out++ = (char)(0x80 | ((c >> 12) & 0x3F));
+                    *out++ = (char)(0x80 | ((c >> 6) & 0x3F));
+                    *out++ = (char)(0x80 | (c & 0x3F));
+                }
+                break;
+            }
+            case '\0': return (size_t)(out - start);
+            default: *out++ = *p; break;
+        }
+        ++p;
+    }
+    return (size_t)(out - start);
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[])
+{
+    int realtime = 0, screen = 0;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--realtime") == 0) realtime = 1;
+        else if (strcmp(argv[i], "--screen") == 0) screen = 1;
+        else path = argv[i];
+    }
+    if (!path) {
+        fprintf(stderr, "Usage: %s [--realtime] [--screen] trace.cast\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Couldn't open %s\n", path);
+        return 1;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    int width = 80, height = 24;
+    if (getline(&line, &size, f) <= 0) {
+        fprintf(stderr, "%s is empty\n", path);
+        return 1;
+    }
+    char *w = strstr(line, "\"width\":"), *h = strstr(line, "\"height\":");
+    if (w) width = atoi(w + strlen("\"width\":"));
+    if (h) height = atoi(h + strlen("\"height\":"));
+
+    btui_init_tables();
+    btui_t *bt = btui_create_headless(width, height);
+    if (!bt) return 1;
+    // Only count what's replayed, not BTUI's own setup:
+    uint64_t sequences = bt->vt->sequences, printed = bt->vt->printed;
+
+    uint64_t out_bytes = 0, out_chunks = 0, in_bytes = 0, in_chunks = 0, events = 0, resizes = 0;
+    uint64_t largest = 0, second_bytes = 0, busiest = 0;
+    double duration = 0, second = 0, start = now();
+    char *data = NULL;
+    ssize_t len;
+    while ((len = getline(&line, &size, f)) > 0) {
+        double t;
+        char kind;
+        int n;
+        if (sscanf(line, "[%lf, \"%c\", \"%n", &t, &kind, &n) < 2) continue;
+        char *buf = realloc(data, (size_t)len);
+        if (!buf) return 1;
+        data = buf;
+        size_t datalen = parse_string(&line[n], data);
+        duration = t;
+
+        if (realtime) {
+            double delay = start + t - now();
+            if (delay > 0) {
+                struct timespec ts = {.tv_sec = (time_t)delay, .tv_nsec = (long)((delay - (double)(time_t)delay) * 1e9)};
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        switch (kind) {
+            case 'o':
+                btui_vt_feed(bt->vt, data, datalen);
+                out_bytes += datalen;
+                ++out_chunks;
+                if (datalen > largest) largest = datalen;
+                if (t >= second + 1.0) {
+                    second = t;
+                    second_bytes = 0;
+                }
+                second_bytes += datalen;
+                if (second_bytes > busiest) busiest = second_bytes;
+                break;
+            case 'i':
+                in_bytes += datalen;
+                ++in_chunks;
+                // Small pieces, so the pipe to the parser never fills up:
+                for (size_t sent = 0; sent < datalen; sent += 4096) {
+                    btui_vt_type(bt->vt, &data[sent], datalen - sent < 4096 ? datalen - sent : 4096);
+                    btui_event_t ev[256];
+                    int got;
+                    while ((got = btui_getkeys(bt, ev, sizeof(ev)/sizeof(ev[0]), 0)) > 0)
+                        events += (uint64_t)got;
+                }
+                break;
+            case 'r': ++resizes; break;
+            default: break;
+        }
+    }
+    double elapsed = now() - start;
+    free(line);
+    free(data);
+    fclose(f);
+
+    printf("recording:   %.3f s\n", duration);
+    printf("replay:      %.3f s%s\n", elapsed, realtime ? " (realtime)" : "");
+    printf("output:      %" PRIu64 " bytes in %" PRIu64 " chunks (largest %" PRIu64 ", busiest second %" PRIu64 " bytes)\n",
+           out_bytes, out_chunks, largest, busiest);
+    printf("sequences:   %" PRIu64 " escape sequences, %" PRIu64 " characters printed\n",
+           bt->vt->sequences - sequences, bt->vt->printed - printed);
+    printf("input:       %" PRIu64 " bytes in %" PRIu64 " chunks, %" PRIu64 " events\n",
+           in_bytes, in_chunks, events);
+    if (resizes) printf("resizes:     %" PRIu64 " (not replayed)\n", resizes);
+    if (!realtime && elapsed > 0)
+        printf("throughput:  %.1f MB/s of output\n", (double)out_bytes / elapsed / (1 << 20));
+
+    if (screen) {
+        char buf[4096];
+        for (int y = 0; y < bt->vt->height; y++) {
+            btui_vt_line(bt->vt, y, buf, sizeof(buf));
+            printf("|%s\n", buf);
+        }
+    }
+    btui_disable(bt);
+    return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * This file contains a benchmark of running many BTUI sessions in one process
+ * (with btui_create_fd()), the way a server would host one per pty or ssh
+ * channel. Each session gets its own pty, and every round, each session is sent
+ * a key, reads it, and draws and flushes a frame of a retained mode status
+ * screen, while the other end of its pty is drained like a client would. It
+ * reports the memory each session takes and the CPU time per frame.
+ *
+ * Usage: sessions [count] (1000 sessions by default)
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include "btui.h"
+
+#define ROUNDS 100
+#define WIDTH 80
+#define HEIGHT 24
+
+typedef struct {
+    int master, slave;
+    btui_t *bt;
+    uint64_t events;
+} session_t;
+
+// Peak resident memory in bytes:
+static double peak_memory(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return (double)usage.ru_maxrss;
+#else
+    return (double)usage.ru_maxrss * 1024.0;
+#endif
+}
+
+// CPU time (user and system) in microseconds:
+static double cpu_time(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (double)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e6
+        + (double)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e6 + (double)t.tv_nsec / 1e3;
+}
+
+static int open_session(session_t *s)
+{
+    s->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (s->master < 0 || grantpt(s->master) || unlockpt(s->master)) return -1;
+    const char *name = ptsname(s->master);
+    if (!name || (s->slave = open(name, O_RDWR | O_NOCTTY)) < 0) return -1;
+    struct winsize size = {.ws_row = HEIGHT, .ws_col = WIDTH};
+    ioctl(s->master, TIOCSWINSZ, &size);
+    fcntl(s->master, F_SETFL, fcntl(s->master, F_GETFL) | O_NONBLOCK);
+    s->bt = btui_create_fd(s->slave, s->slave);
+    if (!s->bt) return -1;
+    btui_set_retained(s->bt, 1);
+    return 0;
+}
+
+// Read everything the session has output, like the client on the other end:
+static void drain(session_t *s)
+{
+    char buf[1 << 14];
+    while (read(s->master, buf, sizeof(buf)) > 0)
+        continue;
+}
+
+// A status screen where a few lines change each frame:
+static void draw(session_t *s, int id, int round)
+{
+    btui_t *bt = s->bt;
+    if (round == 0) {
+        btui_clear(bt, BTUI_CLEAR_SCREEN);
+        btui_set_attributes(bt, BTUI_NORMAL);
+        btui_draw_linebox(bt, 1, 1, WIDTH - 2, HEIGHT - 2);
+        btui_move_cursor(bt, 3, 1);
+        btui_set_attributes(bt, BTUI_BOLD);
+        btui_printf(bt, " Session %d ", id);
+        btui_set_attributes(bt, BTUI_NORMAL);
+    }
+    btui_move_cursor(bt, 3, 3);
+    btui_printf(bt, "Round %4d, %4" PRIu64 " events", round, s->events);
+    btui_move_cursor(bt, 3, 5);
+    int filled = round % (WIDTH - 8);
+    btui_set_bg_hex(bt, 0x3366CC);
+    btui_printf(bt, "%*s", filled, "");
+    btui_set_attributes(bt, BTUI_BG_NORMAL);
+    btui_printf(bt, "%*s", WIDTH - 8 - filled, "");
+    btui_move_cursor(bt, 3, 7 + round % (HEIGHT - 10));
+    btui_printf(bt, "%08x", (unsigned int)round * 2654435761u);
+}
+
+int main(int argc, char *argv[])
+{
+    int count = argc > 1 ? atoi(argv[1]) : 1000;
+    if (count <= 0) {
+        fprintf(stderr, "Usage: %s [count]\n", argv[0]);
+        return 1;
+    }
+    // Each session needs four file descriptors:
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    session_t *sessions = calloc((size_t)count, sizeof(session_t));
+    if (!sessions) return 1;
+    btui_init_tables();
+    double memory_before = peak_memory();
+    for (int i = 0; i < count; i++) {
+        if (open_session(&sessions[i])) {
+            fprintf(stderr, "Couldn't open session %d (out of ptys or file descriptors?)\n", i + 1);
+            return 1;
+        }
+    }
+    // The first frame allocates the screen buffers:
+    for (int i = 0; i < count; i++) {
+        draw(&sessions[i], i, 0);
+        btui_flush(sessions[i].bt);
+        drain(&sessions[i]);
+    }
+    double memory = (peak_memory() - memory_before) / count;
+
+    double cpu_start = cpu_time(), start = now();
+    uint64_t bytes = 0;
+    for (int round = 1; round <= ROUNDS; round++) {
+        for (int i = 0; i < count; i++) {
+            session_t *s = &sessions[i];
+            if (write(s->master, "j", 1) != 1) return 1;
+            btui_event_t events[16];
+            int n = btui_getkeys(s->bt, events, sizeof(events)/sizeof(events[0]), 0);
+            if (n > 0) s->events += (uint64_t)n;
+            draw(s, i, round);
+            btui_flush(s->bt);
+            drain(s);
+        }
+    }
+    double cpu = cpu_time() - cpu_start, elapsed = now() - start;
+
+    uint64_t events = 0;
+    for (int i = 0; i < count; i++) {
+        btui_stats_t stats;
+        if (btui_stats(sessions[i].bt, &stats) == 0)
+            bytes += stats.bytes_written;
+        events += sessions[i].events;
+        btui_disable(sessions[i].bt);
+        close(sessions[i].slave);
+        close(sessions[i].master);
+    }
+    free(sessions);
+
+    long frames = (long)count * ROUNDS;
+    printf("sessions:    %d (%dx%d, retained mode)\n", count, WIDTH, HEIGHT);
+    printf("memory:      %.1f KB per session (btui_t is %zu bytes)\n", memory / 1024, sizeof(btui_t));
+    printf("cpu:         %.2f us per frame (%.2f us wall time)\n", cpu / (double)frames, elapsed / (double)frames);
+    printf("output:      %.1f bytes per frame\n", (double)bytes / (double)(frames + count));
+    printf("input:       %" PRIu64 " of %ld keys read without waiting\n", events, frames);
+    return 0;
+}
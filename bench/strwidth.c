@@ -0,0 +1,43 @@
+/*
+ * This file contains a microbenchmark that measures how fast btui_strnwidth()
+ * can measure the width of ASCII text and of mixed ASCII and CJK text.
+ */
+#include <stdio.h>
+#include "btui.h"
+
+#define TEXT_SIZE (1 << 20)
+#define ITERATIONS 200
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+static void bench(const char *name, const char *text, size_t len)
+{
+    int width = 0;
+    double start = now();
+    for (int i = 0; i < ITERATIONS; i++)
+        width += btui_strnwidth(text, len);
+    double ns = now() - start;
+    printf("%-18s %10.2f %12d\n", name, (double)len * ITERATIONS / ns, width / ITERATIONS);
+}
+
+int main(void)
+{
+    static char ascii[TEXT_SIZE], mixed[TEXT_SIZE];
+    static const char *const words[] = {"The ", "quick ", "brown ", "fox ", "jumps ", "over ", "the ", "lazy ", "dog.\n"};
+    static const char *const cjk_words[] = {"Hello ", "世界", " and ", "日本語", " text, ", "café ", "😀 "};
+    printf("%-18s %10s %12s\n", "text", "GB/s", "columns");
+    size_t len = 0;
+    for (int i = 0; len + 16 < TEXT_SIZE; i++)
+        len += (size_t)sprintf(&ascii[len], "%s", words[i % 9]);
+    bench("ascii", ascii, len);
+    len = 0;
+    for (int i = 0; len + 16 < TEXT_SIZE; i++)
+        len += (size_t)sprintf(&mixed[len], "%s", cjk_words[i % 7]);
+    bench("mixed", mixed, len);
+    return 0;
+}
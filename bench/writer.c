@@ -0,0 +1,95 @@
+/*
+ * This file contains a benchmark that measures how long the drawing thread
+ * spends stalled in btui_flush() when the terminal is slow, with and without
+ * the writer thread. The "terminal" is a pipe drained at a fixed rate.
+ */
+#include <stdio.h>
+#include "btui.h"
+
+#define FRAMES 300
+#define WIDTH 160
+#define HEIGHT 48
+#define TERMINAL_BYTES_PER_SEC (200 << 20)
+#define COMPUTE_NS 1000000
+
+static int terminal_fd;
+
+static double now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+// A slow terminal: read from the pipe, then sleep as long as it would take to
+// display what was read.
+static void *terminal(void *arg)
+{
+    (void)arg;
+    static char buf[1 << 16];
+    for (;;) {
+        ssize_t n = read(terminal_fd, buf, sizeof(buf));
+        if (n <= 0) return NULL;
+        long ns = (long)((double)n * 1e9 / TERMINAL_BYTES_PER_SEC);
+        struct timespec delay = {.tv_sec = ns / 1000000000L, .tv_nsec = ns % 1000000000L};
+        nanosleep(&delay, NULL);
+    }
+}
+
+// Busy-wait to stand in for the program's work between frames:
+static void compute(void)
+{
+    double start = now();
+    while (now() - start < COMPUTE_NS)
+        continue;
+}
+
+static void bench(const char *name, int writer_thread)
+{
+    int fds[2];
+    if (pipe(fds)) exit(1);
+    terminal_fd = fds[0];
+    pthread_t thread;
+    pthread_create(&thread, NULL, terminal, NULL);
+
+    btui_t bt = {0};
+    bt.out = fdopen(fds[1], "w");
+    if (!bt.out) exit(1);
+    bt.width = WIDTH, bt.height = HEIGHT;
+    bt.cursor_x = bt.cursor_y = -1;
+    bt.color_depth = BTUI_COLORS_TRUECOLOR;
+    btui_set_writer_thread(&bt, writer_thread);
+
+    double stalled = 0, worst = 0, start = now();
+    for (int frame = 0; frame < FRAMES; frame++) {
+        compute();
+        for (int y = 0; y < HEIGHT; y++) {
+            btui_move_cursor(&bt, 0, y);
+            for (int x = 0; x < WIDTH; x++) {
+                btui_set_bg_hex(&bt, (x * 1543 + y * 7919 + frame * 104729) & 0xFFFFFF);
+                btui_puts(&bt, " ");
+            }
+        }
+        double t = now();
+        btui_flush(&bt);
+        t = now() - t;
+        stalled += t;
+        if (t > worst) worst = t;
+    }
+    btui_set_writer_thread(&bt, 0);
+    double total = now() - start;
+    fclose(bt.out);
+    free(bt.outbuf);
+    pthread_join(thread, NULL);
+    close(fds[0]);
+    printf("%-18s %12.3f %12.3f %12.1f\n", name, stalled / FRAMES / 1e6, worst / 1e6, total / 1e6);
+}
+
+int main(void)
+{
+    btui_init_tables();
+    printf("%-18s %12s %12s %12s\n", "flush", "avg stall ms", "max stall ms", "total ms");
+    bench("direct write", 0);
+    bench("writer thread", 1);
+    return 0;
+}
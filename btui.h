@@ -9,16 +9,38 @@
 #ifndef __BTUI_H__
 #define __BTUI_H__
 
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifndef BTUI_NO_THREADS
+#include <pthread.h>
+#endif
+
+// The event loop uses epoll where it's available, and poll() elsewhere (or
+// with -DBTUI_NO_EPOLL):
+#if defined(__linux__) && !defined(BTUI_NO_EPOLL)
+#define BTUI_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #define BTUI_VERSION 5
 
 // Terminal escape sequences:
@@ -28,6 +50,7 @@
 #define T_MOUSE_CELL  "1002"
 #define T_MOUSE_SGR   "1006"
 #define T_ALT_SCREEN  "1049"
+#define T_SYNC        "2026"
 #define T_ON(opt)  "\033[?" opt "h"
 #define T_OFF(opt) "\033[?" opt "l"
 
@@ -36,6 +59,40 @@
 #define BTUI_DOUBLECLICK_THRESHOLD 200
 #endif
 
+// How long to wait (in milliseconds) for the rest of an escape sequence:
+#ifndef BTUI_ESCAPE_TIMEOUT
+#define BTUI_ESCAPE_TIMEOUT 50
+#endif
+
+// How long (in milliseconds) the terminal size must stay the same before a
+// burst of resizes is reported as a single RESIZE_EVENT:
+#ifndef BTUI_RESIZE_DEBOUNCE
+#define BTUI_RESIZE_DEBOUNCE 20
+#endif
+
+#ifndef BTUI_INPUT_BUFSIZE
+#define BTUI_INPUT_BUFSIZE 4096
+#endif
+
+// The largest numeric parameter that input escape sequences are parsed up to:
+#define BTUI_MAX_PARAM 100000
+
+// How much output the writer thread can have queued up (must be a power of 2):
+#ifndef BTUI_WRITER_BUFSIZE
+#define BTUI_WRITER_BUFSIZE (1 << 18)
+#endif
+
+// How long a signal handler waits for the terminal to take the writer
+// thread's leftover output before giving up on it, in milliseconds:
+#ifndef BTUI_ABANDON_MS
+#define BTUI_ABANDON_MS 100
+#endif
+
+// How much recorded input and output tracing keeps (the oldest is dropped):
+#ifndef BTUI_TRACE_BUFSIZE
+#define BTUI_TRACE_BUFSIZE (1 << 22)
+#endif
+
 // Keyboard modifiers:
 #define MOD_BITSHIFT  9
 #define MOD_META   (1 << (MOD_BITSHIFT + 0))
@@ -75,6 +132,15 @@ typedef enum {
     RESIZE_EVENT,
 } btui_key_t;
 
+// Input event (see btui_getkeys()):
+typedef struct {
+    int key;            // The key, without modifiers (e.g. 'x', KEY_F1 or MOUSE_LEFT_DRAG)
+    int modifiers;      // MOD_* bits
+    int x, y;           // Mouse position (0-indexed), or -1 for non-mouse events
+    int count;          // How many identical events were coalesced into this one
+    uint64_t timestamp; // When the input arrived (monotonic clock, in microseconds)
+} btui_event_t;
+
 typedef enum {
     CURSOR_DEFAULT            = 0,
     CURSOR_BLINKING_BLOCK     = 1,
@@ -164,14 +230,171 @@ const attr_t BTUI_NO_OVERLINED         = 1ul << 55;
 // 60-65: Ideogram stuff
 
 
+// Colors (see btui_pen_t):
+#define BTUI_COLOR_DEFAULT 0u
+#define BTUI_COLOR_BASIC   (1u << 24) // BTUI_COLOR_BASIC | (0-7)
+#define BTUI_COLOR_RGB     (2u << 24) // BTUI_COLOR_RGB | 0xRRGGBB
+#define BTUI_COLOR_PALETTE (3u << 24) // BTUI_COLOR_PALETTE | (0-255)
+
+// How many colors the terminal supports (see btui_set_color_depth()):
+typedef enum {
+    BTUI_COLORS_AUTO      = 0,
+    BTUI_COLORS_16        = 16,
+    BTUI_COLORS_256       = 256,
+    BTUI_COLORS_TRUECOLOR = 16777216,
+} btui_color_depth_t;
+
+// Optional terminal features (see btui_set_capabilities()):
+#define BTUI_CAP_AUTO (-1)
+#define BTUI_CAP_ECH  (1 << 0) // Erase characters: CSI n X
+#define BTUI_CAP_REP  (1 << 1) // Repeat the last character: CSI n b
+#define BTUI_CAP_RECT (1 << 2) // Fill a rectangle: DECFRA (CSI c;t;l;b;r $ x)
+
+// The attributes and colors that text is drawn with:
+typedef struct {
+    attr_t attrs; // Active attributes, e.g. BTUI_BOLD | BTUI_UNDERLINE
+    uint32_t fg, bg;
+} btui_pen_t;
+
+// A single character cell of the retained screen:
+typedef struct {
+    btui_pen_t pen;
+    uint32_t glyph; // UTF-8 bytes of the character, packed little-endian
+    uint32_t width;
+} btui_cell_t;
+
+// Retained screen state (see btui_set_retained()):
+typedef struct {
+    btui_cell_t *front, *back; // What the terminal shows and what has been drawn
+    uint64_t *dirty;           // Bitmap of rows drawn to since the last flush
+    uint64_t *hashes;          // Scratch space for row hashes (2 per row)
+    int width, height;
+    int x, y;                  // Drawing position in the back buffer
+    btui_pen_t pen;            // Attributes and colors used for drawing
+    int line_drawing;          // Whether the DEC line drawing charset is selected
+    int valid;                 // Whether the front buffer matches the terminal
+} btui_screen_t;
+
+// A virtual terminal that applies escape sequences to a grid of cells instead
+// of a real screen (see btui_create_headless() and btui_vt_feed()):
+typedef struct {
+    btui_cell_t *cells; // width*height cells, row by row
+    int width, height;
+    int x, y;           // Cursor position
+    int wrap_pending;   // Whether the next character goes on the next line
+    int autowrap, cursor_visible;
+    int scroll_top, scroll_bottom;
+    int saved_x, saved_y;
+    btui_pen_t pen, saved_pen;
+    int line_drawing;   // Whether the DEC line drawing charset is selected
+    int saved_line_drawing;
+    btui_cell_t last;   // The last character printed (for REP)
+    int input_fd;       // Where btui_vt_type() sends input (-1 if nowhere)
+    // Escape sequence parser state (sequences can be split between feeds):
+    int state;
+    int params[16], nparams;
+    unsigned char prefix, intermediate;
+    unsigned char utf8[4];
+    int utf8_len, utf8_need;
+    // Totals of everything fed to the terminal:
+    uint64_t bytes, writes, sequences, printed;
+} btui_vt_t;
+
+// Runtime counters (see btui_stats()):
+typedef struct {
+    uint64_t bytes_written;  // Bytes of output sent to the terminal
+    uint64_t flushes;        // Calls to btui_flush()
+    uint64_t writes;         // write() system calls (including the writer thread's)
+    uint64_t cursor_moves;   // Cursor movement sequences (CUP, CUU, VPA, etc.)
+    uint64_t sgr;            // SGR sequences (attributes and colors)
+    uint64_t colors;         // SGR sequences that only set a color
+    uint64_t scrolls;        // Scroll sequences (SU/SD, with any scroll region)
+    uint64_t bytes_read;     // Bytes of input read from the terminal
+    uint64_t events;         // Input events decoded
+    uint64_t wait_us;        // Microseconds spent waiting for input
+} btui_stats_t;
+
+// Counting can be compiled out with -DBTUI_NO_STATS:
+#ifdef BTUI_NO_STATS
+#define BTUI_COUNT(bt, counter, n) ((void)0)
+#else
+#define BTUI_COUNT(bt, counter, n) ((bt)->stats.counter += (uint64_t)(n))
+#endif
+
+// How long it took from input being read to the next completed flush, as a
+// log-scale histogram in microseconds: below 8us each value has its own
+// bucket, and above that, each power of two is split into 8 buckets, so every
+// bucket is within 12.5% of its values (see btui_latency()):
+#define BTUI_LATENCY_BUCKETS 272
+typedef struct {
+    uint32_t buckets[BTUI_LATENCY_BUCKETS];
+    uint64_t count, max;
+} btui_latency_t;
+
+// Performance overlay (see btui_set_hud()). The measurements are of the
+// app's own frames, and what the overlay takes to draw is kept separate:
+#define BTUI_HUD_WIDTH 24
+#define BTUI_HUD_HEIGHT 7
+typedef struct btui_hud_s {
+    double frame_us;       // Time between frames (smoothed)
+    uint64_t frame_bytes;  // Bytes of output in the last frame
+    uint64_t frame_writes; // write() calls for the last frame
+    uint64_t queued;       // Bytes of input waiting to be handled
+    uint64_t cost_us, cost_bytes;             // What the overlay took in the last frame
+    uint64_t total_cost_us, total_cost_bytes; // What the overlay has taken altogether
+    uint64_t last_frame, last_writes;
+    int x, y; // Where the overlay was drawn (-1 if it wasn't)
+    // What the app drew under the overlay in retained mode:
+    btui_cell_t under[BTUI_HUD_WIDTH * BTUI_HUD_HEIGHT];
+} btui_hud_t;
+
 // BTUI object:
 typedef struct {
     FILE *in, *out;
     int width, height;
     int size_changed;
     btui_mode_t mode;
+    btui_pen_t pen; // What the terminal is using (BTUI_NORMAL in .attrs means unknown)
+    int cursor_x, cursor_y; // Where the terminal's cursor is (-1 if unknown)
+    int retained;
+    btui_screen_t screen;
+    char *outbuf; // Output that hasn't been flushed yet
+    size_t outlen, outsize;
+    int synchronized; // Whether to wrap flushes in synchronized update mode
+    int nonblocking; // Whether flushes return instead of waiting on the terminal
+    size_t pending; // Bytes at the front of outbuf the terminal hasn't taken yet
+    int fps; // Maximum frames per second for btui_frame_begin() (0 for no limit)
+    uint64_t frame_start; // When the last frame began
+    struct btui_writer_s *writer; // The thread writing output (see btui_set_writer_thread())
+    btui_vt_t *vt; // Where output goes instead of a terminal (see btui_create_headless())
+    char inbuf[BTUI_INPUT_BUFSIZE]; // Input that has been read but not parsed
+    size_t inpos, inlen;
+    uint64_t intime; // When the input in the buffer arrived
+    int coalesce; // Whether btui_getkeys() merges consecutive drag/wheel events
+    btui_color_depth_t color_depth; // What RGB colors get converted to
+    int capabilities; // Which optional escape sequences can be used (BTUI_CAP_*)
+    btui_stats_t stats; // Runtime counters (see btui_stats())
+    struct btui_trace_s *trace; // Recorded input and output (see btui_set_trace())
+    uint64_t keytime; // When the last key returned by btui_getkey() arrived
+    uint64_t unanswered; // When the oldest input not yet followed by a flush arrived (0 if none)
+    btui_latency_t latency; // Input-to-flush latencies (see btui_latency())
+    btui_hud_t *hud; // Performance overlay (see btui_set_hud())
+    int lastclick; // The last mouse button released (for double clicks)
+    uint64_t lastclicktime; // When it was released
+    int controlling; // Whether this is the terminal from btui_create() (which gets signals)
+    int raw; // Whether the terminal was put in raw mode (and normal_termios has to be restored)
+    struct termios normal_termios, tui_termios; // The terminal's normal settings and BTUI's
 } btui_t;
 
+// Event loop (see btui_loop_create()):
+#define BTUI_LOOP_READ  (1 << 0)
+#define BTUI_LOOP_WRITE (1 << 1)
+typedef struct btui_loop_s btui_loop_t;
+typedef struct btui_timer_s btui_timer_t;
+typedef void (*btui_fd_callback_t)(btui_loop_t *loop, int fd, int events, void *data);
+typedef void (*btui_key_callback_t)(btui_loop_t *loop, btui_t *bt, const btui_event_t *event, void *data);
+typedef void (*btui_timer_callback_t)(btui_loop_t *loop, btui_timer_t *timer, void *data);
+
 // Key Names:
 typedef struct {
     int key;
@@ -185,34 +408,74 @@ void    btui_disable(btui_t *bt);
 void    btui_draw_linebox(btui_t *bt, int x, int y, int w, int h);
 void    btui_draw_shadow(btui_t *bt, int x, int y, int w, int h);
 btui_t* btui_create(btui_mode_t mode);
+btui_t* btui_create_fd(int in_fd, int out_fd);
+btui_t* btui_create_headless(int width, int height);
 #define btui_enable() btui_create(BTUI_MODE_TUI)
 void    btui_fill_box(btui_t *bt, int x, int y, int w, int h);
 int     btui_flush(btui_t *bt);
+int     btui_frame_begin(btui_t *bt);
+int     btui_frame_end(btui_t *bt);
+int     btui_frame_timeout(btui_t *bt);
 void    btui_force_close(btui_t *bt);
 int     btui_getkey(btui_t *bt, int timeout, int *mouse_x, int *mouse_y);
+int     btui_getkeys(btui_t *bt, btui_event_t *events, size_t max, int timeout_ms);
 int     btui_hide_cursor(btui_t *bt);
 char    *btui_keyname(int key, char *buf);
 int     btui_keynamed(const char *name);
+uint64_t btui_latency(btui_t *bt, double percentile);
+int     btui_loop_add_btui(btui_loop_t *loop, btui_t *bt, btui_key_callback_t callback, void *data);
+int     btui_loop_add_fd(btui_loop_t *loop, int fd, int events, btui_fd_callback_t callback, void *data);
+btui_timer_t* btui_loop_add_timer(btui_loop_t *loop, int delay_ms, int interval_ms, btui_timer_callback_t callback, void *data);
+void    btui_loop_cancel_timer(btui_loop_t *loop, btui_timer_t *timer);
+btui_loop_t* btui_loop_create(void);
+void    btui_loop_free(btui_loop_t *loop);
+int     btui_loop_remove_btui(btui_loop_t *loop, btui_t *bt);
+int     btui_loop_remove_fd(btui_loop_t *loop, int fd);
+int     btui_loop_run(btui_loop_t *loop);
+int     btui_loop_run_once(btui_loop_t *loop, int timeout_ms);
+void    btui_loop_stop(btui_loop_t *loop);
 int     btui_move_cursor(btui_t *bt, int x, int y);
-#define btui_printf(bt, ...) fprintf((bt)->out, __VA_ARGS__)
+int     btui_output_pending(btui_t *bt);
+int     btui_printf(btui_t *bt, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
 int     btui_puts(btui_t *bt, const char *s);
 int     btui_scroll(btui_t *bt, int firstline, int lastline, int scroll_amount);
 int     btui_set_attributes(btui_t *bt, attr_t attrs);
 int     btui_set_bg(btui_t *bt, unsigned char r, unsigned char g, unsigned char b);
 int     btui_set_bg_hex(btui_t *bt, int hex);
+int     btui_set_capabilities(btui_t *bt, int capabilities);
+int     btui_set_coalescing(btui_t *bt, int coalesce);
+int     btui_set_color_depth(btui_t *bt, btui_color_depth_t depth);
 int     btui_set_cursor(btui_t *bt, cursor_t cur);
 int     btui_set_fg(btui_t *bt, unsigned char r, unsigned char g, unsigned char b);
 int     btui_set_fg_hex(btui_t *bt, int hex);
+int     btui_set_fps(btui_t *bt, int fps);
+int     btui_set_hud(btui_t *bt, int enabled);
 void    btui_set_mode(btui_t *bt, btui_mode_t mode);
+int     btui_set_nonblocking(btui_t *bt, int nonblocking);
+int     btui_set_retained(btui_t *bt, int retained);
+int     btui_set_size(btui_t *bt, int width, int height);
+int     btui_set_synchronized(btui_t *bt, int synchronized);
+int     btui_set_trace(btui_t *bt, int enabled);
+int     btui_set_writer_thread(btui_t *bt, int enabled);
 int     btui_show_cursor(btui_t *bt);
+int     btui_stats(btui_t *bt, btui_stats_t *stats);
+int     btui_stats_reset(btui_t *bt);
+int     btui_strnwidth(const char *str, size_t len);
+int     btui_strwidth(const char *str);
 int     btui_suspend(btui_t *bt);
+int     btui_trace_dump(btui_t *bt, const char *path);
+btui_vt_t* btui_vt_create(int width, int height);
+void    btui_vt_feed(btui_vt_t *vt, const char *buf, size_t len);
+void    btui_vt_free(btui_vt_t *vt);
+int     btui_vt_line(btui_vt_t *vt, int y, char *buf, size_t size);
+int     btui_vt_type(btui_vt_t *vt, const char *keys, size_t len);
 
 
 // File-local variables:
 static btui_t current_bt = {.in = NULL, .out = NULL, .mode = BTUI_MODE_UNINITIALIZED};
 
 // The names of keys that don't render well:
-static keyname_t key_names[] = {
+static const keyname_t key_names[] = {
     {KEY_SPACE, "Space"}, {KEY_BACKSPACE2, "Backspace"},
     {KEY_INSERT, "Insert"}, {KEY_DELETE, "Delete"},
     {KEY_TAB, "Tab"}, {KEY_ENTER, "Enter"}, {KEY_ENTER, "Return"},
@@ -251,302 +514,3508 @@ static keyname_t key_names[] = {
     {RESIZE_EVENT, "Resize"},
 };
 
-// This is the default termios for normal terminal behavior and the text-user-interface one:
-static struct termios normal_termios, tui_termios;
+// BEGIN GENERATED KEY TABLES
+// Generated by tools/keytables.py from key_names[] (do not edit by hand):
+// Canonical name of each key code, indexed by code:
+static const char *const key_code_names[RESIZE_EVENT+1] = {
+    [KEY_SPACE] = "Space",
+    [KEY_BACKSPACE2] = "Backspace",
+    [KEY_INSERT] = "Insert",
+    [KEY_DELETE] = "Delete",
+    [KEY_CTRL_I] = "Tab",
+    [KEY_CTRL_M] = "Enter",
+    [KEY_HOME] = "Home",
+    [KEY_END] = "End",
+    [KEY_PGUP] = "PgUp",
+    [KEY_PGDN] = "PgDn",
+    [KEY_ARROW_UP] = "Up",
+    [KEY_ARROW_DOWN] = "Down",
+    [KEY_ARROW_LEFT] = "Left",
+    [KEY_ARROW_RIGHT] = "Right",
+    [MOUSE_LEFT_PRESS] = "Left press",
+    [MOUSE_RIGHT_PRESS] = "Right press",
+    [MOUSE_MIDDLE_PRESS] = "Middle press",
+    [MOUSE_LEFT_DRAG] = "Left drag",
+    [MOUSE_RIGHT_DRAG] = "Right drag",
+    [MOUSE_MIDDLE_DRAG] = "Middle drag",
+    [MOUSE_LEFT_RELEASE] = "Left release",
+    [MOUSE_RIGHT_RELEASE] = "Right release",
+    [MOUSE_MIDDLE_RELEASE] = "Middle release",
+    [MOUSE_LEFT_DOUBLE] = "Double left click",
+    [MOUSE_RIGHT_DOUBLE] = "Double right click",
+    [MOUSE_MIDDLE_DOUBLE] = "Double middle click",
+    [MOUSE_WHEEL_RELEASE] = "Mouse wheel up",
+    [MOUSE_WHEEL_PRESS] = "Mouse wheel down",
+    [KEY_CTRL_LSQ_BRACKET] = "Esc",
+    [KEY_CTRL_A] = "Ctrl-a",
+    [KEY_CTRL_B] = "Ctrl-b",
+    [KEY_CTRL_C] = "Ctrl-c",
+    [KEY_CTRL_D] = "Ctrl-d",
+    [KEY_CTRL_E] = "Ctrl-e",
+    [KEY_CTRL_F] = "Ctrl-f",
+    [KEY_CTRL_G] = "Ctrl-g",
+    [KEY_CTRL_H] = "Ctrl-h",
+    [KEY_CTRL_J] = "Ctrl-j",
+    [KEY_CTRL_K] = "Ctrl-k",
+    [KEY_CTRL_L] = "Ctrl-l",
+    [KEY_CTRL_N] = "Ctrl-n",
+    [KEY_CTRL_O] = "Ctrl-o",
+    [KEY_CTRL_P] = "Ctrl-p",
+    [KEY_CTRL_Q] = "Ctrl-q",
+    [KEY_CTRL_R] = "Ctrl-r",
+    [KEY_CTRL_S] = "Ctrl-s",
+    [KEY_CTRL_T] = "Ctrl-t",
+    [KEY_CTRL_U] = "Ctrl-u",
+    [KEY_CTRL_V] = "Ctrl-v",
+    [KEY_CTRL_W] = "Ctrl-w",
+    [KEY_CTRL_X] = "Ctrl-x",
+    [KEY_CTRL_Y] = "Ctrl-y",
+    [KEY_CTRL_Z] = "Ctrl-z",
+    [KEY_CTRL_CARET] = "Ctrl-~",
+    [KEY_CTRL_BACKSLASH] = "Ctrl-\\",
+    [KEY_CTRL_RSQ_BRACKET] = "Ctrl-]",
+    [KEY_CTRL_UNDERSCORE] = "Ctrl-_",
+    [KEY_CTRL_AT] = "Ctrl-@",
+    [KEY_F1] = "F1",
+    [KEY_F2] = "F2",
+    [KEY_F3] = "F3",
+    [KEY_F4] = "F4",
+    [KEY_F5] = "F5",
+    [KEY_F6] = "F6",
+    [KEY_F7] = "F7",
+    [KEY_F8] = "F8",
+    [KEY_F9] = "F9",
+    [KEY_F10] = "F10",
+    [KEY_F11] = "F11",
+    [KEY_F12] = "F12",
+    [RESIZE_EVENT] = "Resize",
+};
 
-// File-local functions:
+// Perfect hash table from key name to 1 + index in key_names[] (0 for none):
+#define KEY_NAME_HASH_SEED 0x811C9DD0u
+#define KEY_NAME_HASH_BITS 10
+static const uint8_t key_name_slots[1 << KEY_NAME_HASH_BITS] = {
+    [20] = 84, [24] = 85, [32] = 83, [36] = 88, [40] = 89, [44] = 86, [48] = 87,
+    [53] = 95, [60] = 90, [64] = 91, [68] = 12, [85] = 28, [102] = 20,
+    [119] = 15, [149] = 16, [191] = 26, [237] = 34, [246] = 1, [252] = 23,
+    [273] = 30, [282] = 3, [321] = 18, [331] = 22, [366] = 31, [387] = 14,
+    [388] = 39, [407] = 2, [421] = 35, [436] = 33, [460] = 93, [464] = 92,
+    [472] = 94, [494] = 67, [498] = 68, [502] = 73, [506] = 70, [554] = 4,
+    [567] = 13, [599] = 5, [606] = 72, [630] = 66, [634] = 6, [638] = 63,
+    [642] = 64, [646] = 65, [647] = 37, [654] = 59, [657] = 25, [658] = 60,
+    [662] = 61, [664] = 24, [666] = 62, [670] = 55, [674] = 56, [678] = 57,
+    [682] = 58, [686] = 51, [690] = 52, [693] = 19, [694] = 53, [696] = 8,
+    [698] = 54, [702] = 47, [706] = 48, [710] = 49, [714] = 50, [718] = 43,
+    [722] = 44, [725] = 17, [726] = 45, [730] = 46, [734] = 74, [738] = 40,
+    [742] = 41, [746] = 42, [825] = 7, [832] = 9, [837] = 38, [879] = 29,
+    [884] = 21, [894] = 81, [897] = 36, [898] = 82, [910] = 77, [914] = 78,
+    [918] = 79, [922] = 80, [934] = 75, [938] = 76, [954] = 71, [964] = 10,
+    [986] = 11, [1001] = 27, [1019] = 32,
+};
+// END GENERATED KEY TABLES
 
-/* 
- * Read and return the next character from the file descriptor, or -1 if no
- * character is available. (Helper method for nextnum() and btui_getkey())
+/*
+ * Hash a key name for looking it up in key_name_slots[].
  */
-static inline int nextchar(int fd)
+static inline uint32_t btui_keyname_hash(const char *name)
 {
-    char c;
-    return read(fd, &c, 1) == 1 ? c : -1;
+    uint32_t h = KEY_NAME_HASH_SEED;
+    for ( ; *name; name++)
+        h = (h ^ (uint8_t)*name) * 16777619u;
+    return h >> (32 - KEY_NAME_HASH_BITS);
 }
 
+// The Unicode equivalents of the DEC line drawing characters '_' through '~':
+static const char *const dec_line_drawing[] = {
+    " ", "◆", "▒", "␉", "␌", "␍", "␊", "°", "±", "␤", "␋", "┘", "┐", "┌", "└", "┼",
+    "⎺", "⎻", "─", "⎼", "⎽", "├", "┤", "┴", "┬", "│", "≤", "≥", "π", "≠", "£", "·",
+};
+
+// BEGIN GENERATED WIDTH TABLES
+// Generated by tools/widthtable.py from Unicode 14.0.0 (do not edit by hand):
+// Which block of width_block_data[] holds each 256-codepoint block's widths:
+static const uint8_t width_blocks[0x40000 >> 8] = {
+    0, 1, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 1, 1, 19, 20,
+    21, 22, 23, 24, 25, 26, 1, 27, 28, 29, 1, 30, 31, 32, 33, 34, 1, 1, 1, 35, 36, 37, 38, 39,
+    40, 39, 41, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 42, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 43, 1, 44, 45,
+    46, 47, 48, 49, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 50,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 39, 39, 51, 1, 52, 53, 54, 55, 56, 57, 58, 59, 60, 1, 61,
+    62, 63, 64, 65, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 39, 81, 82, 83, 84,
+    1, 1, 1, 85, 86, 87, 39, 39, 39, 39, 39, 39, 39, 39, 39, 88, 1, 1, 1, 1, 89, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 1, 1, 90, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    1, 1, 91, 92, 39, 39, 93, 94, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 95, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 96, 97, 98, 99, 100, 101, 102, 103, 104, 1, 1, 105, 39, 39, 39, 39, 106,
+    107, 108, 109, 39, 39, 39, 39, 110, 111, 112, 39, 39, 113, 114, 115, 39, 116, 117, 39, 118, 119, 120, 121, 122,
+    123, 124, 125, 126, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+    39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39, 39,
+};
+// The width of each codepoint in a block, packed 4 per byte (2 bits each):
+static const uint8_t width_block_data[127][64] = {
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,
+     0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x55,0x55,0x5A,0x55,
+     0xAA,0x55,0x95,0x59,0x55,0x55,0x55,0x55,0x65,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x15,0x00,0x50,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x95,0x56,0x02,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x10,0x41,0x10,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x6A,0x55,0xA9,0xAA,0xAA},
+    {0x00,0x50,0x55,0x55,0x00,0x00,0x40,0x54,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x00,0x00,0x00,0x00,0x00,0x55,0x55,0x55,0x55,0x54,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x05,0x00,0x10,0x00,0x14,0x04,0x50,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x25,0x51,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x00,0x00,0x00,0x00,0x00,0x80,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x05,0x00,0x00,0xA4,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x00,0x00,0x55,0x95,0x52},
+    {0x55,0x55,0x55,0x55,0x55,0x05,0x10,0x00,0x00,0x01,0x01,0xA0,0x55,0x55,0x55,0x95,0x55,0x55,0x55,0x55,0x55,0x55,0x01,0x9A,0x55,0x55,0x95,0xAA,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x95,0xA0,0xAA,0x00,0x00,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x05,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00},
+    {0x40,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x45,0x54,0x01,0x00,0x54,0x51,0x01,0x00,0x55,0x55,0x05,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x51,0x56,0x55,0x69,0x69,0x55,0x55,0x55,0x55,0x55,0x59,0x55,0x99,0x5A,0xA5,0x54,0x01,0x68,0x69,0x91,0xAA,0x6A,0xAA,0x65,0x05,0x5A,0x55,0x55,0x55,0x55,0x55,0x85},
+    {0x42,0x56,0x95,0x6A,0x69,0x55,0x55,0x55,0x55,0x55,0x59,0x55,0x59,0x96,0xA5,0x58,0x81,0x2A,0x28,0xA0,0xA2,0xAA,0x56,0x99,0xAA,0x5A,0x55,0x55,0x50,0x91,0xAA,0xAA,
+     0x42,0x56,0x55,0x65,0x65,0x55,0x55,0x55,0x55,0x55,0x59,0x55,0x59,0x56,0xA5,0x54,0x01,0x20,0x64,0xA1,0xA9,0xAA,0xAA,0xAA,0x05,0x5A,0x55,0x55,0xA5,0xAA,0x06,0x00},
+    {0x52,0x56,0x55,0x69,0x69,0x55,0x55,0x55,0x55,0x55,0x59,0x55,0x59,0x56,0xA5,0x14,0x01,0x68,0x69,0xA1,0xAA,0x42,0xAA,0x65,0x05,0x5A,0x55,0x55,0x55,0x55,0xAA,0xAA,
+     0x4A,0x56,0x95,0x5A,0x59,0xA5,0x96,0x59,0x6A,0xA9,0x95,0x5A,0x55,0x55,0xA5,0x5A,0x94,0x5A,0x59,0xA1,0xA9,0x6A,0xAA,0xAA,0xAA,0x5A,0x55,0x55,0x55,0x55,0x95,0xAA},
+    {0x54,0x54,0x55,0x59,0x59,0x55,0x55,0x55,0x55,0x55,0x59,0x55,0x55,0x55,0xA5,0x04,0x54,0x09,0x08,0xA0,0xAA,0x82,0x95,0xA6,0x05,0x5A,0x55,0x55,0xAA,0x6A,0x55,0x55,
+     0x51,0x55,0x55,0x59,0x59,0x55,0x55,0x55,0x55,0x55,0x59,0x55,0x55,0x56,0xA5,0x14,0x55,0x49,0x59,0xA0,0xAA,0x96,0xAA,0x96,0x05,0x5A,0x55,0x55,0x96,0xAA,0xAA,0xAA},
+    {0x50,0x55,0x55,0x59,0x59,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x54,0x01,0x58,0x59,0x51,0xAA,0x55,0x55,0x55,0x05,0x5A,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x52,0x56,0x55,0x55,0x55,0x95,0x5A,0x55,0x55,0x55,0x55,0x55,0x65,0x55,0x55,0xA6,0x55,0x95,0x8A,0x6A,0x05,0x88,0x55,0x55,0xAA,0x5A,0x55,0x55,0x5A,0xA9,0xAA,0xAA},
+    {0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x51,0x00,0x80,0x6A,0x55,0x15,0x00,0x40,0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0x96,0x59,0x95,0x55,0x55,0x55,0x55,0x55,0x55,0x66,0x55,0x55,0x51,0x00,0x00,0xA4,0x55,0x99,0x00,0xA0,0x55,0x55,0xA5,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x50,0x55,0x55,0x55,0x55,0x55,0x55,0x11,0x51,0x55,0x55,0x55,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0x02,0x00,0x00,0x40,
+     0x00,0x04,0x55,0x01,0x00,0x00,0x02,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x58,0x55,0x45,0x55,0x59,0x55,0x55,0x95,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x01,0x04,0x00,0x41,0x41,0x55,0x55,0x55,0x55,0x55,0x55,0x50,0x05,0x54,0x55,0x55,0x55,0x01,0x54,0x55,0x55,
+     0x45,0x41,0x55,0x51,0x55,0x55,0x55,0x51,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x65,0xAA,0xA6,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
+     0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x59,0xA5,0x55,0x95,0x59,0xA5,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x59,0xA5,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x59,0xA5,0x55,0x95,0x59,0xA5,0x55,0x55,0x55,0x95,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x59,0xA5,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x02,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,
+     0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0x55,0xA5},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0xAA},
+    {0x55,0x55,0x55,0x55,0x05,0xA4,0xAA,0x6A,0x55,0x55,0x55,0x55,0x05,0x95,0xAA,0xAA,0x55,0x55,0x55,0x55,0x05,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x59,0x09,0xAA,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x10,0x00,0x50,0x55,0x45,0x01,0x00,0x00,0x55,0x55,0xA1,0x55,0x55,0xA5,0xAA,0x55,0x55,0xA5,0xAA},
+    {0x55,0x55,0x15,0x00,0x55,0x55,0xA5,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0xAA,
+     0x55,0x41,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x91,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x40,0x15,0x54,0xAA,0x45,0x55,0x01,0xAA,0xA9,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0x55,0xA9,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0xAA,0x55,0x55,0x95,0x5A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x15,0x14,0x5A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x45,0x00,0x80,0x44,0x01,0x00,0x54,0x15,0x00,0x00,0x28,
+     0x55,0x55,0xA5,0xAA,0x55,0x55,0xA5,0xAA,0x55,0x55,0x55,0xA5,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x80,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x00,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x04,0x40,0x54,0x45,0x55,0x55,0xA9,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x00,0x00,0x55,0x55,0x95,
+     0x50,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x05,0x50,0x10,0x50,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x45,0x50,0x11,0x50,0xAA,0xAA,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x00,0x05,0x6A,0x55,0x55,0x55,0xA5,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0xA9,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x56,0x55,0x55,0xAA,0xAA,0x40,0x00,0x00,0x00,0x04,0x00,0x54,0x51,0x55,0x54,0x90,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00},
+    {0x55,0x55,0x55,0x55,0x55,0xA5,0x55,0xA5,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0x55,0xA5,0x55,0x55,0x66,0x66,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x59,0x55,0x55,0x55,0x59,0x55,0x55,0x55,0x5A,0x55,0x56,0x55,0x55,0x55,0x55,0x5A,0x59,0x55,0x95},
+    {0x55,0x55,0x15,0x00,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x40,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x08,0x00,0x00,0xA5,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x95,0x55,0x55,0x55,0xA9,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0xAA,0xAA,0xAA,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xA8,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0x55,0x55,0x55,0x69,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0x56,0x96,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x95,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x69},
+    {0x55,0x55,0x55,0x55,0x55,0x5A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,
+     0x55,0x55,0x55,0x55,0x95,0x55,0x55,0x55,0x59,0x55,0xA5,0x55,0x55,0x55,0x55,0x69,0x55,0x5A,0x55,0x65,0x55,0x56,0x55,0x55,0x55,0x55,0x65,0x55,0xA5,0x59,0x65,0x59},
+    {0x55,0x59,0xA5,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x66,0x95,0x9A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0xA9,0x55,0x55,0x55,0x55,0x55,0x55,0x56,0x55,0x55,0x95,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x56,0x59,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x5A,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x65,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x50,0xAA,0x56,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x65,0xAA,0xA6,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0x6A,0xA9,0xAA,0xAA,0x2A,
+     0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0x55,0x95,0x55,0x95,0x55,0x95,0x55,0x95,0x55,0x95,0x55,0x95,0x55,0x95,0x55,0x95,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x0A,0xA0,0xAA,0xAA,0xAA,0x6A,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x82,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x40,0x00,0x00,0x50,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x05,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x50,0x55,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0x65,0x56,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0x5A,0x55,0x55,0x55},
+    {0x45,0x45,0x15,0x55,0x55,0x55,0x55,0x55,0x55,0x41,0x55,0xA8,0x55,0x55,0xA5,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA0,0xAA,0x5A,0x55,0x55,0xA5,0xAA,0x00,0x00,0x00,0x00,0x50,0x55,0x55,0x15},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x05,0x00,0x50,0x55,0x55,0x55,0x55,0x55,0x15,0x00,0x00,0x50,0xAA,0xAA,0x6A,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0x40,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x05,0x50,0x50,0x55,0x55,0x55,0x65,0x55,0x55,0xA5,0x5A,0x55,0x51,0x55,0x55,0x55,0x55,0x55,0x95},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x01,0x40,0x41,0x81,0xAA,0xAA,0x15,0x55,0x55,0xA4,0x55,0x55,0xA5,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x54,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x04,0x14,0x54,0x05,0x91,0xAA,0xAA,0xAA,0xAA,0xAA,0x6A,0x55,0x55,0x55,0x55,0x50,0x55,0x85,0xAA,0xAA},
+    {0x56,0x95,0x56,0x95,0x56,0x95,0xAA,0xAA,0x55,0x95,0x55,0x95,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x51,0x54,0xA1,0x55,0x55,0xA5,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x95,0x6A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA},
+    {0x55,0x95,0xAA,0xAA,0x6A,0x55,0xAA,0x46,0x55,0x55,0x55,0x55,0x55,0x95,0x55,0x99,0x65,0x59,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0xAA,0x6A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x5A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0x6A,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55},
+    {0x00,0x00,0x00,0x00,0xAA,0xAA,0xAA,0xAA,0x00,0x00,0x00,0x00,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x59,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x29},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x5A,0x55,0x5A,0x55,0x5A,0x55,0x5A,0xA9,0xAA,0xAA,0x55,0x95,0xAA,0xAA,0x02,0xA5},
+    {0x55,0x55,0x55,0x56,0x55,0x55,0x55,0x55,0x55,0x95,0x55,0x55,0x55,0x55,0x95,0x65,0x55,0x55,0x55,0xA5,0x55,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA},
+    {0x95,0x6A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x6A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x95,0x55,0x55,0x55,0xA9,0xA9,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA1},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0xAA,0xAA,0xAA,0x54,0x55,0x55,0x55,0x55,0x55,0x55,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x05,0x80,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x65,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0x55,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0x55,0x55,0xA5,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0x6A,0x55,0x55,0x95,0x55,
+     0x55,0x55,0x95,0x55,0x95,0x65,0x55,0x55,0x65,0x55,0x55,0x55,0x65,0x55,0x65,0xA9,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0xA5,0xAA,0xAA,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0x55,0x65,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x59,0x55,0x95,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0xA5,0x59,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x65,0xA9,0x69,0x55,0x55,0x55,0x55,0x55,0x65,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0x6A,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x95,0xA5,0x6A,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x6A,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0x6A,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0x55,0x55,0x55,0x55,0x55,0x5A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x01,0x82,0xAA,0x00,0x55,0x56,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0x80,0x2A,0x55,0x55,0xA9,0xAA,0x55,0x55,0xA9,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x81,0x6A,0x55,0x55,0x95,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0x55,0x55,
+     0x55,0x55,0x55,0x55,0xA5,0xAA,0x56,0xA9,0xAA,0xAA,0x56,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0x5A,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0xAA,0xAA,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x25,0xA4,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x05,0x00,0x00,0x54,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,
+     0x05,0x50,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA},
+    {0x51,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x00,0x00,0x40,0x55,0xA5,0x5A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x14,0xA4,0xAA,0x2A,
+     0x50,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x40,0x41,0x51,0x85,0xAA,0xAA,0xA2,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0xAA,0x55,0x55,0xA5,0xAA},
+    {0x40,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x00,0x01,0x00,0x58,0x55,0x55,0x55,0x55,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x95,0xAA,0xAA,
+     0x50,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x05,0x00,0x40,0x55,0x55,0x01,0x14,0x55,0x55,0x55,0x55,0x56,0x55,0x55,0x55,0x55,0xA9,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x65,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x50,0x04,0x55,0x85,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0x55,0x95,0x59,0x65,0x55,0x55,0x55,0x65,0x55,0x55,0xA5,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x15,0x00,0x80,0xAA,0x55,0x55,0xA5,0xAA},
+    {0x50,0x56,0x55,0x69,0x69,0x55,0x55,0x55,0x55,0x55,0x59,0x55,0x59,0x56,0x25,0x54,0x54,0x69,0x69,0xA5,0xA9,0x6A,0xAA,0x56,0x55,0x0A,0x00,0xA8,0x00,0xA8,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x00,0x05,0x44,0x55,0x55,0x55,0x55,0x55,0x46,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x00,0x44,0x15,0x04,0x55,0xAA,0xAA,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x05,0xA0,0x55,0x10,0x54,0x55,0x55,0x55,0x55,0x55,0x55,0xA0,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x00,0x40,0x11,0x54,0xA9,0xAA,0xAA,0x55,0x55,0xA5,0xAA,0x55,0x55,0x55,0xA9,0xAA,0xAA,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x51,0x00,0x10,0xA5,0xAA,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x02,0x05,0x10,0x00,0xAA,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x00,0x00,0x41,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0x6A},
+    {0x55,0x95,0xA6,0x55,0x55,0x96,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x65,0x29,0x44,0x15,0x95,0xAA,0xAA,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x5A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x0A,0x55,0x54,0xA9,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x01,0x00,0x40,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x00,0x14,0x40,0x55,0x15,0xAA,0xAA,0x01,0x40,0x01,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x05,0x00,0x00,0x40,0x50,0x55,0x95,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0xAA},
+    {0x55,0x55,0x59,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x80,0x00,0x10,0x55,0xA5,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x0A,0x00,0x00,0x00,0x00,0x00,0x06,0x00,0x04,0x81,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x95,0x65,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x01,0x80,0x8A,0x20,0x00,0x10,0xAA,0xAA,0x55,0x55,0xA5,0xAA,0x55,0x65,0x59,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x95,0x60,0x11,0xA9,0xAA,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x15,0x54,0xA9,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xA9,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0xAA,0xAA,0x6A},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x55,0xA9,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x00,0x00,0xA8,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x55,0x55,0xA5,0x5A,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x55,0x55,0xA5,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0x00,0xA4,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x40,0x55,0x55,0x55,0xA5,0xAA,0xAA,0x55,0x55,0x65,0x55,0x65,0x55,0x55,0x55,0x55,0x55,0xAA,0x56,
+     0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x2A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0xAA,0x2A,0x40,0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xA8,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0x55,0x55,0x55,0xA9,
+     0x55,0x55,0xA9,0xAA,0x55,0x55,0xA5,0x41,0x00,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0xA0,0x00,0x00,0x00,0x00,0x00,0x80,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x15,0x50,0x55,0x15,0x00,0x00,0x00,
+     0x40,0x01,0x00,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x05,0x50,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x05,0xA4,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x59,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x59,0x9A,0x96,0x56,0x59,0x55,0x55,0x65,0x56,0x55,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x65,0x95,0x56,0x55,0x59,0x55,0x59,0x55,0x55,0x55,0x55,0x55,0x55,0x65,0x95,0x55,0x99,0x5A,0x55,0x59,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x5A,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x40,0x15,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x54,0x55,0x51,0x55,0x55,
+     0x55,0x54,0x55,0xAA,0xAA,0xAA,0x2A,0x00,0x02,0x00,0x00,0x00,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x00,0x80,0x00,0x00,0x00,0x00,0x28,0x00,0x20,0x08,0x80,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0x00,0x40,0x55,0xA5,0x55,0x55,0xA5,0x5A,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x85,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x55,0x55,0xA5,0x6A},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x95,0x55,0x96,0x55,0x55,0x55,0x95},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x69,0x55,0x55,0x00,0x80,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x00,0x40,0xAA,0x55,0x55,0xA5,0x5A,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x56,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x96,0x69,0x56,0x55,0x95,0x55,0x66,0xAA,0x9A,0x6A,0x66,0x56,0x96,0x69,0x66,0x66,0x96,0x69,0x95,0x55,0x95,0x55,0x56,0x99,
+     0x55,0x55,0x65,0x55,0x55,0x55,0x55,0xAA,0x56,0x56,0x65,0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xA5,0xAA,0xAA,0xAA},
+    {0x55,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x95,0x56,0x55,0x55,0x55,0x56,0x55,0x55,0x95,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x65,0xA9,0xAA,0x6A,0x55,0x55,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x5A,0x55,0x55,0x55,0x55,0x55,0x55},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x56,0x55,0x55,0xA9,0xAA,0x9A,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xA6,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x6A,0x95,0xAA,0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0x56,0x56,0xAA,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x6A,0xA6,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x96},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x5A,0x55,0x55,0x95,0x6A,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x65,0x55,
+     0x55,0x55,0x55,0x55,0x55,0x69,0x55,0x55,0x55,0x56,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA},
+    {0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x5A,0x55,0x56,0x6A,0xA9,0xAA,0xAA,0x55,0x55,0x95,0xAA,0x55,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA,
+     0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA9,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0x55,0x55,0xA5,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0xAA,0xAA,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xA5,0xA5,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x6A,0xAA,0xAA,0x9A,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0xAA,0xAA,0xAA,0x55,0x55,0x55,0xA5,0xAA,0xAA,0xAA,0xAA,
+     0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA},
+    {0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,
+     0x55,0x55,0x55,0x55,0x95,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x55,0x95,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0xAA,0x55,0x55,0xA5,0xAA},
+};
+// END GENERATED WIDTH TABLES
+
+// The SIGWINCH handler writes to this pipe to wake up anything waiting for
+// input on the terminal from btui_create():
+static int resize_pipe[2] = {-1, -1};
+
+// Set while btui_cleanup_and_raise() tears down the BTUI, which has to stick
+// to async-signal-safe calls, since the interrupted code might be holding
+// locks (its own or stdio's):
+static volatile sig_atomic_t in_signal_handler = 0;
+
+// Decimal representations of 0-255 (for SGR codes and color components):
+static struct { char digits[3]; uint8_t len; } dec8[256];
+// Zero-padded decimal representations of 0-9999 (for coordinates), with some
+// slack at the end so four bytes can always be copied:
+static char dec4[4*10000 + 4];
+// The index of each value in the 256 color palette's 6x6x6 color cube (or -1):
+static int8_t cube_level[256];
+// The nearest 256 color and 16 color palette entries to each 15-bit RGB color
+// (filled in by btui_init_color_tables() when they're first needed):
+static uint8_t rgb_to_256[1 << 15], rgb_to_16[1 << 15];
+
+// File-local functions:
+
 /*
- * Given a file descriptor, parse an integer value, updating *c to hold the
- * next character after the integer value. Return the parsed integer value.
- * (Helper method for btui_getkey())
+ * Fill in the decimal lookup tables used for encoding escape sequences.
  */
-static inline int nextnum(int fd, int *c)
+static void btui_init_tables(void)
 {
-    int n;
-    *c = nextchar(fd);
-    for (n = 0; '0' <= *c && *c <= '9'; *c = nextchar(fd))
-        n = 10*n + (*c - '0');
-    return n;
+    static int initialized = 0;
+    if (initialized) return;
+    for (int i = 0; i < 10000; i++) {
+        dec4[4*i + 0] = (char)('0' + i / 1000);
+        dec4[4*i + 1] = (char)('0' + i / 100 % 10);
+        dec4[4*i + 2] = (char)('0' + i / 10 % 10);
+        dec4[4*i + 3] = (char)('0' + i % 10);
+    }
+    for (int i = 0; i < 256; i++) {
+        int len = i < 10 ? 1 : (i < 100 ? 2 : 3);
+        memcpy(dec8[i].digits, &dec4[4*i + 4 - len], (size_t)len);
+        dec8[i].len = (uint8_t)len;
+    }
+    memset(cube_level, -1, sizeof(cube_level));
+    for (int i = 0; i < 6; i++)
+        cube_level[i ? 55 + 40*i : 0] = (int8_t)i;
+    initialized = 1;
 }
 
 /*
- * Reset the terminal back to its normal state.
+ * Return a measure of how different two colors look (weighted squared
+ * distance, since the eye is most sensitive to green and least to blue).
  */
-static void btui_cleanup(void)
+static inline int btui_color_distance(int r1, int g1, int b1, int r2, int g2, int b2)
 {
-    if (!current_bt.out) return;
-    tcsetattr(fileno(current_bt.out), TCSANOW, &normal_termios);
-    btui_set_cursor(&current_bt, CURSOR_DEFAULT);
-    btui_set_mode(&current_bt, BTUI_MODE_UNINITIALIZED);
-    fflush(current_bt.out);
-    fclose(current_bt.in);
-    fclose(current_bt.out);
-    memset(&current_bt, 0, sizeof(btui_t));
+    return 2*(r1-r2)*(r1-r2) + 4*(g1-g2)*(g1-g2) + 3*(b1-b2)*(b1-b2);
 }
 
 /*
- * Reset the terminal back to its normal state and raise the given signal.
- * (This is used as a signal handler that gracefully exits without gunking up
- * the terminal)
+ * Fill in the lookup tables from 15-bit RGB colors to the nearest 256 color
+ * and 16 color palette entries.
  */
-static void btui_cleanup_and_raise(int sig)
+static void btui_init_color_tables(void)
 {
-    btui_mode_t mode = current_bt.mode;
-    btui_cleanup();
-    raise(sig);
-    // This code will only ever be run if sig is SIGTSTP/SIGSTOP, otherwise, raise() won't return:
-    btui_create(mode);
-    struct sigaction sa = {.sa_handler = &btui_cleanup_and_raise, .sa_flags = (int)(SA_NODEFER | SA_RESETHAND)};
-    sigaction(sig, &sa, NULL);
+    // The standard xterm colors for the first 16 palette entries:
+    static const uint8_t basic[16][3] = {
+        {0,0,0}, {205,0,0}, {0,205,0}, {205,205,0}, {0,0,238}, {205,0,205}, {0,205,205}, {229,229,229},
+        {127,127,127}, {255,0,0}, {0,255,0}, {255,255,0}, {92,92,255}, {255,0,255}, {0,255,255}, {255,255,255},
+    };
+    static int initialized = 0;
+    if (initialized) return;
+    for (int i = 0; i < (1 << 15); i++) {
+        int r = ((i >> 10) & 31) << 3 | 4, g = ((i >> 5) & 31) << 3 | 4, b = (i & 31) << 3 | 4;
+        // The first 16 palette entries vary between terminals, so only the
+        // 6x6x6 color cube and the grayscale ramp are used for 256 colors:
+#define CUBE_INDEX(v) ((v) < 48 ? 0 : ((v) < 115 ? 1 : ((v) - 35) / 40))
+#define CUBE_VALUE(n) ((n) ? 55 + 40*(n) : 0)
+        int cr = CUBE_INDEX(r), cg = CUBE_INDEX(g), cb = CUBE_INDEX(b);
+        int gray = (r + g + b) / 3;
+        gray = gray < 8 ? 0 : (gray > 238 ? 23 : (gray - 3) / 10);
+        if (gray > 23) gray = 23;
+        int cube_dist = btui_color_distance(r, g, b, CUBE_VALUE(cr), CUBE_VALUE(cg), CUBE_VALUE(cb));
+        int gray_dist = btui_color_distance(r, g, b, 8 + 10*gray, 8 + 10*gray, 8 + 10*gray);
+        rgb_to_256[i] = (uint8_t)(gray_dist < cube_dist ? 232 + gray : 16 + 36*cr + 6*cg + cb);
+#undef CUBE_INDEX
+#undef CUBE_VALUE
+
+        int best = 0, best_dist = btui_color_distance(r, g, b, basic[0][0], basic[0][1], basic[0][2]);
+        for (int c = 1; c < 16; c++) {
+            int dist = btui_color_distance(r, g, b, basic[c][0], basic[c][1], basic[c][2]);
+            if (dist < best_dist) best = c, best_dist = dist;
+        }
+        rgb_to_16[i] = (uint8_t)best;
+    }
+    initialized = 1;
 }
 
 /*
- * A signal handler used to update BTUI's internal window size values when a
- * SIGWINCH event occurs.
+ * Guess how many colors the terminal supports from the COLORTERM and TERM
+ * environment variables. Terminals that don't say otherwise are assumed to
+ * support truecolor.
  */
-static void update_term_size(int sig)
+static btui_color_depth_t btui_detect_color_depth(void)
 {
-    (void)sig;
-    struct winsize winsize;
-    ioctl(STDIN_FILENO, TIOCGWINSZ, &winsize);
-    if (winsize.ws_col != current_bt.width || winsize.ws_row != current_bt.height) {
-        current_bt.width = winsize.ws_col;
-        current_bt.height = winsize.ws_row;
-        current_bt.size_changed = 1;
+    const char *colorterm = getenv("COLORTERM");
+    if (colorterm && (strcmp(colorterm, "truecolor") == 0 || strcmp(colorterm, "24bit") == 0))
+        return BTUI_COLORS_TRUECOLOR;
+    const char *term = getenv("TERM");
+    if (!term) return BTUI_COLORS_TRUECOLOR;
+    if (strstr(term, "-direct")) return BTUI_COLORS_TRUECOLOR;
+    if (strstr(term, "256color")) return BTUI_COLORS_256;
+    static const char *const basic_terms[] = {"linux", "vt100", "vt102", "vt220", "ansi", "cons25", "screen", "tmux", "rxvt"};
+    for (size_t i = 0; i < sizeof(basic_terms)/sizeof(basic_terms[0]); i++) {
+        if (strcmp(term, basic_terms[i]) == 0)
+            return BTUI_COLORS_16;
     }
+    if (strstr(term, "-16color") || strstr(term, "-color")) return BTUI_COLORS_16;
+    return BTUI_COLORS_TRUECOLOR;
 }
 
-// Public API functions:
+/*
+ * Guess which optional escape sequences the terminal supports from the TERM,
+ * XTERM_VERSION and VTE_VERSION environment variables. Pretty much everything
+ * since the VT220 can erase characters, but only xterm can fill rectangles.
+ */
+static int btui_detect_capabilities(void)
+{
+    const char *term = getenv("TERM");
+    if (!term || strcmp(term, "dumb") == 0 || strncmp(term, "vt100", 5) == 0 || strncmp(term, "vt102", 5) == 0)
+        return 0;
+    int caps = BTUI_CAP_ECH;
+    if (strncmp(term, "xterm", 5) == 0 && getenv("XTERM_VERSION"))
+        return caps | BTUI_CAP_REP | BTUI_CAP_RECT;
+    const char *vte = getenv("VTE_VERSION");
+    if (vte && atoi(vte) >= 5400)
+        caps |= BTUI_CAP_REP;
+    static const char *const rep_terms[] = {"xterm-kitty", "foot", "foot-extra", "mintty", "mlterm", "contour"};
+    for (size_t i = 0; i < sizeof(rep_terms)/sizeof(rep_terms[0]); i++) {
+        if (strcmp(term, rep_terms[i]) == 0)
+            caps |= BTUI_CAP_REP;
+    }
+    return caps;
+}
 
 /*
- * Clear all or part of the screen. `mode` should be one of:
- *   BTUI_CLEAR_(BELOW|ABOVE|SCREEN|RIGHT|LEFT|LINE)
+ * Return the pen color for an RGB color on the terminal: the nearest palette
+ * color if the terminal doesn't support truecolor, or the exact palette color
+ * if there is one (since it's shorter to encode).
  */
-int btui_clear(btui_t *bt, int mode)
+static inline uint32_t btui_rgb_color(const btui_t *bt, uint32_t rgb)
 {
-    switch (mode) {
-        case BTUI_CLEAR_BELOW:  return fputs("\033[J", bt->out);
-        case BTUI_CLEAR_ABOVE:  return fputs("\033[1J", bt->out);
-        case BTUI_CLEAR_SCREEN: return fputs("\033[2J", bt->out);
-        case BTUI_CLEAR_RIGHT:  return fputs("\033[K", bt->out);
-        case BTUI_CLEAR_LEFT:   return fputs("\033[1K", bt->out);
-        case BTUI_CLEAR_LINE:   return fputs("\033[2K", bt->out);
-        default:                return -1;
+    unsigned int r = (rgb >> 16) & 0xFFu, g = (rgb >> 8) & 0xFFu, b = rgb & 0xFFu;
+    unsigned int rgb15 = (r >> 3) << 10 | (g >> 3) << 5 | (b >> 3);
+    switch (bt->color_depth) {
+        case BTUI_COLORS_16: {
+            uint32_t n = rgb_to_16[rgb15];
+            return n < 8 ? (BTUI_COLOR_BASIC | n) : (BTUI_COLOR_PALETTE | n);
+        }
+        case BTUI_COLORS_256: return BTUI_COLOR_PALETTE | rgb_to_256[rgb15];
+        case BTUI_COLORS_AUTO: case BTUI_COLORS_TRUECOLOR: default: {
+            if (cube_level[r] >= 0 && cube_level[g] >= 0 && cube_level[b] >= 0)
+                return BTUI_COLOR_PALETTE | (uint32_t)(16 + 36*cube_level[r] + 6*cube_level[g] + cube_level[b]);
+            if (r == g && g == b && r >= 8 && r <= 238 && (r - 8) % 10 == 0)
+                return BTUI_COLOR_PALETTE | (232 + (r - 8) / 10);
+            return BTUI_COLOR_RGB | (rgb & 0xFFFFFFu);
+        }
     }
 }
 
 /*
- * Disable TUI mode (return to the normal terminal with the normal terminal
- * input handling).
+ * Encode a number from 0-255 in decimal at `p` and return the end of the
+ * encoding. (There must be room for 3 bytes at `p`.)
  */
-void btui_disable(btui_t *bt)
+static inline char *btui_enc_u8(char *p, unsigned int n)
 {
-    (void)bt;
-    btui_cleanup();
+    memcpy(p, dec8[n & 0xFF].digits, 3);
+    return p + dec8[n & 0xFF].len;
 }
 
 /*
- * Draw a box using the special box-drawing characters at the given x,y
- * position with the given width,height.
+ * Encode a number from 0-9999 in decimal at `p` and return the end of the
+ * encoding. (There must be room for 4 bytes at `p`.)
  */
-void btui_draw_linebox(btui_t *bt, int x, int y, int w, int h)
+static inline char *btui_enc_dec4(char *p, int n)
 {
-    btui_move_cursor(bt, x-1, y-1);
-    // Top row
-    fputs("\033(0l", bt->out);
-    for (int i = 0; i < w; i++)
-       fputc('q', bt->out);
-    fputc('k', bt->out);
-    // Side walls
-    for (int i = 0; i < h; i++) {
-        btui_move_cursor(bt, x-1, y + i);
-        fputc('x', bt->out);
-        btui_move_cursor(bt, x + w, y + i);
-        fputc('x', bt->out);
-    }
-    // Bottom row
-    btui_move_cursor(bt, x-1, y + h);
-    fputc('m', bt->out);
-    for (int i = 0; i < w; i++)
-       fputc('q', bt->out);
-    fputs("j\033(B", bt->out);
+    int len = n < 10 ? 1 : (n < 100 ? 2 : (n < 1000 ? 3 : 4));
+    memcpy(p, &dec4[4*n + 4 - len], 4);
+    return p + len;
 }
 
 /*
- * Draw a shadow to the bottom right of the given box coordinates.
+ * Encode a nonnegative number in decimal at `p` and return the end of the
+ * encoding. Negative numbers are encoded as 0. (There must be room for 8 bytes
+ * at `p`.)
  */
-void btui_draw_shadow(btui_t *bt, int x, int y, int w, int h)
+static inline char *btui_enc_num(char *p, int n)
 {
-    fputs("\033(0", bt->out);
-    for (int i = 0; i < h-1; i++) {
-        btui_move_cursor(bt, x + w, y + 1 + i);
-        fputc('a', bt->out);
+    if (n < 0) n = 0;
+    if (n < 10000) return btui_enc_dec4(p, n);
+    if (n > 99999999) n = 99999999;
+    p = btui_enc_dec4(p, n / 10000);
+    memcpy(p, &dec4[4*(n % 10000)], 4);
+    return p + 4;
+}
+
+/*
+ * Make sure there is room for `n` more bytes in the output buffer and return a
+ * pointer to where they should be written, or NULL if memory couldn't be
+ * allocated. Use btui_commit() after writing.
+ */
+static char *btui_reserve(btui_t *bt, size_t n)
+{
+    if (bt->outlen + n > bt->outsize) {
+        size_t size = bt->outsize ? bt->outsize : 4096;
+        while (size < bt->outlen + n) size *= 2;
+        char *buf = realloc(bt->outbuf, size);
+        if (!buf) return NULL;
+        bt->outbuf = buf;
+        bt->outsize = size;
     }
-    btui_move_cursor(bt, x + 1, y + h);
-    for (int i = 0; i < w; i++) {
-        fputc('a', bt->out);
+    return &bt->outbuf[bt->outlen];
+}
+
+/*
+ * Add the bytes written after btui_reserve() (up to `end`) to the output and
+ * return how many there were.
+ */
+static inline int btui_commit(btui_t *bt, char *end)
+{
+    int len = (int)(end - &bt->outbuf[bt->outlen]);
+    bt->outlen += (size_t)len;
+    return len;
+}
+
+/*
+ * Add bytes to the output buffer and return how many were added.
+ */
+static int btui_out(btui_t *bt, const char *s, size_t len)
+{
+    char *p = btui_reserve(bt, len);
+    if (!p) return 0;
+    memcpy(p, s, len);
+    bt->outlen += len;
+    return (int)len;
+}
+#define btui_out_literal(bt, s) btui_out(bt, s, sizeof(s) - 1)
+
+/*
+ * Return the current time on the monotonic clock in microseconds.
+ */
+static uint64_t btui_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * UINT64_C(1000000) + (uint64_t)now.tv_nsec / UINT64_C(1000);
+}
+
+#ifndef BTUI_NO_THREADS
+// A ring of output shared with a writer thread. The drawing thread only ever
+// moves `head` and the writer thread only ever moves `tail`, so handing over
+// output doesn't need a lock. The lock is only for going to sleep and waking
+// up when the ring is empty (writer thread) or full (drawing thread).
+typedef struct btui_writer_s {
+    char *buf;
+    size_t size;
+    size_t head, tail; // How many bytes have ever been added/written
+    int fd;
+    int stop;
+    int abandoned; // Set by btui_writer_abandon(), after which the thread writes nothing more
+    int thread_asleep, drawer_asleep; // Whether the writer/drawing thread is waiting
+    uint64_t writes; // How many write() calls the thread has made
+    pid_t pid;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready, space;
+} btui_writer_t;
+
+/*
+ * The writer thread: write whatever is in the ring to the terminal until
+ * told to stop, then exit once everything has been written.
+ */
+static void *btui_writer_run(void *arg)
+{
+    btui_writer_t *w = arg;
+    for (;;) {
+        size_t tail = w->tail, head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            pthread_mutex_lock(&w->lock);
+            __atomic_store_n(&w->thread_asleep, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&w->head, __ATOMIC_SEQ_CST) == tail && !w->stop)
+                pthread_cond_wait(&w->ready, &w->lock);
+            __atomic_store_n(&w->thread_asleep, 0, __ATOMIC_SEQ_CST);
+            int done = w->stop && __atomic_load_n(&w->head, __ATOMIC_SEQ_CST) == tail;
+            pthread_mutex_unlock(&w->lock);
+            if (done) return NULL;
+            continue;
+        }
+
+        // A signal handler has taken over what's left:
+        if (__atomic_load_n(&w->abandoned, __ATOMIC_SEQ_CST)) return NULL;
+        size_t start = tail & (w->size - 1), n = head - tail;
+        if (n > w->size - start) n = w->size - start;
+        ssize_t written = write(w->fd, &w->buf[start], n);
+#ifndef BTUI_NO_STATS
+        __atomic_add_fetch(&w->writes, 1, __ATOMIC_RELAXED);
+#endif
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = {.fd = w->fd, .events = POLLOUT};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            // The terminal is gone, so the output is thrown away:
+            written = (ssize_t)n;
+        }
+        __atomic_store_n(&w->tail, tail + (size_t)written, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&w->drawer_asleep, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&w->lock);
+            pthread_cond_signal(&w->space);
+            pthread_mutex_unlock(&w->lock);
+        }
     }
-    fputs("\033(B", bt->out);
 }
 
 /*
- * Enable TUI mode for this terminal and return a pointer to the BTUI struct
- * that should be passed to future API calls.
+ * Start a writer thread for the given file descriptor. Returns NULL on
+ * failure.
  */
-btui_t *btui_create(btui_mode_t mode)
+static btui_writer_t *btui_writer_start(int fd)
 {
-    FILE *in = fopen("/dev/tty", "r");
-    if (!in) return NULL;
-    FILE *out = fopen("/dev/tty", "w");
-    if (!out) {
-        fclose(in);
+    btui_writer_t *w = calloc(1, sizeof(btui_writer_t));
+    if (!w) return NULL;
+    w->buf = malloc(BTUI_WRITER_BUFSIZE);
+    if (!w->buf) {
+        free(w);
         return NULL;
     }
-
-    if (tcgetattr(fileno(in), &normal_termios)
-      || tcgetattr(fileno(in), &tui_termios)
-      || (cfmakeraw(&tui_termios),
-         tcsetattr(fileno(out), TCSANOW, &tui_termios))) {
-        fclose(in);
-        fclose(out);
+    w->size = BTUI_WRITER_BUFSIZE;
+    w->fd = fd;
+    w->pid = getpid();
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->ready, NULL);
+    pthread_cond_init(&w->space, NULL);
+    // Signals should be handled by the program's threads, not this one:
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int err = pthread_create(&w->thread, NULL, btui_writer_run, w);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err) {
+        pthread_cond_destroy(&w->space);
+        pthread_cond_destroy(&w->ready);
+        pthread_mutex_destroy(&w->lock);
+        free(w->buf);
+        free(w);
         return NULL;
     }
-
-    current_bt.in = in;
-    current_bt.out = out;
-    current_bt.mode = BTUI_MODE_NORMAL;
-    atexit(btui_cleanup);
-
-    struct sigaction sa_winch = {.sa_handler = &update_term_size};
-    sigaction(SIGWINCH, &sa_winch, NULL);
-    int signals[] = {SIGTERM, SIGINT, SIGXCPU, SIGXFSZ, SIGVTALRM, SIGPROF, SIGSEGV, SIGTSTP, SIGPIPE};
-    struct sigaction sa = {.sa_handler = &btui_cleanup_and_raise, .sa_flags = (int)(SA_NODEFER | SA_RESETHAND)};
-    for (size_t i = 0; i < sizeof(signals)/sizeof(signals[0]); i++)
-        sigaction(signals[i], &sa, NULL);
-
-    update_term_size(SIGWINCH);
-    current_bt.size_changed = 0;
-    btui_set_mode(&current_bt, mode);
-    return &current_bt;
+    return w;
 }
 
 /*
- * Set the display mode of BTUI
+ * Wait for the writer thread to write everything in its ring, then stop it
+ * and free it. After a fork(), the child doesn't have the thread, so it just
+ * frees the memory. Returns how many write() calls the thread made.
  */
-void btui_set_mode(btui_t *bt, btui_mode_t mode)
+static uint64_t btui_writer_stop(btui_writer_t *w)
 {
-    if (mode == bt->mode) return;
-    switch (mode) {
-        case BTUI_MODE_NORMAL: case BTUI_MODE_UNINITIALIZED:
-            if (bt->mode == BTUI_MODE_TUI)
-                fputs(T_OFF(T_ALT_SCREEN), bt->out);
-            fputs(T_ON(T_SHOW_CURSOR ";" T_WRAP) T_OFF(T_MOUSE_XY ";" T_MOUSE_CELL ";" T_MOUSE_SGR) "\033[0m", bt->out);
-            break;
-        case BTUI_MODE_TUI:
-            fputs(T_OFF(T_SHOW_CURSOR ";" T_WRAP)  T_ON(T_ALT_SCREEN ";" T_MOUSE_XY ";" T_MOUSE_CELL ";" T_MOUSE_SGR), bt->out);
-            break;
-        default: break;
+    if (w->pid == getpid()) {
+        pthread_mutex_lock(&w->lock);
+        w->stop = 1;
+        pthread_cond_signal(&w->ready);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+        pthread_cond_destroy(&w->space);
+        pthread_cond_destroy(&w->ready);
+        pthread_mutex_destroy(&w->lock);
     }
-    fflush(bt->out);
-    bt->mode = mode;
+    uint64_t writes = w->writes;
+    free(w->buf);
+    free(w);
+    return writes;
 }
 
 /*
- * Fill the given rectangular area (x,y coordinates and width,height) with
- * spaces.
+ * Stop using the writer thread from a signal handler, where it can't be
+ * stopped properly: the interrupted thread might hold the lock, and the writer
+ * thread might be stuck on a terminal that isn't reading. This only makes
+ * async-signal-safe calls. It tells the thread not to write anything more,
+ * then writes what's left in the ring itself, giving up if the terminal
+ * hasn't taken it within BTUI_ABANDON_MS. `w->fd` should be non-blocking. The
+ * thread, lock and memory are left alone (and leaked). At worst, whatever the
+ * thread was in the middle of writing comes out twice. Returns 0 if everything
+ * was written, or -1 if not.
  */
-void btui_fill_box(btui_t *bt, int x, int y, int w, int h)
+static int btui_writer_abandon(btui_writer_t *w)
 {
-    int left = x, bottom = y + h;
-    for ( ; y < bottom; y++) {
-        x = left;
-        btui_move_cursor(bt, x, y);
-        for ( ; x < left + w; x++) {
-            fputc(' ', bt->out);
+    __atomic_store_n(&w->abandoned, 1, __ATOMIC_SEQ_CST);
+    size_t tail = __atomic_load_n(&w->tail, __ATOMIC_SEQ_CST), head = __atomic_load_n(&w->head, __ATOMIC_SEQ_CST);
+    uint64_t deadline = btui_now() + BTUI_ABANDON_MS * UINT64_C(1000);
+    while (tail != head) {
+        size_t start = tail & (w->size - 1), n = head - tail;
+        if (n > w->size - start) n = w->size - start;
+        ssize_t written = write(w->fd, &w->buf[start], n);
+        if (written > 0) {
+            tail += (size_t)written;
+            continue;
+        } else if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written == 0 || errno != EAGAIN) {
+            return -1;
         }
+        uint64_t now = btui_now();
+        if (now >= deadline) return -1;
+        struct pollfd pfd = {.fd = w->fd, .events = POLLOUT};
+        poll(&pfd, 1, (int)((deadline - now + 999) / 1000));
+    }
+    return 0;
+}
+
+/*
+ * Add as much of `buf` to the writer thread's ring as will fit. Returns the
+ * number of bytes added, or -1 (with errno set to EAGAIN) if the ring is full.
+ */
+static ssize_t btui_writer_push(btui_writer_t *w, const char *buf, size_t len)
+{
+    size_t head = w->head, tail = __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+    size_t n = w->size - (head - tail);
+    if (n == 0) {
+        errno = EAGAIN;
+        return -1;
     }
+    if (n > len) n = len;
+    size_t start = head & (w->size - 1), first = w->size - start < n ? w->size - start : n;
+    memcpy(&w->buf[start], buf, first);
+    memcpy(w->buf, buf + first, n - first);
+    __atomic_store_n(&w->head, head + n, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->thread_asleep, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&w->lock);
+        pthread_cond_signal(&w->ready);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return (ssize_t)n;
 }
 
 /*
- * Flush BTUI's output.
+ * Wait until there is room in the writer thread's ring.
  */
-int btui_flush(btui_t *bt)
+static void btui_writer_wait(btui_writer_t *w)
 {
-    return fflush(bt->out);
+    pthread_mutex_lock(&w->lock);
+    __atomic_store_n(&w->drawer_asleep, 1, __ATOMIC_SEQ_CST);
+    while (w->head - __atomic_load_n(&w->tail, __ATOMIC_SEQ_CST) == w->size)
+        pthread_cond_wait(&w->space, &w->lock);
+    __atomic_store_n(&w->drawer_asleep, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&w->lock);
 }
+#endif
 
 /*
- * Close BTUI files and prevent cleaning up (useful for fork/exec)
+ * Return which bucket of the latency histogram a latency (in microseconds)
+ * belongs in, and the smallest latency that belongs in a bucket.
  */
-void btui_force_close(btui_t *bt)
+static inline int btui_latency_bucket(uint64_t us)
 {
-    if (!bt->out) return;
-    fclose(bt->in);
-    fclose(bt->out);
-    memset(bt, 0, sizeof(btui_t));
+    if (us < 8) return (int)us;
+    int log2 = 63 - __builtin_clzll(us);
+    int bucket = (log2 - 2) * 8 + (int)((us >> (log2 - 3)) & 7);
+    return bucket < BTUI_LATENCY_BUCKETS ? bucket : BTUI_LATENCY_BUCKETS - 1;
+}
+
+static inline uint64_t btui_latency_floor(int bucket)
+{
+    if (bucket < 8) return (uint64_t)bucket;
+    return (uint64_t)(8 + bucket % 8) << (bucket / 8 - 1);
 }
 
 /*
- * Get one key of input from the given file. Returns -1 on failure.
- * If mouse_x or mouse_y are non-null and a mouse event occurs, they will be
- * set to the position of the mouse (0-indexed).
+ * Mark any input that has been read as answered by a completed flush, and
+ * record how long it waited in the latency histogram.
  */
-int btui_getkey(btui_t *bt, int timeout, int *mouse_x, int *mouse_y)
+static void btui_answer_input(btui_t *bt)
 {
-    int new_vmin = timeout < 0 ? 1 : 0, new_vtime = timeout < 0 ? 0 : timeout;
-    if (new_vmin != tui_termios.c_cc[VMIN] || new_vtime != tui_termios.c_cc[VTIME]) {
-        tui_termios.c_cc[VMIN] = new_vmin;
-        tui_termios.c_cc[VTIME] = new_vtime;
-        if (tcsetattr(fileno(bt->out), TCSANOW, &tui_termios) == -1)
-            return -1;
-    }
+#ifdef BTUI_NO_STATS
+    (void)bt;
+#else
+    if (!bt->unanswered) return;
+    uint64_t us = btui_now() - bt->unanswered;
+    bt->unanswered = 0;
+    ++bt->latency.buckets[btui_latency_bucket(us)];
+    ++bt->latency.count;
+    if (us > bt->latency.max) bt->latency.max = us;
+#endif
+}
 
-    if (mouse_x) *mouse_x = -1;
-    if (mouse_y) *mouse_y = -1;
-    int fd = fileno(bt->in);
-    int numcode = 0, modifiers = 0;
-    int c = nextchar(fd);
-    if (c == '\x1b') {
-        goto escape;
-    } else if (c == -1 && bt->size_changed) {
-        bt->size_changed = 0;
-        return RESIZE_EVENT;
-    }
+// A ring of timestamped chunks of output ('o'), input ('i') and resizes
+// ('r'). Each chunk is a btui_trace_record_t followed by its data, and when
+// the ring is full, the oldest chunks are dropped to make room.
+typedef struct {
+    uint64_t time; // Microseconds since tracing started
+    uint32_t len;
+    char kind;
+} btui_trace_record_t;
 
-    return c;
+typedef struct btui_trace_s {
+    char *buf;
+    size_t size;
+    size_t head, tail; // How many bytes have ever been added/dropped
+    uint64_t start; // When tracing started (monotonic clock)
+    time_t started; // When tracing started (wall clock)
+    int width, height; // The terminal size when tracing started
+    char *path; // Where to save the trace when BTUI is disabled (or NULL)
+} btui_trace_t;
 
-  escape:
-    c = nextchar(fd);
-    // Actual escape key:
-    if (c < 0)
-        return KEY_ESC;
+/*
+ * Copy bytes into the trace ring at position `pos`, wrapping around the end.
+ */
+static void btui_trace_put(btui_trace_t *t, size_t pos, const void *data, size_t len)
+{
+    size_t start = pos % t->size, first = len < t->size - start ? len : t->size - start;
+    memcpy(&t->buf[start], data, first);
+    memcpy(t->buf, (const char*)data + first, len - first);
+}
 
-    switch (c) {
-        case '\x1b': return KEY_ESC;
-        case '[': c = nextchar(fd); goto CSI_start;
-        case 'P': goto DCS;
-        case 'O': goto SS3;
-        default: return MOD_ALT | c;
+/*
+ * Copy bytes out of the trace ring from position `pos`, wrapping around the
+ * end.
+ */
+static void btui_trace_get(const btui_trace_t *t, size_t pos, void *data, size_t len)
+{
+    size_t start = pos % t->size, first = len < t->size - start ? len : t->size - start;
+    memcpy(data, &t->buf[start], first);
+    memcpy((char*)data + first, t->buf, len - first);
+}
+
+/*
+ * Add a timestamped chunk to the trace, dropping the oldest chunks if there
+ * isn't room. Chunks too big for the ring are cut short.
+ */
+static void btui_trace_record(btui_trace_t *t, char kind, const char *data, size_t len)
+{
+    if (len > t->size - sizeof(btui_trace_record_t))
+        len = t->size - sizeof(btui_trace_record_t);
+    btui_trace_record_t record = {.time = btui_now() - t->start, .len = (uint32_t)len, .kind = kind};
+    while (t->size - (t->head - t->tail) < sizeof(record) + len) {
+        btui_trace_record_t oldest;
+        btui_trace_get(t, t->tail, &oldest, sizeof(oldest));
+        t->tail += sizeof(oldest) + oldest.len;
     }
+    btui_trace_put(t, t->head, &record, sizeof(record));
+    btui_trace_put(t, t->head + sizeof(record), data, len);
+    t->head += sizeof(record) + len;
+}
 
-  CSI_start:
-    if (c == -1)
-        return MOD_ALT | '[';
+/*
+ * Save the trace to its path (if it has one) and free it.
+ */
+static void btui_trace_finish(btui_t *bt)
+{
+    if (!bt->trace) return;
+    if (bt->trace->path) btui_trace_dump(bt, bt->trace->path);
+    btui_set_trace(bt, 0);
+}
 
-    switch (c) {
-        case 'A': return modifiers | KEY_ARROW_UP;
-        case 'B': return modifiers | KEY_ARROW_DOWN;
+/*
+ * Hand bytes off to the terminal (or the writer thread) without waiting.
+ * Returns the number of bytes taken or -1 on failure, like write().
+ */
+static ssize_t btui_send(btui_t *bt, const char *buf, size_t len)
+{
+    ssize_t sent;
+    if (bt->vt) {
+        btui_vt_feed(bt->vt, buf, len);
+        BTUI_COUNT(bt, writes, 1);
+        sent = (ssize_t)len;
+#ifndef BTUI_NO_THREADS
+    } else if (bt->writer) {
+        sent = btui_writer_push(bt->writer, buf, len);
+#endif
+    } else {
+        sent = write(fileno(bt->out), buf, len);
+        BTUI_COUNT(bt, writes, 1);
+    }
+    if (sent > 0) {
+        BTUI_COUNT(bt, bytes_written, sent);
+        if (bt->trace) btui_trace_record(bt->trace, 'o', buf, (size_t)sent);
+    }
+    return sent;
+}
+
+/*
+ * Write as much of the output buffer as the terminal will take right now
+ * without waiting. Whatever doesn't fit stays at the front of the buffer as
+ * `pending` bytes, and goes out first on the next flush. Returns 0 on success.
+ */
+static int btui_flush_output_nonblocking(btui_t *bt)
+{
+    if (bt->out && !in_signal_handler && fflush(bt->out) != 0) return -1;
+    size_t len = bt->outlen;
+    if (bt->synchronized && len > bt->pending) {
+        // The frame might not all be written now, so it's wrapped in place:
+        static const char sync_on[] = T_ON(T_SYNC), sync_off[] = T_OFF(T_SYNC);
+        size_t on = sizeof(sync_on) - 1, off = sizeof(sync_off) - 1;
+        if (!btui_reserve(bt, on + off)) return -1;
+        char *frame = &bt->outbuf[bt->pending];
+        memmove(frame + on, frame, len - bt->pending);
+        memcpy(frame, sync_on, on);
+        memcpy(&bt->outbuf[len + on], sync_off, off);
+        len += on + off;
+    }
+
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t written = btui_send(bt, &bt->outbuf[sent], len - sent);
+        if (written >= 0) {
+            sent += (size_t)written;
+        } else if (errno == EAGAIN) {
+            break;
+        } else if (errno != EINTR) {
+            bt->outlen = bt->pending = 0;
+            return -1;
+        }
+    }
+    memmove(bt->outbuf, &bt->outbuf[sent], len - sent);
+    bt->outlen = bt->pending = len - sent;
+    return 0;
+}
+
+/*
+ * Write out everything in the output buffer with as few write() calls as
+ * possible (ideally one), so the terminal sees each frame in one piece. If
+ * synchronized output is enabled, the frame is wrapped in begin/end
+ * synchronized update sequences so terminals that support it won't draw a
+ * half-finished frame. Returns 0 on success.
+ */
+static int btui_flush_output(btui_t *bt)
+{
+    // A virtual terminal takes everything at once:
+    if (bt->vt) return btui_flush_output_nonblocking(bt);
+#ifndef BTUI_NO_THREADS
+    if (bt->writer) {
+        // The writer thread does the writing, this just waits for room:
+        if (btui_flush_output_nonblocking(bt)) return -1;
+        while (bt->pending > 0) {
+            btui_writer_wait(bt->writer);
+            if (btui_flush_output_nonblocking(bt)) return -1;
+        }
+        return 0;
+    }
+#endif
+    static char sync_on[] = T_ON(T_SYNC), sync_off[] = T_OFF(T_SYNC);
+    size_t len = bt->outlen, pending = bt->pending;
+    bt->outlen = bt->pending = 0;
+    // Anything written to the FILE directly has to come out first:
+    if (!in_signal_handler && fflush(bt->out) != 0) return -1;
+    if (len == 0) return 0;
+
+    struct iovec iov[4];
+    int iovcnt = 0;
+    // Leftovers from non-blocking flushes were already wrapped:
+    if (pending > 0)
+        iov[iovcnt++] = (struct iovec){.iov_base = bt->outbuf, .iov_len = pending};
+    if (len > pending) {
+        if (bt->synchronized)
+            iov[iovcnt++] = (struct iovec){.iov_base = sync_on, .iov_len = sizeof(sync_on) - 1};
+        iov[iovcnt++] = (struct iovec){.iov_base = &bt->outbuf[pending], .iov_len = len - pending};
+        if (bt->synchronized)
+            iov[iovcnt++] = (struct iovec){.iov_base = sync_off, .iov_len = sizeof(sync_off) - 1};
+    }
+
+    int fd = fileno(bt->out);
+    for (struct iovec *v = iov, *end = &iov[iovcnt]; v < end; ) {
+        ssize_t written = writev(fd, v, (int)(end - v));
+        BTUI_COUNT(bt, writes, 1);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        BTUI_COUNT(bt, bytes_written, written);
+        // Skip past whatever got written (this may be a partial write):
+        size_t n = (size_t)written;
+        for (struct iovec *t = v; bt->trace && t < end && n > 0; t++) {
+            size_t part = n < t->iov_len ? n : t->iov_len;
+            btui_trace_record(bt->trace, 'o', t->iov_base, part);
+            n -= part;
+        }
+        n = (size_t)written;
+        while (v < end && n >= v->iov_len)
+            n -= v++->iov_len;
+        if (v < end) {
+            v->iov_base = (char*)v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Update BTUI's internal window size values from the terminal.
+ */
+static void update_term_size(btui_t *bt)
+{
+    struct winsize winsize;
+    if (!bt->out || ioctl(fileno(bt->out), TIOCGWINSZ, &winsize) == -1) return;
+    if (winsize.ws_col != bt->width || winsize.ws_row != bt->height) {
+        bt->width = winsize.ws_col;
+        bt->height = winsize.ws_row;
+        bt->size_changed = 1;
+        bt->cursor_x = bt->cursor_y = -1;
+    }
+}
+
+/*
+ * Close the resize pipe.
+ */
+static void btui_close_resize_pipe(void)
+{
+    for (int i = 0; i < 2; i++) {
+        if (resize_pipe[i] != -1) close(resize_pipe[i]);
+        resize_pipe[i] = -1;
+    }
+}
+
+/*
+ * Drain the resize pipe after one or more SIGWINCHs, wait for the burst of
+ * resizes to settle down (but not for too long), then update the size.
+ */
+static void btui_handle_resize(btui_t *bt)
+{
+    char buf[64];
+    struct pollfd pfd = {.fd = resize_pipe[0], .events = POLLIN};
+    for (int i = 0; i < 10; i++) {
+        while (read(resize_pipe[0], buf, sizeof(buf)) > 0)
+            continue;
+        if (poll(&pfd, 1, BTUI_RESIZE_DEBOUNCE) == 0)
+            break;
+    }
+    update_term_size(bt);
+    if (bt->trace && bt->size_changed) {
+        char size[32];
+        btui_trace_record(bt->trace, 'r', size, (size_t)sprintf(size, "%dx%d", bt->width, bt->height));
+    }
+}
+
+/*
+ * Wait up to `timeout_ms` milliseconds (forever if negative) for input to be
+ * available. Returns a positive number if there is input to read, 0 if the
+ * timeout expired or the terminal was resized (bt->size_changed), or -1 on
+ * failure.
+ */
+static int btui_wait_input(btui_t *bt, int timeout_ms)
+{
+    struct pollfd pfds[2] = {
+        {.fd = fileno(bt->in), .events = POLLIN},
+        {.fd = bt->controlling ? resize_pipe[0] : -1, .events = POLLIN},
+    };
+    uint64_t deadline = timeout_ms > 0 ? btui_now() + (uint64_t)timeout_ms * 1000 : 0;
+    for (;;) {
+        int ret = poll(pfds, 2, timeout_ms);
+        if (ret < 0 && errno != EINTR) return -1;
+        if (ret > 0 && pfds[1].revents) {
+            btui_handle_resize(bt);
+            if (bt->size_changed) return 0;
+        }
+        if (ret > 0 && pfds[0].revents) return ret;
+        if (ret == 0 || timeout_ms == 0) return 0;
+        if (timeout_ms > 0) {
+            // Keep waiting for whatever time is left:
+            uint64_t now = btui_now();
+            if (now >= deadline) return 0;
+            timeout_ms = (int)((deadline - now + 999) / 1000);
+        }
+    }
+}
+
+/*
+ * Refill the (empty) input buffer with as much input as is available in a
+ * single read(), waiting up to `timeout_ms` milliseconds (or forever, if
+ * negative) for some to arrive. Returns the number of bytes read, or -1 on
+ * failure or timeout.
+ */
+static int btui_read_input(btui_t *bt, int timeout_ms)
+{
+    bt->inpos = bt->inlen = 0;
+#ifndef BTUI_NO_STATS
+    uint64_t start = timeout_ms != 0 ? btui_now() : 0;
+    int ready = btui_wait_input(bt, timeout_ms);
+    if (timeout_ms != 0) BTUI_COUNT(bt, wait_us, btui_now() - start);
+#else
+    int ready = btui_wait_input(bt, timeout_ms);
+#endif
+    if (ready <= 0) return -1;
+    ssize_t len = read(fileno(bt->in), bt->inbuf, sizeof(bt->inbuf));
+    if (len <= 0) return -1;
+    BTUI_COUNT(bt, bytes_read, len);
+    if (bt->trace) btui_trace_record(bt->trace, 'i', bt->inbuf, (size_t)len);
+    bt->inlen = (size_t)len;
+    bt->intime = btui_now();
+    return (int)len;
+}
+
+/* 
+ * Return the next character of input, or -1 if no character is available.
+ * Characters come from the input buffer, and if it runs dry in the middle of a
+ * sequence, wait up to BTUI_ESCAPE_TIMEOUT milliseconds for the rest of it.
+ * (Helper method for nextnum() and btui_getkey())
+ */
+static inline int nextchar(btui_t *bt)
+{
+    if (bt->inpos >= bt->inlen && btui_read_input(bt, BTUI_ESCAPE_TIMEOUT) < 0)
+        return -1;
+    return (unsigned char)bt->inbuf[bt->inpos++];
+}
+
+/*
+ * Parse an integer value from the input, updating *c to hold the next
+ * character after the integer value. Return the parsed integer value, which
+ * is capped at BTUI_MAX_PARAM so that long runs of digits can't overflow.
+ * (Helper method for btui_getkey())
+ */
+static inline int nextnum(btui_t *bt, int *c)
+{
+    int n;
+    *c = nextchar(bt);
+    for (n = 0; '0' <= *c && *c <= '9'; *c = nextchar(bt))
+        n = 10*n + (*c - '0') < BTUI_MAX_PARAM ? 10*n + (*c - '0') : BTUI_MAX_PARAM;
+    return n;
+}
+
+/*
+ * Return the number of columns a Unicode codepoint takes up in the terminal:
+ * 0 for combining marks and other invisible characters, 2 for wide characters
+ * (like CJK ideographs and most emoji), and 1 for everything else.
+ */
+static inline int btui_codepoint_width(uint32_t codepoint)
+{
+    if (codepoint < 0x40000)
+        return (width_block_data[width_blocks[codepoint >> 8]][(codepoint & 0xFF) >> 2] >> (2*(codepoint & 3))) & 3;
+    // Tags and variation selectors are invisible, everything else up here is narrow:
+    return (0xE0000 <= codepoint && codepoint <= 0xE0FFF) ? 0 : 1;
+}
+
+/*
+ * Decode the UTF-8 character at `p` (which must be before `end`), store it in
+ * *codepoint, and return how many bytes it took up. Invalid bytes are decoded
+ * one at a time as U+FFFD (the replacement character).
+ */
+static inline int btui_utf8_decode(const unsigned char *p, const unsigned char *end, uint32_t *codepoint)
+{
+    int len = *p < 0x80 ? 1 : (*p < 0xC2 ? 0 : (*p < 0xE0 ? 2 : (*p < 0xF0 ? 3 : (*p < 0xF5 ? 4 : 0))));
+    if (len == 0 || end - p < len) {
+        *codepoint = 0xFFFD;
+        return 1;
+    }
+    uint32_t c = len == 1 ? *p : (uint32_t)(*p & (0x7F >> len));
+    for (int i = 1; i < len; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *codepoint = 0xFFFD;
+            return 1;
+        }
+        c = (c << 6) | (p[i] & 0x3Fu);
+    }
+    *codepoint = c;
+    return len;
+}
+
+/*
+ * Return the index of the first byte that differs between `a` and `b`, or `n`
+ * if the first `n` bytes are identical.
+ */
+static inline size_t btui_memdiff(const void *a, const void *b, size_t n)
+{
+    const unsigned char *p = a, *q = b;
+    size_t i = 0;
+#if defined(__AVX2__)
+    for ( ; i + 32 <= n; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(const void*)&p[i]),
+                                       _mm256_loadu_si256((const __m256i*)(const void*)&q[i]));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(eq);
+        if (mask != 0xFFFFFFFFu) return i + (size_t)__builtin_ctz(~mask);
+    }
+#elif defined(__SSE2__)
+    for ( ; i + 16 <= n; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(const void*)&p[i]),
+                                    _mm_loadu_si128((const __m128i*)(const void*)&q[i]));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(eq);
+        if (mask != 0xFFFFu) return i + (size_t)__builtin_ctz(~mask);
+    }
+#endif
+    for ( ; i + 8 <= n; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, &p[i], sizeof(x));
+        memcpy(&y, &q[i], sizeof(y));
+        if (x != y) break;
+    }
+    for ( ; i < n; i++)
+        if (p[i] != q[i]) return i;
+    return n;
+}
+
+/*
+ * Apply the given text attributes to a pen the same way the terminal would.
+ * Attributes that BTUI doesn't track (like alternative fonts) are ignored.
+ */
+static void btui_pen_apply(btui_pen_t *pen, attr_t attrs)
+{
+    while (attrs) {
+        int code = __builtin_ctzll(attrs);
+        attrs &= attrs - 1;
+        if (code == 0) {
+            pen->attrs = 0;
+            pen->fg = pen->bg = BTUI_COLOR_DEFAULT;
+        } else if ((1 <= code && code <= 9) || code == 20 || code == 21 || (51 <= code && code <= 53)) {
+            pen->attrs |= 1ul << code;
+        } else if (30 <= code && code <= 37) {
+            pen->fg = BTUI_COLOR_BASIC | (uint32_t)(code - 30);
+        } else if (40 <= code && code <= 47) {
+            pen->bg = BTUI_COLOR_BASIC | (uint32_t)(code - 40);
+        } else {
+            switch (code) {
+                case 22: pen->attrs &= ~(BTUI_BOLD | BTUI_FAINT); break;
+                case 23: pen->attrs &= ~(BTUI_ITALIC | BTUI_FRAKTUR); break;
+                case 24: pen->attrs &= ~(BTUI_UNDERLINE | BTUI_DOUBLE_UNDERLINE); break;
+                case 25: pen->attrs &= ~(BTUI_BLINK_SLOW | BTUI_BLINK_FAST); break;
+                case 27: pen->attrs &= ~BTUI_REVERSE; break;
+                case 28: pen->attrs &= ~BTUI_CONCEAL; break;
+                case 29: pen->attrs &= ~BTUI_STRIKETHROUGH; break;
+                case 39: pen->fg = BTUI_COLOR_DEFAULT; break;
+                case 49: pen->bg = BTUI_COLOR_DEFAULT; break;
+                case 54: pen->attrs &= ~(BTUI_FRAMED | BTUI_ENCIRCLED); break;
+                case 55: pen->attrs &= ~BTUI_OVERLINED; break;
+                default: break;
+            }
+        }
+    }
+}
+
+/*
+ * Apply the parameters of an SGR escape sequence to a pen the same way the
+ * terminal would, including 256-color and RGB colors.
+ */
+static void btui_pen_apply_sgr(btui_pen_t *pen, const int *params, int nparams)
+{
+    for (int i = 0; i < nparams; i++) {
+        int code = params[i];
+        if (code == 38 || code == 48) {
+            uint32_t color;
+            if (i + 2 < nparams && params[i+1] == 5) {
+                int n = params[i+2] & 0xFF;
+                color = n < 8 ? (BTUI_COLOR_BASIC | (uint32_t)n) : (BTUI_COLOR_PALETTE | (uint32_t)n);
+                i += 2;
+            } else if (i + 4 < nparams && params[i+1] == 2) {
+                color = BTUI_COLOR_RGB | (uint32_t)(params[i+2] & 0xFF) << 16
+                    | (uint32_t)(params[i+3] & 0xFF) << 8 | (uint32_t)(params[i+4] & 0xFF);
+                i += 4;
+            } else {
+                break;
+            }
+            if (code == 38) pen->fg = color;
+            else pen->bg = color;
+        } else if (90 <= code && code <= 97) {
+            pen->fg = BTUI_COLOR_PALETTE | (uint32_t)(code - 90 + 8);
+        } else if (100 <= code && code <= 107) {
+            pen->bg = BTUI_COLOR_PALETTE | (uint32_t)(code - 100 + 8);
+        } else if (0 <= code && code < 56) {
+            btui_pen_apply(pen, 1ul << code);
+        }
+    }
+}
+
+static inline int btui_pen_eq(const btui_pen_t *a, const btui_pen_t *b)
+{
+    return a->attrs == b->attrs && a->fg == b->fg && a->bg == b->bg;
+}
+
+/*
+ * Mark the terminal's current attributes and colors as unknown, e.g. after
+ * writing a raw escape sequence that BTUI didn't parse.
+ */
+static inline void btui_forget_pen(btui_t *bt)
+{
+    bt->pen.attrs = BTUI_NORMAL;
+}
+
+/*
+ * Encode the SGR parameter for a color (with `base` of 30 for foreground or 40
+ * for background) at `p`, preceded by a ';', and return the end.
+ */
+static char *btui_enc_color(char *p, uint32_t color, unsigned int base)
+{
+    *p++ = ';';
+    switch (color & 0xFF000000u) {
+        case BTUI_COLOR_BASIC: return btui_enc_u8(p, base + (color & 0xFFu));
+        case BTUI_COLOR_PALETTE:
+            // The first 16 colors have their own shorter codes:
+            if ((color & 0xFFu) < 8)
+                return btui_enc_u8(p, base + (color & 0xFFu));
+            else if ((color & 0xFFu) < 16)
+                return btui_enc_u8(p, base + 60u + (color & 0xFFu) - 8u);
+            p = btui_enc_u8(p, base + 8u);
+            memcpy(p, ";5;", 3);
+            return btui_enc_u8(p + 3, color & 0xFFu);
+        case BTUI_COLOR_RGB:
+            p = btui_enc_u8(p, base + 8u);
+            memcpy(p, ";2;", 3);
+            p = btui_enc_u8(p + 3, (color >> 16) & 0xFFu);
+            *p++ = ';';
+            p = btui_enc_u8(p, (color >> 8) & 0xFFu);
+            *p++ = ';';
+            return btui_enc_u8(p, color & 0xFFu);
+        default: return btui_enc_u8(p, base + 9u);
+    }
+}
+
+/*
+ * Encode the SGR parameters for each of the given attribute codes at `p`, each
+ * preceded by a ';', and return the end.
+ */
+static char *btui_enc_codes(char *p, attr_t attrs)
+{
+    for ( ; attrs; attrs &= attrs - 1) {
+        *p++ = ';';
+        p = btui_enc_u8(p, (unsigned int)__builtin_ctzll(attrs));
+    }
+    return p;
+}
+
+/*
+ * Encode the SGR parameters that change the terminal from pen `from` to pen
+ * `to` at `p` and return the end (which is `p` if nothing needs to change).
+ */
+static char *btui_enc_sgr_diff(char *p, const btui_pen_t *from, const btui_pen_t *to)
+{
+    // Attributes that are turned off together by a single SGR code:
+    static const struct { attr_t attrs; unsigned int code; } off_codes[] = {
+        {(1ul << 1) | (1ul << 2), 22},   // Bold, faint
+        {(1ul << 3) | (1ul << 20), 23},  // Italic, fraktur
+        {(1ul << 4) | (1ul << 21), 24},  // Underline, double underline
+        {(1ul << 5) | (1ul << 6), 25},   // Slow blink, fast blink
+        {1ul << 7, 27},                  // Reverse
+        {1ul << 8, 28},                  // Conceal
+        {1ul << 9, 29},                  // Strikethrough
+        {(1ul << 51) | (1ul << 52), 54}, // Framed, encircled
+        {1ul << 53, 55},                 // Overlined
+    };
+    attr_t removed = from->attrs & ~to->attrs, added = to->attrs & ~from->attrs;
+    for (size_t i = 0; removed && i < sizeof(off_codes)/sizeof(off_codes[0]); i++) {
+        if (removed & off_codes[i].attrs) {
+            *p++ = ';';
+            p = btui_enc_u8(p, off_codes[i].code);
+            // Anything else in the group that should stay on has to be re-added:
+            added |= to->attrs & off_codes[i].attrs;
+        }
+    }
+    p = btui_enc_codes(p, added);
+    if (to->fg != from->fg) p = btui_enc_color(p, to->fg, 30);
+    if (to->bg != from->bg) p = btui_enc_color(p, to->bg, 40);
+    return p;
+}
+
+/*
+ * Encode the SGR parameters that reset the terminal and then set pen `to` at
+ * `p` and return the end.
+ */
+static char *btui_enc_sgr_full(char *p, const btui_pen_t *to)
+{
+    *p++ = ';';
+    *p++ = '0';
+    p = btui_enc_codes(p, to->attrs);
+    if (to->fg != BTUI_COLOR_DEFAULT) p = btui_enc_color(p, to->fg, 30);
+    if (to->bg != BTUI_COLOR_DEFAULT) p = btui_enc_color(p, to->bg, 40);
+    return p;
+}
+
+/*
+ * Output an SGR escape sequence from SGR parameters that were encoded with a
+ * leading ';' (which gets replaced with the '[') and return its length.
+ */
+static int btui_emit_sgr(btui_t *bt, const char *params, const char *end)
+{
+    size_t len = (size_t)(end - params);
+    if (len == 0) return 0;
+    char *p = btui_reserve(bt, len + 2);
+    if (!p) return 0;
+    *p++ = '\033';
+    memcpy(p, params, len);
+    *p = '[';
+    p += len;
+    *p++ = 'm';
+    BTUI_COUNT(bt, sgr, 1);
+    return btui_commit(bt, p);
+}
+
+/*
+ * Output a single SGR escape sequence that changes the terminal from its
+ * current pen to pen `to` (plus any `untracked` attribute codes), using the
+ * shorter of a reset or an incremental change. Nothing is output if nothing
+ * would change. Returns the number of bytes output.
+ */
+static int btui_emit_pen(btui_t *bt, const btui_pen_t *to, attr_t untracked)
+{
+    char diff[256], full[256];
+    char *params = full, *end = btui_enc_sgr_full(full, to);
+    if (!(bt->pen.attrs & BTUI_NORMAL)) {
+        char *diffend = btui_enc_sgr_diff(diff, &bt->pen, to);
+        if (diffend - diff <= end - full) {
+            params = diff;
+            end = diffend;
+        }
+    }
+    end = btui_enc_codes(end, untracked);
+    bt->pen = *to;
+    return btui_emit_sgr(bt, params, end);
+}
+
+/*
+ * Set the foreground (`base` of 30) or background (`base` of 40) color to an
+ * RGB value. Returns the number of bytes output.
+ */
+static int btui_set_rgb(btui_t *bt, int base, uint32_t rgb)
+{
+    uint32_t color = btui_rgb_color(bt, rgb);
+    btui_pen_t pen = bt->retained ? bt->screen.pen : bt->pen;
+    if (base == 30) pen.fg = color;
+    else pen.bg = color;
+    if (bt->retained) {
+        bt->screen.pen = pen;
+        return 0;
+    } else if (!(bt->pen.attrs & BTUI_NORMAL)) {
+        if (btui_pen_eq(&pen, &bt->pen)) return 0;
+        bt->pen = pen;
+    }
+    // Changing one color never takes more than the color's parameters:
+    char params[32];
+    BTUI_COUNT(bt, colors, 1);
+    return btui_emit_sgr(bt, params, btui_enc_color(params, color, (unsigned int)base));
+}
+
+/*
+ * Set `n` cells to blank spaces drawn with the given pen's background color.
+ */
+static void btui_fill_cells(btui_cell_t *cells, size_t n, const btui_pen_t *pen)
+{
+    for (size_t i = 0; i < n; i++) {
+        cells[i].pen.attrs = 0;
+        cells[i].pen.fg = BTUI_COLOR_DEFAULT;
+        cells[i].pen.bg = pen->bg;
+        cells[i].glyph = ' ';
+        cells[i].width = 1;
+    }
+}
+
+static inline void btui_screen_mark_dirty(btui_screen_t *s, int y)
+{
+    s->dirty[y >> 6] |= UINT64_C(1) << (y & 63);
+}
+
+/*
+ * Free the retained screen buffers.
+ */
+static void btui_screen_free(btui_t *bt)
+{
+    free(bt->screen.front);
+    free(bt->screen.back);
+    free(bt->screen.dirty);
+    free(bt->screen.hashes);
+    memset(&bt->screen, 0, sizeof(btui_screen_t));
+}
+
+/*
+ * (Re)allocate the retained screen buffers if the terminal size has changed.
+ * Returns -1 on allocation failure.
+ */
+static int btui_screen_resize(btui_t *bt)
+{
+    btui_screen_t *s = &bt->screen;
+    if (s->back && s->width == bt->width && s->height == bt->height)
+        return 0;
+    int w = bt->width > 0 ? bt->width : 1, h = bt->height > 0 ? bt->height : 1;
+    size_t ncells = (size_t)w * (size_t)h;
+    btui_cell_t *front = calloc(ncells, sizeof(btui_cell_t));
+    btui_cell_t *back = calloc(ncells, sizeof(btui_cell_t));
+    uint64_t *dirty = calloc((size_t)(h + 63) / 64, sizeof(uint64_t));
+    uint64_t *hashes = calloc(2 * (size_t)h, sizeof(uint64_t));
+    if (!front || !back || !dirty || !hashes) {
+        free(front);
+        free(back);
+        free(dirty);
+        free(hashes);
+        return -1;
+    }
+    free(s->front);
+    free(s->back);
+    free(s->dirty);
+    free(s->hashes);
+    s->front = front;
+    s->back = back;
+    s->dirty = dirty;
+    s->hashes = hashes;
+    s->width = w;
+    s->height = h;
+    s->valid = 0;
+    btui_pen_t blank = {0, BTUI_COLOR_DEFAULT, BTUI_COLOR_DEFAULT};
+    btui_fill_cells(back, ncells, &blank);
+    return 0;
+}
+
+/*
+ * Erase the cells in row `y` from `x1` up to (but not including) `x2` in the
+ * back buffer.
+ */
+static void btui_screen_erase(btui_t *bt, int y, int x1, int x2)
+{
+    btui_screen_t *s = &bt->screen;
+    if (y < 0 || y >= s->height) return;
+    if (x1 < 0) x1 = 0;
+    if (x2 > s->width) x2 = s->width;
+    if (x1 >= x2) return;
+    btui_cell_t *row = &s->back[y*s->width];
+    // Erasing half of a wide character erases all of it:
+    if (x1 > 0 && row[x1].width == 0) --x1;
+    if (x2 < s->width && row[x2].width == 0) ++x2;
+    btui_fill_cells(&row[x1], (size_t)(x2 - x1), &s->pen);
+    btui_screen_mark_dirty(s, y);
+}
+
+/*
+ * Draw a single character (UTF-8 bytes packed into `glyph`) into the back
+ * buffer at the drawing position and advance the drawing position. Characters
+ * outside of the screen are clipped.
+ */
+static void btui_screen_put(btui_screen_t *s, uint32_t glyph, int width)
+{
+    int x = s->x;
+    s->x += width;
+    if (s->y < 0 || s->y >= s->height) return;
+    btui_cell_t *row = &s->back[s->y*s->width];
+    if (width == 0) {
+        // Combining characters go in the previous cell (if there's room):
+        if (--x > 0 && x < s->width && row[x].width == 0) --x;
+        if (x < 0 || x >= s->width) return;
+        int used = 0;
+        for (uint32_t g = row[x].glyph; g; g >>= 8) ++used;
+        int extra = 0;
+        for (uint32_t g = glyph; g; g >>= 8) ++extra;
+        if (used + extra <= 4) {
+            row[x].glyph |= glyph << (8*used);
+            btui_screen_mark_dirty(s, s->y);
+        }
+        return;
+    }
+    if (x < 0 || x >= s->width) return;
+    // A wide character that doesn't fit at the end of the line becomes a space:
+    if (width == 2 && x == s->width - 1)
+        glyph = ' ', width = 1;
+    // Don't leave behind half of a wide character that's being drawn over:
+    if (row[x].width == 0 && x > 0)
+        row[x-1].glyph = ' ', row[x-1].width = 1;
+    if (row[x+width-1].width == 2 && x + width < s->width)
+        row[x+width].glyph = ' ', row[x+width].width = 1;
+    row[x].pen = s->pen;
+    row[x].glyph = glyph;
+    row[x].width = (uint32_t)width;
+    // The second column of a wide character is a placeholder:
+    if (width == 2)
+        row[x+1] = (btui_cell_t){.pen = s->pen, .glyph = 0, .width = 0};
+    btui_screen_mark_dirty(s, s->y);
+}
+
+/*
+ * Clear all or part of the back buffer (see btui_clear()).
+ */
+static int btui_screen_clear(btui_t *bt, int mode)
+{
+    btui_screen_t *s = &bt->screen;
+    if (btui_screen_resize(bt)) return -1;
+    switch (mode) {
+        case BTUI_CLEAR_BELOW:
+            btui_screen_erase(bt, s->y, s->x, s->width);
+            for (int y = s->y + 1; y < s->height; y++)
+                btui_screen_erase(bt, y, 0, s->width);
+            return 0;
+        case BTUI_CLEAR_ABOVE:
+            for (int y = 0; y < s->y && y < s->height; y++)
+                btui_screen_erase(bt, y, 0, s->width);
+            btui_screen_erase(bt, s->y, 0, s->x + 1);
+            return 0;
+        case BTUI_CLEAR_SCREEN:
+            for (int y = 0; y < s->height; y++)
+                btui_screen_erase(bt, y, 0, s->width);
+            return 0;
+        case BTUI_CLEAR_RIGHT: btui_screen_erase(bt, s->y, s->x, s->width); return 0;
+        case BTUI_CLEAR_LEFT: btui_screen_erase(bt, s->y, 0, s->x + 1); return 0;
+        case BTUI_CLEAR_LINE: btui_screen_erase(bt, s->y, 0, s->width); return 0;
+        default: return -1;
+    }
+}
+
+/*
+ * Apply a CSI escape sequence ending in `final` to the back buffer the way the
+ * terminal would have applied it to the screen. Only SGR (attributes and
+ * colors), ED and EL are understood. Returns 0 on success, or -1 if the
+ * sequence has to go to the terminal instead.
+ */
+static int btui_screen_csi(btui_t *bt, unsigned char final, const int *params, int nparams)
+{
+    static const btui_clear_t ed[] = {BTUI_CLEAR_BELOW, BTUI_CLEAR_ABOVE, BTUI_CLEAR_SCREEN};
+    static const btui_clear_t el[] = {BTUI_CLEAR_RIGHT, BTUI_CLEAR_LEFT, BTUI_CLEAR_LINE};
+    switch (final) {
+        case 'm':
+            btui_pen_apply_sgr(&bt->screen.pen, params, nparams);
+            return 0;
+        case 'J': return nparams == 1 && params[0] <= 2 ? btui_screen_clear(bt, ed[params[0]]) : -1;
+        case 'K': return nparams == 1 && params[0] <= 2 ? btui_screen_clear(bt, el[params[0]]) : -1;
+        default: return -1;
+    }
+}
+
+/*
+ * Draw text into the back buffer. Control characters move the drawing
+ * position, the DEC line drawing charset is translated to Unicode, and SGR,
+ * ED and EL escape sequences are applied to the back buffer. Any other escape
+ * sequences are passed through to the terminal immediately, and since BTUI
+ * can't tell what they did to the screen, the next flush redraws all of it.
+ */
+static void btui_screen_write(btui_t *bt, const char *str, size_t len)
+{
+    btui_screen_t *s = &bt->screen;
+    if (btui_screen_resize(bt)) return;
+    const unsigned char *p = (const unsigned char*)str, *end = p + len;
+    while (p < end) {
+        if (*p == '\033') {
+            const unsigned char *start = p++;
+            if (p + 1 < end && *p == '(') {
+                s->line_drawing = p[1] == '0';
+                p += 2;
+                continue;
+            } else if (p < end && *p == '[') {
+                int params[16] = {0}, nparams = 1, other = 0;
+                for (++p; p < end && !('@' <= *p && *p <= '~'); p++) {
+                    if ('0' <= *p && *p <= '9') {
+                        int *param = &params[nparams - 1];
+                        if (*param < 100000) *param = *param * 10 + (*p - '0');
+                    } else if (*p == ';' || *p == ':') {
+                        if (nparams < (int)(sizeof(params)/sizeof(params[0])))
+                            ++nparams;
+                    } else {
+                        // Private and intermediate characters:
+                        other = 1;
+                    }
+                }
+                if (p < end && !other && btui_screen_csi(bt, *p, params, nparams) == 0) {
+                    ++p;
+                    continue;
+                }
+            }
+            if (p < end) ++p;
+            btui_out(bt, (const char*)start, (size_t)(p - start));
+            btui_forget_pen(bt);
+            bt->cursor_x = bt->cursor_y = -1;
+            s->valid = 0;
+            continue;
+        } else if (*p < ' ' || *p == 0x7F) {
+            switch (*p) {
+                case '\n': ++s->y; break;
+                case '\r': s->x = 0; break;
+                case '\b': if (s->x > 0) --s->x; break;
+                case '\t': s->x = (s->x + 8) & ~7; break;
+                default: break;
+            }
+            ++p;
+            continue;
+        }
+
+        uint32_t glyph = 0;
+        int width = 1;
+        if (s->line_drawing && '_' <= *p && *p <= '~') {
+            const char *utf8 = dec_line_drawing[*p - '_'];
+            for (int i = 0; utf8[i]; i++)
+                glyph |= (uint32_t)(unsigned char)utf8[i] << (8*i);
+            ++p;
+        } else {
+            uint32_t codepoint;
+            int n = btui_utf8_decode(p, end, &codepoint);
+            width = btui_codepoint_width(codepoint);
+            for (int i = 0; i < n; i++)
+                glyph |= (uint32_t)p[i] << (8*i);
+            p += n;
+        }
+        btui_screen_put(s, glyph, width);
+    }
+}
+
+/*
+ * Scroll a region of the back buffer (see btui_scroll()).
+ */
+static void btui_screen_scroll(btui_t *bt, int firstline, int lastline, int scroll_amount)
+{
+    btui_screen_t *s = &bt->screen;
+    if (btui_screen_resize(bt)) return;
+    if (firstline < 0) firstline = 0;
+    if (lastline >= s->height) lastline = s->height - 1;
+    if (firstline > lastline || scroll_amount == 0) return;
+    int n = lastline - firstline + 1;
+    int shift = scroll_amount > 0 ? scroll_amount : -scroll_amount;
+    if (shift > n) shift = n;
+    size_t rowsize = (size_t)s->width * sizeof(btui_cell_t);
+    btui_cell_t *top = &s->back[firstline*s->width];
+    if (scroll_amount > 0) {
+        memmove(top, top + shift*s->width, (size_t)(n - shift) * rowsize);
+        for (int y = lastline - shift + 1; y <= lastline; y++)
+            btui_screen_erase(bt, y, 0, s->width);
+    } else {
+        memmove(top + shift*s->width, top, (size_t)(n - shift) * rowsize);
+        for (int y = firstline; y < firstline + shift; y++)
+            btui_screen_erase(bt, y, 0, s->width);
+    }
+    for (int y = firstline; y <= lastline; y++)
+        btui_screen_mark_dirty(s, y);
+}
+
+/*
+ * Output the escape sequences to scroll the given region of the terminal by
+ * the given amount (positive means content moves up).
+ */
+static int btui_emit_scroll(btui_t *bt, int firstline, int lastline, int scroll_amount)
+{
+    if (scroll_amount == 0) return 0;
+    char *p = btui_reserve(bt, 32);
+    if (!p) return 0;
+    // Scrolling the whole screen doesn't need a scroll region:
+    int whole_screen = firstline <= 0 && lastline >= bt->height - 1;
+    if (!whole_screen) {
+        *p++ = '\033';
+        *p++ = '[';
+        p = btui_enc_num(p, firstline + 1);
+        *p++ = ';';
+        p = btui_enc_num(p, lastline + 1);
+        *p++ = 'r';
+    }
+    *p++ = '\033';
+    *p++ = '[';
+    p = btui_enc_num(p, scroll_amount > 0 ? scroll_amount : -scroll_amount);
+    *p++ = scroll_amount > 0 ? 'S' : 'T';
+    if (!whole_screen) {
+        memcpy(p, "\033[r", 3);
+        p += 3;
+        // Setting the scroll region moves the cursor to the top left:
+        bt->cursor_x = bt->cursor_y = -1;
+    }
+    BTUI_COUNT(bt, scrolls, 1);
+    return btui_commit(bt, p);
+}
+
+/*
+ * Return the number of decimal digits needed for a positive number.
+ */
+static inline int btui_digits(int n)
+{
+    return n < 10 ? 1 : (n < 100 ? 2 : (n < 1000 ? 3 : (n < 10000 ? 4 : 8)));
+}
+
+/*
+ * Return the number of bytes it would take to move the cursor from column `x0`
+ * to column `x` by rewriting the characters that are already there, or -1 if
+ * that isn't possible. This only works in retained mode, when the cells
+ * in between are known and were drawn with the terminal's current pen.
+ */
+static int btui_overprint_cost(btui_t *bt, int x0, int x, int y)
+{
+    btui_screen_t *s = &bt->screen;
+    if (!bt->retained || !s->valid || y >= s->height || x > s->width || x - x0 > 8)
+        return -1;
+    int cost = 0;
+    for (const btui_cell_t *cell = &s->front[y*s->width + x0]; x0 < x; x0++, cell++) {
+        if (cell->width != 1 || !btui_pen_eq(&cell->pen, &bt->pen))
+            return -1;
+        for (uint32_t g = cell->glyph; g; g >>= 8)
+            ++cost;
+    }
+    return cost;
+}
+
+/*
+ * Encode a CSI escape sequence with an optional numeric parameter (omitted
+ * when it's 1, since that's the default) at `p` and return the end.
+ */
+static inline char *btui_enc_csi(char *p, int n, char final)
+{
+    *p++ = '\033';
+    *p++ = '[';
+    if (n != 1) p = btui_enc_num(p, n);
+    *p++ = final;
+    return p;
+}
+
+/*
+ * Output the cheapest sequence of bytes that moves the cursor to the given
+ * position, based on where the cursor is now: nothing, CR, LF, BS, relative
+ * moves (CUU/CUD/CUF/CUB), single-axis absolute moves (VPA/CHA), rewriting the
+ * characters in between (in retained mode), or an absolute move (CUP).
+ */
+static int btui_emit_move(btui_t *bt, int x, int y)
+{
+    int x0 = bt->cursor_x, y0 = bt->cursor_y;
+    if (x < 0) x = 0;
+    if (y < 0) y = 0;
+    if (x == x0 && y == y0) return 0;
+
+    // Absolute move: CSI y;x H (with the defaults of 1 left out)
+    int best = 3 + (y > 0 ? btui_digits(y+1) : 0) + (x > 0 ? 1 + btui_digits(x+1) : 0);
+    enum { V_NONE, V_LF, V_RI, V_CUD, V_CUU, V_VPA } vmove = V_NONE;
+    enum { H_NONE, H_CR, H_CR_CUF, H_BS, H_CUB, H_CUF, H_CHA, H_OVERPRINT } hmove = H_NONE;
+    if (x0 >= 0 && y0 >= 0) {
+        int dy = y - y0, vcost = 0;
+        if (dy != 0) {
+            vmove = V_VPA;
+            vcost = 3 + (y > 0 ? btui_digits(y+1) : 0);
+            int rel = 3 + (dy*dy > 1 ? btui_digits(dy > 0 ? dy : -dy) : 0);
+            if (rel < vcost) vmove = dy > 0 ? V_CUD : V_CUU, vcost = rel;
+            if (dy > 0 && dy < vcost && y < bt->height) vmove = V_LF, vcost = dy;
+            else if (dy == -1) vmove = V_RI, vcost = 2;
+        }
+
+        int dx = x - x0, hcost = 0;
+        if (dx != 0) {
+            hmove = H_CHA;
+            hcost = 3 + (x > 0 ? btui_digits(x+1) : 0);
+            int rel = 3 + (dx*dx > 1 ? btui_digits(dx > 0 ? dx : -dx) : 0);
+            if (rel < hcost) hmove = dx > 0 ? H_CUF : H_CUB, hcost = rel;
+            if (x == 0) {
+                hmove = H_CR, hcost = 1;
+            } else if (dx < 0 && -dx < hcost) {
+                hmove = H_BS, hcost = -dx;
+            } else if (dx > 0) {
+                int cr_cuf = 4 + (x > 1 ? btui_digits(x) : 0);
+                if (cr_cuf < hcost) hmove = H_CR_CUF, hcost = cr_cuf;
+                int overprint = btui_overprint_cost(bt, x0, x, y);
+                if (overprint >= 0 && overprint < hcost) hmove = H_OVERPRINT, hcost = overprint;
+            }
+        }
+        if (vcost + hcost < best) best = vcost + hcost;
+        else vmove = V_NONE, hmove = H_NONE;
+    }
+
+    char *p = btui_reserve(bt, 40);
+    if (!p) return 0;
+    if (vmove == V_NONE && hmove == H_NONE) {
+        *p++ = '\033';
+        *p++ = '[';
+        if (y > 0) p = btui_enc_num(p, y+1);
+        if (x > 0) {
+            *p++ = ';';
+            p = btui_enc_num(p, x+1);
+        }
+        *p++ = 'H';
+    } else {
+        switch (vmove) {
+            case V_LF: for (int i = y0; i < y; i++) *p++ = '\n'; break;
+            case V_RI: *p++ = '\033'; *p++ = 'M'; break;
+            case V_CUD: p = btui_enc_csi(p, y - y0, 'B'); break;
+            case V_CUU: p = btui_enc_csi(p, y0 - y, 'A'); break;
+            case V_VPA: p = btui_enc_csi(p, y+1, 'd'); break;
+            case V_NONE: default: break;
+        }
+        switch (hmove) {
+            case H_CR: *p++ = '\r'; break;
+            case H_CR_CUF: *p++ = '\r'; p = btui_enc_csi(p, x, 'C'); break;
+            case H_BS: for (int i = x; i < x0; i++) *p++ = '\b'; break;
+            case H_CUB: p = btui_enc_csi(p, x0 - x, 'D'); break;
+            case H_CUF: p = btui_enc_csi(p, x - x0, 'C'); break;
+            case H_CHA: p = btui_enc_csi(p, x+1, 'G'); break;
+            case H_OVERPRINT:
+                for (const btui_cell_t *cell = &bt->screen.front[y*bt->screen.width + x0]; cell < &bt->screen.front[y*bt->screen.width + x]; cell++)
+                    for (uint32_t g = cell->glyph; g; g >>= 8)
+                        *p++ = (char)(g & 0xFF);
+                break;
+            case H_NONE: default: break;
+        }
+    }
+    bt->cursor_x = x;
+    bt->cursor_y = y;
+    BTUI_COUNT(bt, cursor_moves, 1);
+    return btui_commit(bt, p);
+}
+
+/*
+ * Update the tracked cursor position (and pen) for text written to the
+ * terminal. Printable characters advance the cursor, and anything that BTUI
+ * can't follow makes the position unknown.
+ */
+static void btui_track_text(btui_t *bt, const char *str, size_t len)
+{
+    const unsigned char *p = (const unsigned char*)str, *end = p + len;
+    for ( ; p < end; p++) {
+        if (*p >= ' ' && *p != 0x7F) {
+            const unsigned char *text = p;
+            while (p + 1 < end && p[1] >= ' ' && p[1] != 0x7F) ++p;
+            if (bt->cursor_x >= 0) {
+                bt->cursor_x += btui_strnwidth((const char*)text, (size_t)(p + 1 - text));
+                if (bt->cursor_x >= bt->width) bt->cursor_x = -1;
+            }
+            continue;
+        }
+        switch (*p) {
+            case '\r': if (bt->cursor_x >= 0 || bt->cursor_y >= 0) bt->cursor_x = 0; break;
+            case '\n':
+                // At the bottom line, LF scrolls and the cursor stays put:
+                if (bt->cursor_y >= 0 && bt->cursor_y < bt->height - 1)
+                    ++bt->cursor_y;
+                break;
+            case '\b': if (bt->cursor_x > 0) --bt->cursor_x; break;
+            case '\033':
+                // Character set designations (like the DEC line drawing
+                // charset) are harmless, anything else could move the cursor
+                // or change the pen:
+                if (p + 2 < end && p[1] == '(') {
+                    p += 2;
+                    break;
+                }
+                btui_forget_pen(bt);
+                bt->cursor_x = bt->cursor_y = -1;
+                return;
+            default: bt->cursor_x = bt->cursor_y = -1; break;
+        }
+    }
+}
+
+/*
+ * Hash `n` cells, starting at `cells`. If `stride` is 0, the same cell is
+ * hashed `n` times (this gives the hash of a blank row).
+ */
+static uint64_t btui_hash_cells(const btui_cell_t *cells, int n, int stride)
+{
+    uint64_t h = UINT64_C(14695981039346656037);
+    for (int i = 0; i < n; i++, cells += stride) {
+        uint64_t words[sizeof(btui_cell_t)/sizeof(uint64_t)];
+        memcpy(words, cells, sizeof(words));
+        for (size_t j = 0; j < sizeof(words)/sizeof(words[0]); j++) {
+            h = (h ^ words[j]) * UINT64_C(0x100000001B3);
+            h ^= h >> 29;
+        }
+    }
+    return h;
+}
+
+/*
+ * Look for a block of rows in the back buffer that are in the front buffer,
+ * but shifted up or down. If scrolling part of the terminal would save more
+ * redrawing than it costs, output the scroll and update the front buffer to
+ * match. This catches content that moves between frames (log tails, pagers,
+ * lists) no matter how it was drawn, the same way ncurses' hashmap does.
+ * Returns 1 if it scrolled, otherwise 0.
+ */
+static int btui_screen_detect_scroll(btui_t *bt)
+{
+    btui_screen_t *s = &bt->screen;
+    int w = s->width, h = s->height;
+    int ndirty = 0;
+    for (int i = 0; i < (h + 63) / 64; i++)
+        ndirty += __builtin_popcountll(s->dirty[i]);
+    if (ndirty < 2) return 0;
+
+    btui_pen_t blank_pen = {0, BTUI_COLOR_DEFAULT, BTUI_COLOR_DEFAULT};
+    btui_cell_t blank_cell = {blank_pen, ' ', 1};
+    uint64_t blank = btui_hash_cells(&blank_cell, w, 0);
+    uint64_t *prev = s->hashes, *next = &s->hashes[h];
+    for (int y = 0; y < h; y++) {
+        prev[y] = btui_hash_cells(&s->front[y*w], w, 1);
+        next[y] = (s->dirty[y >> 6] & (UINT64_C(1) << (y & 63))) ? btui_hash_cells(&s->back[y*w], w, 1) : prev[y];
+    }
+
+    int best_gain = 0, best_first = 0, best_last = 0, best_shift = 0;
+    for (int y = 0; y < h; y++) {
+        if (next[y] == prev[y] || next[y] == blank) continue;
+        // Find where this row was (ignoring rows that aren't unique):
+        int from = -1;
+        for (int y2 = 0; y2 < h; y2++) {
+            if (prev[y2] != next[y]) continue;
+            if (from >= 0) {
+                from = -1;
+                break;
+            }
+            from = y2;
+        }
+        if (from < 0) continue;
+
+        int shift = from - y, top = y, bottom = y;
+        while (top > 0 && top - 1 + shift >= 0 && next[top-1] == prev[top-1+shift])
+            --top;
+        while (bottom < h - 1 && bottom + 1 + shift < h && next[bottom+1] == prev[bottom+1+shift])
+            ++bottom;
+
+        // Count the rows that scrolling would fix, minus the ones that it would
+        // break by scrolling blank lines into the region:
+        int first = shift > 0 ? top : top + shift, last = shift > 0 ? bottom + shift : bottom;
+        int gain = 0;
+        for (int i = first; i <= last; i++) {
+            gain += next[i] != prev[i];
+            if (i < top || i > bottom) gain -= next[i] != blank;
+        }
+        if (gain > best_gain) {
+            best_gain = gain;
+            best_first = first, best_last = last, best_shift = shift;
+        }
+        y = bottom;
+    }
+    // A scroll takes a dozen or so bytes, which is a lot less than a row:
+    if (best_gain == 0 || best_gain * w <= 16) return 0;
+
+    btui_emit_pen(bt, &blank_pen, 0);
+    btui_emit_scroll(bt, best_first, best_last, best_shift);
+    // The terminal fills the lines scrolled into view with blanks:
+    int n = best_last - best_first + 1, shift = best_shift > 0 ? best_shift : -best_shift;
+    btui_cell_t *top = &s->front[best_first*w];
+    if (best_shift > 0) {
+        memmove(top, top + shift*w, (size_t)((n - shift) * w) * sizeof(btui_cell_t));
+        btui_fill_cells(top + (n - shift)*w, (size_t)(shift * w), &blank_pen);
+    } else {
+        memmove(top + shift*w, top, (size_t)((n - shift) * w) * sizeof(btui_cell_t));
+        btui_fill_cells(top, (size_t)(shift * w), &blank_pen);
+    }
+    for (int y = best_first; y <= best_last; y++)
+        btui_screen_mark_dirty(s, y);
+    return 1;
+}
+
+/*
+ * Output the cells of the back buffer that differ from the front buffer, then
+ * leave the terminal's cursor at the drawing position. Blocks of rows that
+ * moved are scrolled into place instead of redrawn.
+ */
+static int btui_screen_flush(btui_t *bt)
+{
+    btui_screen_t *s = &bt->screen;
+    if (btui_screen_resize(bt)) return -1;
+    int w = s->width;
+    if (!s->valid) {
+        btui_pen_t blank = {0, BTUI_COLOR_DEFAULT, BTUI_COLOR_DEFAULT};
+        btui_emit_pen(bt, &blank, 0);
+        btui_out_literal(bt, "\033[2J");
+        btui_fill_cells(s->front, (size_t)w * (size_t)s->height, &blank);
+        for (int y = 0; y < s->height; y++)
+            btui_screen_mark_dirty(s, y);
+        s->valid = 1;
+    } else {
+        for (int i = 0; i < 4 && btui_screen_detect_scroll(bt); i++)
+            continue;
+    }
+
+    for (int y = 0; y < s->height; y++) {
+        if (!s->dirty[y >> 6]) {
+            y |= 63;
+            continue;
+        }
+        if (!(s->dirty[y >> 6] & (UINT64_C(1) << (y & 63))))
+            continue;
+        s->dirty[y >> 6] &= ~(UINT64_C(1) << (y & 63));
+        btui_cell_t *front = &s->front[y*w], *back = &s->back[y*w];
+        for (int x = 0; x < w; ) {
+            size_t remaining = (size_t)(w - x) * sizeof(btui_cell_t);
+            size_t diff = btui_memdiff(&front[x], &back[x], remaining);
+            if (diff == remaining) break;
+            x += (int)(diff / sizeof(btui_cell_t));
+            // Wide characters are drawn from their first column:
+            if (x > 0 && back[x].width == 0) --x;
+            btui_emit_move(bt, x, y);
+            for ( ; x < w && btui_memdiff(&front[x], &back[x], sizeof(btui_cell_t)) != sizeof(btui_cell_t); x++) {
+                if (back[x].width == 0) {
+                    front[x] = back[x];
+                    continue;
+                }
+                if (!btui_pen_eq(&back[x].pen, &bt->pen))
+                    btui_emit_pen(bt, &back[x].pen, 0);
+                char *p = btui_reserve(bt, 4);
+                if (!p) return -1;
+                int glyph_len = 0;
+                for (uint32_t g = back[x].glyph; g; g >>= 8, glyph_len++)
+                    *p++ = (char)(g & 0xFF);
+                btui_commit(bt, p);
+                bt->cursor_x += (int)back[x].width;
+                if (bt->cursor_x >= w) bt->cursor_x = -1;
+                front[x] = back[x];
+                // Runs of the same character can be repeated with REP:
+                int run = 0;
+                if ((bt->capabilities & BTUI_CAP_REP) && back[x].width == 1) {
+                    while (x + 1 + run < w && memcmp(&back[x + 1 + run], &back[x], sizeof(btui_cell_t)) == 0)
+                        ++run;
+                }
+                if (run > 0 && 3 + btui_digits(run) < run * glyph_len) {
+                    p = btui_reserve(bt, 16);
+                    if (!p) return -1;
+                    btui_commit(bt, btui_enc_csi(p, run, 'b'));
+                    for (int i = 1; i <= run; i++)
+                        front[x + i] = back[x];
+                    x += run;
+                    if (bt->cursor_x >= 0) bt->cursor_x += run;
+                    if (bt->cursor_x >= w) bt->cursor_x = -1;
+                }
+            }
+        }
+    }
+
+    int x = s->x < 0 ? 0 : (s->x >= w ? w - 1 : s->x);
+    int y = s->y < 0 ? 0 : (s->y >= s->height ? s->height - 1 : s->y);
+    btui_emit_move(bt, x, y);
+    return 0;
+}
+
+/*
+ * Write raw text to the terminal (or the back buffer in retained mode).
+ */
+static int btui_write(btui_t *bt, const char *s, size_t len)
+{
+    if (bt->retained) {
+        btui_screen_write(bt, s, len);
+        return (int)len;
+    }
+    btui_track_text(bt, s, len);
+    return btui_out(bt, s, len);
+}
+
+/*
+ * Write `n` copies of the character `c` to the terminal (or the back buffer in
+ * retained mode). If the terminal supports REP, long runs are written as one
+ * character followed by a repeat count.
+ */
+static void btui_repeat(btui_t *bt, char c, int n)
+{
+    if (!bt->retained && (bt->capabilities & BTUI_CAP_REP) && n > 1 && 3 + btui_digits(n - 1) < n - 1) {
+        btui_write(bt, &c, 1);
+        char *p = btui_reserve(bt, 16);
+        if (!p) return;
+        btui_commit(bt, btui_enc_csi(p, n - 1, 'b'));
+        if (bt->cursor_x >= 0) bt->cursor_x += n - 1;
+        if (bt->cursor_x >= bt->width) bt->cursor_x = -1;
+        return;
+    }
+    char chunk[64];
+    memset(chunk, c, sizeof(chunk));
+    for ( ; n > 0; n -= (int)sizeof(chunk))
+        btui_write(bt, chunk, n < (int)sizeof(chunk) ? (size_t)n : sizeof(chunk));
+}
+
+/*
+ * Save the terminal's settings and switch it to raw mode. Returns 0 on
+ * success.
+ */
+static int btui_set_raw(btui_t *bt)
+{
+    if (tcgetattr(fileno(bt->in), &bt->normal_termios))
+        return -1;
+    bt->tui_termios = bt->normal_termios;
+    cfmakeraw(&bt->tui_termios);
+    // Reads never block, all waiting is done with poll():
+    bt->tui_termios.c_cc[VMIN] = 0, bt->tui_termios.c_cc[VTIME] = 0;
+    // Raw mode is a setting of the terminal that input comes from, which is
+    // the one that matters even if output goes somewhere else:
+    if (tcsetattr(fileno(bt->in), TCSANOW, &bt->tui_termios))
+        return -1;
+    bt->raw = 1;
+    return 0;
+}
+
+/*
+ * Reset a terminal back to its normal state, close it, and free everything
+ * BTUI was using for it (except the btui_t itself).
+ */
+static void btui_release(btui_t *bt)
+{
+#ifndef BTUI_NO_THREADS
+    if (bt->writer && in_signal_handler) {
+        // The writer thread can't be waited on, and the terminal might not be
+        // reading, so nothing else waits on the terminal either:
+        btui_set_nonblocking(bt, 1);
+        btui_writer_abandon(bt->writer);
+        bt->writer = NULL;
+    } else if (bt->writer) {
+        // Output still in the writer thread's ring has to come out first:
+        btui_writer_stop(bt->writer);
+        bt->writer = NULL;
+    }
+#endif
+    if (bt->raw) tcsetattr(fileno(bt->in), TCSANOW, &bt->normal_termios);
+    btui_set_cursor(bt, CURSOR_DEFAULT);
+    btui_set_mode(bt, BTUI_MODE_UNINITIALIZED);
+    btui_trace_finish(bt);
+    btui_set_hud(bt, 0);
+    if (in_signal_handler) {
+        close(fileno(bt->in));
+        close(fileno(bt->out));
+    } else {
+        fclose(bt->in);
+        fclose(bt->out);
+    }
+    btui_screen_free(bt);
+    free(bt->outbuf);
+}
+
+/*
+ * Reset the terminal back to its normal state.
+ */
+static void btui_cleanup(void)
+{
+    if (!current_bt.out) return;
+    btui_release(&current_bt);
+    btui_close_resize_pipe();
+    memset(&current_bt, 0, sizeof(btui_t));
+}
+
+/*
+ * Reset the terminal back to its normal state and raise the given signal.
+ * (This is used as a signal handler that gracefully exits without gunking up
+ * the terminal)
+ */
+static void btui_cleanup_and_raise(int sig)
+{
+    btui_mode_t mode = current_bt.mode;
+    int retained = current_bt.retained;
+    btui_color_depth_t color_depth = current_bt.color_depth;
+    int capabilities = current_bt.capabilities;
+    int nonblocking = current_bt.nonblocking, fps = current_bt.fps, writer = current_bt.writer != NULL;
+    int hud = current_bt.hud != NULL;
+    btui_stats_t stats;
+    btui_stats(&current_bt, &stats);
+    btui_latency_t latency = current_bt.latency;
+    // A trace carries on after being suspended instead of being saved:
+    struct btui_trace_s *trace = sig == SIGTSTP ? current_bt.trace : NULL;
+    if (trace) current_bt.trace = NULL;
+    in_signal_handler = 1;
+    btui_cleanup();
+    in_signal_handler = 0;
+    raise(sig);
+    // This code will only ever be run if sig is SIGTSTP/SIGSTOP, otherwise, raise() won't return:
+    btui_create(mode);
+    btui_set_retained(&current_bt, retained);
+    btui_set_color_depth(&current_bt, color_depth);
+    btui_set_capabilities(&current_bt, capabilities);
+    btui_set_nonblocking(&current_bt, nonblocking);
+    btui_set_fps(&current_bt, fps);
+    btui_set_writer_thread(&current_bt, writer);
+    btui_set_hud(&current_bt, hud);
+    current_bt.stats = stats;
+    current_bt.latency = latency;
+    if (trace) {
+        btui_set_trace(&current_bt, 0);
+        current_bt.trace = trace;
+    }
+    struct sigaction sa = {.sa_handler = &btui_cleanup_and_raise, .sa_flags = (int)(SA_NODEFER | SA_RESETHAND)};
+    sigaction(sig, &sa, NULL);
+}
+
+/*
+ * A signal handler used to wake up anything waiting for input when a SIGWINCH
+ * event occurs, so BTUI can update its internal window size values.
+ */
+static void btui_on_resize(int sig)
+{
+    (void)sig;
+    int saved_errno = errno;
+    ssize_t written = write(resize_pipe[1], "", 1);
+    (void)written;
+    errno = saved_errno;
+}
+
+/*
+ * Headless virtual terminal: a small VT parser that applies BTUI's output to
+ * a grid of cells, so output can be checked and measured without a real
+ * terminal.
+ */
+enum { VT_GROUND, VT_ESC, VT_CHARSET, VT_CSI, VT_STRING, VT_STRING_ESC };
+
+/*
+ * Erase the cells in row `y` from `x1` up to (but not including) `x2`, using
+ * the current background color like a real terminal does.
+ */
+static void btui_vt_erase(btui_vt_t *vt, int y, int x1, int x2)
+{
+    if (y < 0 || y >= vt->height) return;
+    if (x1 < 0) x1 = 0;
+    if (x2 > vt->width) x2 = vt->width;
+    if (x1 >= x2) return;
+    btui_cell_t *row = &vt->cells[y*vt->width];
+    // Erasing half of a wide character erases all of it:
+    if (x1 > 0 && row[x1].width == 0) --x1;
+    if (x2 < vt->width && row[x2].width == 0) ++x2;
+    btui_fill_cells(&row[x1], (size_t)(x2 - x1), &vt->pen);
+}
+
+/*
+ * Scroll rows `top` through `bottom` up by `n` rows (or down, if `n` is
+ * negative), filling in blank rows.
+ */
+static void btui_vt_scroll(btui_vt_t *vt, int top, int bottom, int n)
+{
+    if (top < 0) top = 0;
+    if (bottom >= vt->height) bottom = vt->height - 1;
+    if (top > bottom || n == 0) return;
+    int rows = bottom - top + 1, shift = n > 0 ? n : -n;
+    if (shift > rows) shift = rows;
+    btui_cell_t *first = &vt->cells[top*vt->width];
+    size_t rowsize = (size_t)vt->width * sizeof(btui_cell_t);
+    if (n > 0) {
+        memmove(first, first + shift*vt->width, (size_t)(rows - shift) * rowsize);
+        btui_fill_cells(first + (rows - shift)*vt->width, (size_t)(shift * vt->width), &vt->pen);
+    } else {
+        memmove(first + shift*vt->width, first, (size_t)(rows - shift) * rowsize);
+        btui_fill_cells(first, (size_t)(shift * vt->width), &vt->pen);
+    }
+}
+
+/*
+ * Move the cursor down a line, scrolling if it's at the bottom of the scroll
+ * region.
+ */
+static void btui_vt_linefeed(btui_vt_t *vt)
+{
+    vt->wrap_pending = 0;
+    if (vt->y == vt->scroll_bottom)
+        btui_vt_scroll(vt, vt->scroll_top, vt->scroll_bottom, 1);
+    else if (vt->y < vt->height - 1)
+        ++vt->y;
+}
+
+/*
+ * Move the cursor to the given position (clamped to the screen).
+ */
+static void btui_vt_move(btui_vt_t *vt, int x, int y)
+{
+    vt->x = x < 0 ? 0 : (x >= vt->width ? vt->width - 1 : x);
+    vt->y = y < 0 ? 0 : (y >= vt->height ? vt->height - 1 : y);
+    vt->wrap_pending = 0;
+}
+
+/*
+ * Print a character (UTF-8 bytes packed into `glyph`) at the cursor and
+ * advance the cursor, wrapping at the end of the line if autowrap is on.
+ */
+static void btui_vt_print(btui_vt_t *vt, uint32_t glyph, int width)
+{
+    ++vt->printed;
+    if (width == 0) {
+        // Combining characters go in the previous cell (if there's room):
+        int x = vt->wrap_pending ? vt->x : vt->x - 1;
+        btui_cell_t *row = &vt->cells[vt->y*vt->width];
+        if (x > 0 && row[x].width == 0) --x;
+        if (x < 0) return;
+        int used = 0;
+        for (uint32_t g = row[x].glyph; g; g >>= 8) ++used;
+        int extra = 0;
+        for (uint32_t g = glyph; g; g >>= 8) ++extra;
+        if (used + extra <= 4)
+            row[x].glyph |= glyph << (8*used);
+        return;
+    }
+    if (width > vt->width) return;
+    if (vt->wrap_pending || vt->x + width > vt->width) {
+        if (vt->autowrap) {
+            vt->x = 0;
+            btui_vt_linefeed(vt);
+        } else {
+            vt->x = vt->width - width;
+        }
+        vt->wrap_pending = 0;
+    }
+    btui_cell_t *row = &vt->cells[vt->y*vt->width];
+    int x = vt->x;
+    // Don't leave behind half of a wide character that's being drawn over:
+    if (row[x].width == 0 && x > 0)
+        row[x-1].glyph = ' ', row[x-1].width = 1;
+    if (row[x+width-1].width == 2 && x + width < vt->width)
+        row[x+width].glyph = ' ', row[x+width].width = 1;
+    row[x] = (btui_cell_t){.pen = vt->pen, .glyph = glyph, .width = (uint32_t)width};
+    if (width == 2)
+        row[x+1] = (btui_cell_t){.pen = vt->pen, .glyph = 0, .width = 0};
+    vt->last = row[x];
+    if (x + width >= vt->width) {
+        vt->x = vt->width - 1;
+        vt->wrap_pending = vt->autowrap;
+    } else {
+        vt->x = x + width;
+    }
+}
+
+/*
+ * Carry out a complete CSI escape sequence ending in `final`.
+ */
+static void btui_vt_csi(btui_vt_t *vt, unsigned char final)
+{
+    int *p = vt->params;
+    int n = p[0] > 0 ? p[0] : 1;
+    if (vt->prefix == '?') {
+        if (final != 'h' && final != 'l') return;
+        for (int i = 0; i < vt->nparams; i++) {
+            switch (p[i]) {
+                case 7: vt->autowrap = final == 'h'; break;
+                case 25: vt->cursor_visible = final == 'h'; break;
+                case 47: case 1047: case 1049:
+                    for (int y = 0; y < vt->height; y++)
+                        btui_vt_erase(vt, y, 0, vt->width);
+                    break;
+                default: break;
+            }
+        }
+        return;
+    } else if (vt->prefix) {
+        return;
+    }
+
+    if (vt->intermediate == '$' && (final == 'x' || final == 'z')) {
+        // DECFRA (fill) and DECERA (erase) a rectangle:
+        int *r = final == 'x' ? &p[1] : &p[0];
+        int top = r[0] > 0 ? r[0] - 1 : 0, left = r[1] > 0 ? r[1] - 1 : 0;
+        int bottom = r[2] > 0 ? r[2] : vt->height, right = r[3] > 0 ? r[3] : vt->width;
+        if (bottom > vt->height) bottom = vt->height;
+        if (final == 'x' && !(' ' <= p[0] && p[0] < 0x7F)) return;
+        for (int y = top; y < bottom; y++) {
+            if (final == 'z') {
+                btui_vt_erase(vt, y, left, right);
+                continue;
+            }
+            for (int x = left; x < right && x < vt->width; x++)
+                vt->cells[y*vt->width + x] = (btui_cell_t){.pen = vt->pen, .glyph = (uint32_t)p[0], .width = 1};
+        }
+        return;
+    } else if (vt->intermediate) {
+        return;
+    }
+
+    switch (final) {
+        case 'A': btui_vt_move(vt, vt->x, vt->y - n); break;
+        case 'B': case 'e': btui_vt_move(vt, vt->x, vt->y + n); break;
+        case 'C': case 'a': btui_vt_move(vt, vt->x + n, vt->y); break;
+        case 'D': btui_vt_move(vt, vt->x - n, vt->y); break;
+        case 'E': btui_vt_move(vt, 0, vt->y + n); break;
+        case 'F': btui_vt_move(vt, 0, vt->y - n); break;
+        case 'G': case '`': btui_vt_move(vt, n - 1, vt->y); break;
+        case 'd': btui_vt_move(vt, vt->x, n - 1); break;
+        case 'H': case 'f': btui_vt_move(vt, (vt->nparams > 1 && p[1] > 0 ? p[1] : 1) - 1, n - 1); break;
+        case 'J':
+            if (p[0] == 0) {
+                btui_vt_erase(vt, vt->y, vt->x, vt->width);
+                for (int y = vt->y + 1; y < vt->height; y++)
+                    btui_vt_erase(vt, y, 0, vt->width);
+            } else if (p[0] == 1) {
+                for (int y = 0; y < vt->y; y++)
+                    btui_vt_erase(vt, y, 0, vt->width);
+                btui_vt_erase(vt, vt->y, 0, vt->x + 1);
+            } else {
+                for (int y = 0; y < vt->height; y++)
+                    btui_vt_erase(vt, y, 0, vt->width);
+            }
+            break;
+        case 'K':
+            if (p[0] == 0) btui_vt_erase(vt, vt->y, vt->x, vt->width);
+            else if (p[0] == 1) btui_vt_erase(vt, vt->y, 0, vt->x + 1);
+            else btui_vt_erase(vt, vt->y, 0, vt->width);
+            break;
+        case 'X': btui_vt_erase(vt, vt->y, vt->x, vt->x + n); break;
+        case 'b':
+            if (vt->last.width > 0) {
+                for (int i = 0; i < n && i < vt->width * vt->height; i++)
+                    btui_vt_print(vt, vt->last.glyph, (int)vt->last.width);
+            }
+            break;
+        case 'S': btui_vt_scroll(vt, vt->scroll_top, vt->scroll_bottom, n); break;
+        case 'T': btui_vt_scroll(vt, vt->scroll_top, vt->scroll_bottom, -n); break;
+        case 'L': case 'M':
+            if (vt->scroll_top <= vt->y && vt->y <= vt->scroll_bottom)
+                btui_vt_scroll(vt, vt->y, vt->scroll_bottom, final == 'L' ? -n : n);
+            break;
+        case '@': case 'P': {
+            btui_cell_t *row = &vt->cells[vt->y*vt->width];
+            if (n > vt->width - vt->x) n = vt->width - vt->x;
+            size_t rest = (size_t)(vt->width - vt->x - n);
+            if (final == '@') {
+                memmove(&row[vt->x + n], &row[vt->x], rest * sizeof(btui_cell_t));
+                btui_fill_cells(&row[vt->x], (size_t)n, &vt->pen);
+            } else {
+                memmove(&row[vt->x], &row[vt->x + n], rest * sizeof(btui_cell_t));
+                btui_fill_cells(&row[vt->width - n], (size_t)n, &vt->pen);
+            }
+            break;
+        }
+        case 'r': {
+            int top = p[0] > 0 ? p[0] - 1 : 0;
+            int bottom = vt->nparams > 1 && p[1] > 0 ? p[1] - 1 : vt->height - 1;
+            if (bottom >= vt->height) bottom = vt->height - 1;
+            if (top < bottom) {
+                vt->scroll_top = top;
+                vt->scroll_bottom = bottom;
+                btui_vt_move(vt, 0, 0);
+            }
+            break;
+        }
+        case 'm': btui_pen_apply_sgr(&vt->pen, vt->params, vt->nparams); break;
+        case 's': vt->saved_x = vt->x, vt->saved_y = vt->y; break;
+        case 'u': btui_vt_move(vt, vt->saved_x, vt->saved_y); break;
+        default: break;
+    }
+}
+
+/*
+ * Carry out a control character.
+ */
+static void btui_vt_control(btui_vt_t *vt, unsigned char c)
+{
+    switch (c) {
+        case '\r': vt->x = 0, vt->wrap_pending = 0; break;
+        case '\n': case '\v': case '\f': btui_vt_linefeed(vt); break;
+        case '\b': if (vt->x > 0) --vt->x; vt->wrap_pending = 0; break;
+        case '\t': btui_vt_move(vt, (vt->x + 8) & ~7, vt->y); break;
+        default: break;
+    }
+}
+
+/*
+ * Carry out an escape sequence that isn't a CSI sequence.
+ */
+static void btui_vt_esc(btui_vt_t *vt, unsigned char c)
+{
+    switch (c) {
+        // Like a real terminal, DECSC/DECRC save the attributes and charset
+        // along with the cursor:
+        case '7':
+            vt->saved_x = vt->x, vt->saved_y = vt->y;
+            vt->saved_pen = vt->pen, vt->saved_line_drawing = vt->line_drawing;
+            break;
+        case '8':
+            btui_vt_move(vt, vt->saved_x, vt->saved_y);
+            vt->pen = vt->saved_pen, vt->line_drawing = vt->saved_line_drawing;
+            break;
+        case 'D': btui_vt_linefeed(vt); break;
+        case 'E': vt->x = 0; btui_vt_linefeed(vt); break;
+        case 'M':
+            vt->wrap_pending = 0;
+            if (vt->y == vt->scroll_top)
+                btui_vt_scroll(vt, vt->scroll_top, vt->scroll_bottom, -1);
+            else if (vt->y > 0)
+                --vt->y;
+            break;
+        case 'c': {
+            int input_fd = vt->input_fd;
+            btui_vt_t fresh = {.cells = vt->cells, .width = vt->width, .height = vt->height,
+                .autowrap = 1, .cursor_visible = 1, .scroll_bottom = vt->height - 1, .input_fd = input_fd,
+                .bytes = vt->bytes, .writes = vt->writes, .sequences = vt->sequences, .printed = vt->printed};
+            *vt = fresh;
+            for (int y = 0; y < vt->height; y++)
+                btui_vt_erase(vt, y, 0, vt->width);
+            break;
+        }
+        default: break;
+    }
+}
+
+/*
+ * Write a chunk of traced bytes as a JSON string. Valid UTF-8 is written as
+ * is and anything else is escaped, with invalid bytes written as the
+ * characters U+0080 to U+00FF (which are otherwise never escaped). An
+ * incomplete UTF-8 character at the end is left in `carry` to go at the start
+ * of the next chunk of the same kind. (Helper method for btui_trace_dump())
+ */
+static void btui_trace_write_string(FILE *f, const unsigned char *p, const unsigned char *end,
+                                    unsigned char *carry, int *carry_len)
+{
+    fputc('"', f);
+    while (p < end) {
+        uint32_t c;
+        int len = btui_utf8_decode(p, end, &c);
+        // Overlong encodings and surrogates aren't valid either:
+        if (len > 1 && c >= (len == 2 ? 0x80u : (len == 3 ? 0x800u : 0x10000u))
+            && (c < 0xD800 || c > 0xDFFF) && c <= 0x10FFFF) {
+            fwrite(p, 1, (size_t)len, f);
+            p += len;
+            continue;
+        }
+        if (*p >= 0xC2 && *p < 0xF5 && end - p < (*p < 0xE0 ? 2 : (*p < 0xF0 ? 3 : 4))) {
+            // Save a character that was cut off to finish it with the next chunk:
+            int partial = 1;
+            for (const unsigned char *q = p + 1; q < end; q++)
+                partial = partial && (*q & 0xC0) == 0x80;
+            if (partial) {
+                *carry_len = (int)(end - p);
+                memcpy(carry, p, (size_t)*carry_len);
+                break;
+            }
+        }
+        switch (*p) {
+            case '"': fputs("\\\"", f); break;
+            case '\\': fputs("\\\\", f); break;
+            case '\n': fputs("\\n", f); break;
+            case '\r': fputs("\\r", f); break;
+            default:
+                if (*p < ' ' || *p >= 0x7F) fprintf(f, "\\u%04x", (unsigned int)*p);
+                else fputc(*p, f);
+                break;
+        }
+        ++p;
+    }
+    fputc('"', f);
+}
+
+/*
+ * Get ready to draw the performance overlay in the top right corner. In
+ * retained mode, what the app drew there is set aside, and what the terminal
+ * already shows there is put in its place, so the app's frame only outputs
+ * what changed everywhere else.
+ */
+static void btui_hud_begin(btui_t *bt)
+{
+    btui_hud_t *hud = bt->hud;
+    uint64_t start = btui_now();
+    hud->x = hud->y = -1;
+    hud->cost_us = 0;
+    if (bt->mode != BTUI_MODE_TUI || bt->width < BTUI_HUD_WIDTH || bt->height < BTUI_HUD_HEIGHT)
+        return;
+    if (bt->retained && btui_screen_resize(bt))
+        return;
+    hud->x = bt->width - BTUI_HUD_WIDTH, hud->y = 0;
+    if (!bt->retained) return;
+    btui_screen_t *s = &bt->screen;
+    for (int row = 0; row < BTUI_HUD_HEIGHT; row++) {
+        btui_cell_t *back = &s->back[(hud->y + row) * s->width + hud->x];
+        memcpy(&hud->under[row * BTUI_HUD_WIDTH], back, BTUI_HUD_WIDTH * sizeof(btui_cell_t));
+        if (s->valid)
+            memcpy(back, &s->front[(hud->y + row) * s->width + hud->x], BTUI_HUD_WIDTH * sizeof(btui_cell_t));
+    }
+    hud->cost_us = btui_now() - start;
+}
+
+/*
+ * Measure the frame that's about to be written and draw the performance
+ * overlay on top of it, leaving the cursor and pen the way the app had them.
+ * In retained mode, the overlay only outputs what changed since the last
+ * frame, and then the app's cells are put back where it was drawn.
+ */
+static int btui_hud_draw(btui_t *bt)
+{
+    btui_hud_t *hud = bt->hud;
+    if (hud->x < 0) return 0;
+    uint64_t start = btui_now();
+    if (hud->last_frame) {
+        double elapsed = (double)(start - hud->last_frame);
+        hud->frame_us = hud->frame_us > 0 ? 0.9 * hud->frame_us + 0.1 * elapsed : elapsed;
+    }
+    hud->last_frame = start;
+    hud->frame_bytes = bt->outlen - bt->pending;
+    btui_stats_t stats;
+    btui_stats(bt, &stats);
+    hud->frame_writes = stats.writes - (stats.writes >= hud->last_writes ? hud->last_writes : 0);
+    hud->last_writes = stats.writes;
+    int available = 0;
+    if (ioctl(fileno(bt->in), FIONREAD, &available) < 0) available = 0;
+    hud->queued = (bt->inlen - bt->inpos) + (uint64_t)(available > 0 ? available : 0);
+
+    btui_screen_t *s = &bt->screen;
+    btui_screen_t saved = *s;
+    btui_pen_t pen = bt->pen;
+    int cursor_x = bt->cursor_x, cursor_y = bt->cursor_y;
+    size_t outlen = bt->outlen;
+    if (!bt->retained) btui_out_literal(bt, "\0337");
+    btui_set_attributes(bt, BTUI_NORMAL | BTUI_FG_WHITE | BTUI_BG_BLACK);
+    int x = hud->x + 1, y = hud->y + 1, w = BTUI_HUD_WIDTH - 2;
+    btui_fill_box(bt, x, y, w, BTUI_HUD_HEIGHT - 2);
+    btui_draw_linebox(bt, x, y, w, BTUI_HUD_HEIGHT - 2);
+    btui_move_cursor(bt, x, y);
+    btui_printf(bt, "%7.2fms %6.0f fps", hud->frame_us / 1e3, hud->frame_us > 0 ? 1e6 / hud->frame_us : 0.0);
+    btui_move_cursor(bt, x, y + 1);
+    btui_printf(bt, "%7lu bytes/frame", (unsigned long)hud->frame_bytes);
+    btui_move_cursor(bt, x, y + 2);
+    btui_printf(bt, "%7lu writes/frame", (unsigned long)hud->frame_writes);
+    btui_move_cursor(bt, x, y + 3);
+    btui_printf(bt, "%7lu bytes queued", (unsigned long)hud->queued);
+    btui_move_cursor(bt, x, y + 4);
+    btui_printf(bt, "hud %5luus %6luB", (unsigned long)hud->cost_us, (unsigned long)hud->cost_bytes);
+
+    if (bt->retained) {
+        s->x = saved.x, s->y = saved.y, s->pen = saved.pen, s->line_drawing = saved.line_drawing;
+        if (btui_screen_flush(bt)) return -1;
+        for (int row = 0; row < BTUI_HUD_HEIGHT; row++) {
+            memcpy(&s->back[(hud->y + row) * s->width + hud->x], &hud->under[row * BTUI_HUD_WIDTH],
+                   BTUI_HUD_WIDTH * sizeof(btui_cell_t));
+            btui_screen_mark_dirty(s, hud->y + row);
+        }
+    } else {
+        // Restoring the cursor also restores the terminal's attributes, so the
+        // app's pen is back as it was, whether or not it was known:
+        btui_out_literal(bt, "\0338");
+        bt->cursor_x = cursor_x, bt->cursor_y = cursor_y;
+        bt->pen = pen;
+    }
+    hud->cost_bytes = bt->outlen - outlen;
+    hud->cost_us += btui_now() - start;
+    hud->total_cost_bytes += hud->cost_bytes;
+    hud->total_cost_us += hud->cost_us;
+    return 0;
+}
+
+/*
+ * Output a frame: in retained mode, the changes to the screen, and the
+ * performance overlay on top, if it's enabled.
+ */
+static int btui_draw_frame(btui_t *bt)
+{
+    if (bt->hud) btui_hud_begin(bt);
+    if (bt->retained && btui_screen_flush(bt))
+        return -1;
+    return bt->hud ? btui_hud_draw(bt) : 0;
+}
+
+/*
+ * Timers for the event loop are kept in a hierarchical timing wheel with 1ms
+ * ticks: level 0 has a slot for each of the next 64 milliseconds, level 1 a
+ * slot for each of the next 64 spans of 64ms, and so on, up to about 4.6
+ * hours. Adding or cancelling a timer is O(1), finding the next deadline is a
+ * bit scan per level, and when a coarse slot's time comes up, its timers move
+ * down to the finer levels.
+ */
+#define BTUI_WHEEL_LEVELS 4
+#define BTUI_WHEEL_BITS 6
+#define BTUI_WHEEL_SLOTS (1 << BTUI_WHEEL_BITS)
+
+struct btui_timer_s {
+    uint64_t expires, interval; // In milliseconds on the monotonic clock
+    btui_timer_callback_t callback;
+    void *data;
+    struct btui_timer_s *prev, *next;
+    int level, slot, cancelled;
+};
+
+// Something the event loop waits on: a file descriptor with a callback, or a
+// BTUI's input (or the resize pipe), which is decoded into events:
+typedef struct {
+    int fd, events, removed;
+    btui_fd_callback_t fd_callback;
+    btui_t *bt;
+    btui_key_callback_t key_callback;
+    void *data;
+} btui_watch_t;
+
+struct btui_loop_s {
+#ifdef BTUI_EPOLL
+    int epoll_fd;
+#else
+    struct pollfd *pollfds;
+#endif
+    btui_watch_t **watches;
+    size_t nwatches, capacity, active, ntimers;
+    struct btui_timer_s *wheel[BTUI_WHEEL_LEVELS][BTUI_WHEEL_SLOTS];
+    uint64_t occupied[BTUI_WHEEL_LEVELS]; // Bitmaps of the non-empty slots
+    uint64_t tick; // The millisecond the wheel has been advanced to
+    struct btui_timer_s *firing; // The timer whose callback is running
+    int running;
+};
+
+/*
+ * Put a timer in the wheel slot for its expiry time, which must not be before
+ * the current tick.
+ */
+static void btui_wheel_insert(btui_loop_t *loop, struct btui_timer_s *t)
+{
+    uint64_t delta = t->expires - loop->tick, when = t->expires;
+    int level = 0;
+    while (level < BTUI_WHEEL_LEVELS - 1 && delta >= (UINT64_C(1) << (BTUI_WHEEL_BITS * (level + 1))))
+        ++level;
+    // Timers further off than the wheel reaches wait in the furthest slot and
+    // get re-sorted from there:
+    uint64_t reach = UINT64_C(1) << (BTUI_WHEEL_BITS * BTUI_WHEEL_LEVELS);
+    if (delta >= reach) when = loop->tick + reach - 1;
+    int slot = (int)((when >> (BTUI_WHEEL_BITS * level)) & (BTUI_WHEEL_SLOTS - 1));
+    t->level = level, t->slot = slot;
+    t->prev = NULL;
+    t->next = loop->wheel[level][slot];
+    if (t->next) t->next->prev = t;
+    loop->wheel[level][slot] = t;
+    loop->occupied[level] |= UINT64_C(1) << slot;
+}
+
+static void btui_wheel_remove(btui_loop_t *loop, struct btui_timer_s *t)
+{
+    if (t->prev) t->prev->next = t->next;
+    else loop->wheel[t->level][t->slot] = t->next;
+    if (t->next) t->next->prev = t->prev;
+    if (!loop->wheel[t->level][t->slot])
+        loop->occupied[t->level] &= ~(UINT64_C(1) << t->slot);
+}
+
+/*
+ * Return the next tick when something happens in the timer wheel (a level 0
+ * slot expires, or a coarser slot has to move down a level), or UINT64_MAX if
+ * there aren't any timers.
+ */
+static uint64_t btui_wheel_next(btui_loop_t *loop)
+{
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < BTUI_WHEEL_LEVELS; level++) {
+        uint64_t mask = loop->occupied[level];
+        if (!mask) continue;
+        int shift = BTUI_WHEEL_BITS * level;
+        uint64_t block = loop->tick >> shift;
+        // Rotate the bitmap so the slot after the current one is bit 0:
+        unsigned int r = (unsigned int)((block + 1) & (BTUI_WHEEL_SLOTS - 1));
+        uint64_t rotated = r ? (mask >> r) | (mask << (64 - r)) : mask;
+        uint64_t when = (block + 1 + (uint64_t)__builtin_ctzll(rotated)) << shift;
+        if (when < next) next = when;
+    }
+    return next;
+}
+
+/*
+ * Advance the timer wheel up to the tick `now`, running the callbacks of the
+ * timers that expire along the way, in order.
+ */
+static void btui_wheel_advance(btui_loop_t *loop, uint64_t now)
+{
+    uint64_t next;
+    while ((next = btui_wheel_next(loop)) <= now) {
+        loop->tick = next;
+        for (int level = BTUI_WHEEL_LEVELS - 1; level > 0; level--) {
+            int shift = BTUI_WHEEL_BITS * level;
+            if (next & ((UINT64_C(1) << shift) - 1)) continue;
+            int slot = (int)((next >> shift) & (BTUI_WHEEL_SLOTS - 1));
+            struct btui_timer_s *t = loop->wheel[level][slot];
+            loop->wheel[level][slot] = NULL;
+            loop->occupied[level] &= ~(UINT64_C(1) << slot);
+            while (t) {
+                struct btui_timer_s *following = t->next;
+                btui_wheel_insert(loop, t);
+                t = following;
+            }
+        }
+        int slot = (int)(next & (BTUI_WHEEL_SLOTS - 1));
+        struct btui_timer_s *t;
+        while ((t = loop->wheel[0][slot])) {
+            btui_wheel_remove(loop, t);
+            loop->firing = t;
+            t->callback(loop, t, t->data);
+            loop->firing = NULL;
+            if (t->interval > 0 && !t->cancelled) {
+                // Missed intervals are skipped rather than run back to back:
+                t->expires += t->interval;
+                if (t->expires <= loop->tick) t->expires = loop->tick + t->interval;
+                btui_wheel_insert(loop, t);
+            } else {
+                free(t);
+                --loop->ntimers;
+            }
+        }
+    }
+    if (now > loop->tick) loop->tick = now;
+}
+
+/*
+ * Find the active watch for a file descriptor, or NULL if there isn't one.
+ */
+static btui_watch_t *btui_loop_find(btui_loop_t *loop, int fd)
+{
+    for (size_t i = 0; i < loop->nwatches; i++) {
+        if (loop->watches[i]->fd == fd && !loop->watches[i]->removed)
+            return loop->watches[i];
+    }
+    return NULL;
+}
+
+/*
+ * Start waiting on a file descriptor, and return its new watch (or NULL on
+ * failure).
+ */
+static btui_watch_t *btui_loop_watch(btui_loop_t *loop, int fd, int events)
+{
+    if (loop->nwatches >= loop->capacity) {
+        size_t capacity = loop->capacity ? 2 * loop->capacity : 8;
+        btui_watch_t **watches = realloc(loop->watches, capacity * sizeof(btui_watch_t*));
+        if (!watches) return NULL;
+        loop->watches = watches;
+#ifndef BTUI_EPOLL
+        struct pollfd *pollfds = realloc(loop->pollfds, capacity * sizeof(struct pollfd));
+        if (!pollfds) return NULL;
+        loop->pollfds = pollfds;
+#endif
+        loop->capacity = capacity;
+    }
+    btui_watch_t *w = calloc(1, sizeof(btui_watch_t));
+    if (!w) return NULL;
+    w->fd = fd, w->events = events;
+#ifdef BTUI_EPOLL
+    struct epoll_event ev = {
+        .events = ((events & BTUI_LOOP_READ) ? EPOLLIN : 0u) | ((events & BTUI_LOOP_WRITE) ? EPOLLOUT : 0u),
+        .data.ptr = w,
+    };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+        free(w);
+        return NULL;
+    }
+#endif
+    loop->watches[loop->nwatches++] = w;
+    ++loop->active;
+    return w;
+}
+
+/*
+ * Stop waiting on a watch. It's only freed after the current round of
+ * callbacks, since one of them might be the one removing it.
+ */
+static void btui_loop_unwatch(btui_loop_t *loop, btui_watch_t *w)
+{
+#ifdef BTUI_EPOLL
+    struct epoll_event ev = {0};
+    (void)epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, w->fd, &ev);
+#endif
+    w->removed = 1;
+    --loop->active;
+}
+
+/*
+ * Pass on the events from a watch that's ready.
+ */
+static void btui_loop_dispatch(btui_loop_t *loop, btui_watch_t *w, int events)
+{
+    if (w->removed) return;
+    if (!w->bt) {
+        w->fd_callback(loop, w->fd, events, w->data);
+        return;
+    }
+    btui_event_t keys[64];
+    int n = btui_getkeys(w->bt, keys, sizeof(keys)/sizeof(keys[0]), 0);
+    for (int i = 0; i < n && !w->removed; i++)
+        w->key_callback(loop, w->bt, &keys[i], w->data);
+}
+
+/*
+ * Return whether any BTUI has events that don't need any waiting for: input
+ * that's been read but not parsed yet, or a resize.
+ */
+static int btui_loop_pending(btui_loop_t *loop)
+{
+    for (size_t i = 0; i < loop->nwatches; i++) {
+        btui_watch_t *w = loop->watches[i];
+        if (w->bt && !w->removed && (w->bt->inpos < w->bt->inlen || w->bt->size_changed))
+            return 1;
+    }
+    return 0;
+}
+
+// Public API functions:
+
+/*
+ * Clear all or part of the screen. `mode` should be one of:
+ *   BTUI_CLEAR_(BELOW|ABOVE|SCREEN|RIGHT|LEFT|LINE)
+ */
+int btui_clear(btui_t *bt, int mode)
+{
+    if (bt->retained) return btui_screen_clear(bt, mode);
+    switch (mode) {
+        case BTUI_CLEAR_BELOW:  return btui_out_literal(bt, "\033[J");
+        case BTUI_CLEAR_ABOVE:  return btui_out_literal(bt, "\033[1J");
+        case BTUI_CLEAR_SCREEN: return btui_out_literal(bt, "\033[2J");
+        case BTUI_CLEAR_RIGHT:  return btui_out_literal(bt, "\033[K");
+        case BTUI_CLEAR_LEFT:   return btui_out_literal(bt, "\033[1K");
+        case BTUI_CLEAR_LINE:   return btui_out_literal(bt, "\033[2K");
+        default:                return -1;
+    }
+}
+
+/*
+ * Disable TUI mode (return to the normal terminal with the normal terminal
+ * input handling).
+ */
+void btui_disable(btui_t *bt)
+{
+    if (bt->vt) {
+        // Headless BTUIs are freed:
+        btui_trace_finish(bt);
+        btui_set_hud(bt, 0);
+        btui_vt_free(bt->vt);
+        fclose(bt->in);
+        btui_screen_free(bt);
+        free(bt->outbuf);
+        free(bt);
+        return;
+    }
+    if (bt != &current_bt) {
+        btui_release(bt);
+        free(bt);
+        return;
+    }
+    btui_cleanup();
+}
+
+/*
+ * Draw a box using the special box-drawing characters at the given x,y
+ * position with the given width,height.
+ */
+void btui_draw_linebox(btui_t *bt, int x, int y, int w, int h)
+{
+    btui_move_cursor(bt, x-1, y-1);
+    // Top row
+    btui_write(bt, "\033(0l", 4);
+    btui_repeat(bt, 'q', w);
+    btui_write(bt, "k", 1);
+    // Side walls
+    for (int i = 0; i < h; i++) {
+        btui_move_cursor(bt, x-1, y + i);
+        btui_write(bt, "x", 1);
+        btui_move_cursor(bt, x + w, y + i);
+        btui_write(bt, "x", 1);
+    }
+    // Bottom row
+    btui_move_cursor(bt, x-1, y + h);
+    btui_write(bt, "m", 1);
+    btui_repeat(bt, 'q', w);
+    btui_write(bt, "j\033(B", 4);
+}
+
+/*
+ * Draw a shadow to the bottom right of the given box coordinates.
+ */
+void btui_draw_shadow(btui_t *bt, int x, int y, int w, int h)
+{
+    btui_write(bt, "\033(0", 3);
+    for (int i = 0; i < h-1; i++) {
+        btui_move_cursor(bt, x + w, y + 1 + i);
+        btui_write(bt, "a", 1);
+    }
+    btui_move_cursor(bt, x + 1, y + h);
+    btui_repeat(bt, 'a', w);
+    btui_write(bt, "\033(B", 3);
+}
+
+/*
+ * Enable TUI mode for this terminal and return a pointer to the BTUI struct
+ * that should be passed to future API calls.
+ */
+btui_t *btui_create(btui_mode_t mode)
+{
+    btui_init_tables();
+    FILE *in = fopen("/dev/tty", "r");
+    if (!in) return NULL;
+    FILE *out = fopen("/dev/tty", "w");
+    if (!out) {
+        fclose(in);
+        return NULL;
+    }
+
+    current_bt.in = in;
+    current_bt.out = out;
+    if (btui_set_raw(&current_bt)) {
+        fclose(in);
+        fclose(out);
+        memset(&current_bt, 0, sizeof(btui_t));
+        return NULL;
+    }
+    current_bt.mode = BTUI_MODE_NORMAL;
+    current_bt.controlling = 1;
+    atexit(btui_cleanup);
+
+    if (resize_pipe[0] == -1 && pipe(resize_pipe) == 0) {
+        for (int i = 0; i < 2; i++) {
+            fcntl(resize_pipe[i], F_SETFL, fcntl(resize_pipe[i], F_GETFL) | O_NONBLOCK);
+            fcntl(resize_pipe[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+    struct sigaction sa_winch = {.sa_handler = &btui_on_resize};
+    sigaction(SIGWINCH, &sa_winch, NULL);
+    int signals[] = {SIGTERM, SIGINT, SIGXCPU, SIGXFSZ, SIGVTALRM, SIGPROF, SIGSEGV, SIGTSTP, SIGPIPE};
+    struct sigaction sa = {.sa_handler = &btui_cleanup_and_raise, .sa_flags = (int)(SA_NODEFER | SA_RESETHAND)};
+    for (size_t i = 0; i < sizeof(signals)/sizeof(signals[0]); i++)
+        sigaction(signals[i], &sa, NULL);
+
+    update_term_size(&current_bt);
+    current_bt.size_changed = 0;
+    btui_set_color_depth(&current_bt, BTUI_COLORS_AUTO);
+    btui_set_capabilities(&current_bt, BTUI_CAP_AUTO);
+    const char *trace_path = getenv("BTUI_TRACE");
+    if (trace_path && *trace_path && btui_set_trace(&current_bt, 1) == 0)
+        current_bt.trace->path = strdup(trace_path);
+    const char *hud = getenv("BTUI_HUD");
+    if (hud && *hud) btui_set_hud(&current_bt, 1);
+    btui_set_mode(&current_bt, mode);
+    return &current_bt;
+}
+
+/*
+ * Create a BTUI in TUI mode for the terminal on the given file descriptors
+ * (which can be the same one), like a pty or a socket to a remote terminal,
+ * so a single process can run many independent sessions. BTUI uses its own
+ * copies of the file descriptors, and if input comes from a terminal, puts
+ * that terminal in raw mode until btui_disable(). Unlike btui_create(), this
+ * doesn't install any signal handlers, so if the terminal can't report its
+ * own size (like a socket), it starts at 80x24 and resizes have to be passed
+ * on with btui_set_size(). Free it with btui_disable(). Returns NULL on
+ * failure, including if the terminal can't be put in raw mode.
+ */
+btui_t *btui_create_fd(int in_fd, int out_fd)
+{
+    btui_init_tables();
+    btui_t *bt = calloc(1, sizeof(btui_t));
+    if (!bt) return NULL;
+    int in = dup(in_fd), out = dup(out_fd);
+    if (in >= 0) fcntl(in, F_SETFD, FD_CLOEXEC);
+    if (out >= 0) fcntl(out, F_SETFD, FD_CLOEXEC);
+    if (in < 0 || out < 0 || !(bt->in = fdopen(in, "r")) || !(bt->out = fdopen(out, "w"))
+        || (isatty(in) && btui_set_raw(bt))) {
+        if (bt->in) fclose(bt->in);
+        else if (in >= 0) close(in);
+        if (bt->out) fclose(bt->out);
+        else if (out >= 0) close(out);
+        free(bt);
+        return NULL;
+    }
+    bt->mode = BTUI_MODE_NORMAL;
+    update_term_size(bt);
+    if (bt->width <= 0 || bt->height <= 0)
+        bt->width = 80, bt->height = 24;
+    bt->size_changed = 0;
+    btui_set_color_depth(bt, BTUI_COLORS_AUTO);
+    btui_set_capabilities(bt, BTUI_CAP_AUTO);
+    const char *hud = getenv("BTUI_HUD");
+    if (hud && *hud) btui_set_hud(bt, 1);
+    btui_set_mode(bt, BTUI_MODE_TUI);
+    return bt;
+}
+
+/*
+ * Create a BTUI that draws to a virtual terminal of the given size instead of
+ * /dev/tty (see btui_vt_feed()). Its output can be inspected through `bt->vt`,
+ * and input can be sent to it with btui_vt_type(). This is useful for tests
+ * and benchmarks. Free it with btui_disable(). Returns NULL on failure.
+ */
+btui_t *btui_create_headless(int width, int height)
+{
+    btui_init_tables();
+    btui_t *bt = calloc(1, sizeof(btui_t));
+    if (!bt) return NULL;
+    int input[2] = {-1, -1};
+    bt->vt = btui_vt_create(width, height);
+    if (!bt->vt || pipe(input) || !(bt->in = fdopen(input[0], "r"))) {
+        if (input[0] >= 0) close(input[0]);
+        if (input[1] >= 0) close(input[1]);
+        if (bt->vt) btui_vt_free(bt->vt);
+        free(bt);
+        return NULL;
+    }
+    bt->vt->input_fd = input[1];
+    bt->width = width;
+    bt->height = height;
+    btui_set_color_depth(bt, BTUI_COLORS_TRUECOLOR);
+    btui_set_capabilities(bt, BTUI_CAP_ECH | BTUI_CAP_REP | BTUI_CAP_RECT);
+    btui_set_mode(bt, BTUI_MODE_TUI);
+    return bt;
+}
+
+/*
+ * Set the display mode of BTUI
+ */
+void btui_set_mode(btui_t *bt, btui_mode_t mode)
+{
+    if (mode == bt->mode) return;
+    switch (mode) {
+        case BTUI_MODE_NORMAL: case BTUI_MODE_UNINITIALIZED:
+            if (bt->mode == BTUI_MODE_TUI)
+                btui_out_literal(bt, T_OFF(T_ALT_SCREEN));
+            btui_out_literal(bt, T_ON(T_SHOW_CURSOR ";" T_WRAP) T_OFF(T_MOUSE_XY ";" T_MOUSE_CELL ";" T_MOUSE_SGR) "\033[0m");
+            break;
+        case BTUI_MODE_TUI:
+            btui_out_literal(bt, T_OFF(T_SHOW_CURSOR ";" T_WRAP)  T_ON(T_ALT_SCREEN ";" T_MOUSE_XY ";" T_MOUSE_CELL ";" T_MOUSE_SGR) "\033[0m");
+            break;
+        default: break;
+    }
+    if (bt->nonblocking) btui_flush_output_nonblocking(bt);
+    else btui_flush_output(bt);
+    bt->mode = mode;
+    memset(&bt->pen, 0, sizeof(btui_pen_t));
+    bt->cursor_x = bt->cursor_y = -1;
+    bt->screen.valid = 0;
+}
+
+/*
+ * Leave the cursor where filling a box by writing spaces would have: just past
+ * the end of its last row. If that's off the screen, the cursor is left
+ * wherever it is, and its position is no longer tracked. (Helper method for
+ * btui_fill_box())
+ */
+static void btui_fill_box_end(btui_t *bt, int x, int y, int w, int h)
+{
+    if (x + w < 0 || x + w >= bt->width || y + h - 1 < 0 || y + h - 1 >= bt->height)
+        bt->cursor_x = bt->cursor_y = -1;
+    else
+        btui_move_cursor(bt, x + w, y + h - 1);
+}
+
+/*
+ * Fill the given rectangular area (x,y coordinates and width,height) with
+ * spaces, leaving the cursor just past the end of the last row. If the box
+ * reaches the right edge of the screen, where the cursor ends up depends on
+ * the terminal, so it should be moved before writing anything else.
+ */
+void btui_fill_box(btui_t *bt, int x, int y, int w, int h)
+{
+    if (!bt->retained && w > 0 && h > 1 && (bt->capabilities & BTUI_CAP_RECT)) {
+        // DECFRA fills the whole rectangle with spaces in the current pen:
+        int left = x < 0 ? 0 : x, top = y < 0 ? 0 : y;
+        int right = x + w > bt->width ? bt->width : x + w, bottom = y + h > bt->height ? bt->height : y + h;
+        if (left >= right || top >= bottom) return;
+        char *p = btui_reserve(bt, 48);
+        if (!p) return;
+        memcpy(p, "\033[32;", 5);
+        p = btui_enc_num(p + 5, top + 1);
+        *p++ = ';';
+        p = btui_enc_num(p, left + 1);
+        *p++ = ';';
+        p = btui_enc_num(p, bottom);
+        *p++ = ';';
+        p = btui_enc_num(p, right);
+        memcpy(p, "$x", 2);
+        btui_commit(bt, p + 2);
+        btui_fill_box_end(bt, x, y, w, h);
+        return;
+    }
+    // ECH erases to the background color, which only looks the same as spaces
+    // when no attributes (like reverse video or underline) are set:
+    int erase = !bt->retained && w > 0 && (bt->capabilities & BTUI_CAP_ECH) && bt->pen.attrs == 0
+        && 3 + btui_digits(w) < w;
+    for (int row = y; row < y + h; row++) {
+        btui_move_cursor(bt, x, row);
+        if (erase) {
+            char *p = btui_reserve(bt, 16);
+            if (!p) return;
+            btui_commit(bt, btui_enc_csi(p, w, 'X'));
+        } else {
+            btui_repeat(bt, ' ', w);
+        }
+    }
+    if (erase && h > 0) btui_fill_box_end(bt, x, y, w, h);
+}
+
+/*
+ * Flush BTUI's output. In non-blocking mode, this only writes what the
+ * terminal will take without waiting, and in retained mode, nothing new is
+ * drawn while the terminal is still busy with the last frame (the next flush
+ * will draw the latest state instead).
+ */
+int btui_flush(btui_t *bt)
+{
+    BTUI_COUNT(bt, flushes, 1);
+    if (!bt->nonblocking) {
+        if (btui_draw_frame(bt))
+            return -1;
+        if (btui_flush_output(bt))
+            return -1;
+        btui_answer_input(bt);
+        return 0;
+    }
+    if (bt->pending > 0 && btui_flush_output_nonblocking(bt))
+        return -1;
+    int drawn = !bt->retained || bt->pending == 0;
+    if (drawn && btui_draw_frame(bt))
+        return -1;
+    if (btui_flush_output_nonblocking(bt))
+        return -1;
+    // Input only counts as answered once a frame drawn after it is all out:
+    if (drawn && bt->pending == 0)
+        btui_answer_input(bt);
+    return 0;
+}
+
+/*
+ * Begin a frame. Returns 1 if the frame should be drawn, or 0 if it should be
+ * skipped because the terminal hasn't finished taking the last frame's output
+ * or because it's too soon for the frame rate set with btui_set_fps(). A
+ * frame that is drawn should end with btui_frame_end().
+ */
+int btui_frame_begin(btui_t *bt)
+{
+    // Skip frames while the terminal (or the writer thread) won't take more:
+    if (bt->pending > 0 && (btui_flush_output_nonblocking(bt) || bt->pending > 0))
+        return 0;
+    uint64_t now = btui_now();
+    if (bt->fps > 0) {
+        uint64_t interval = UINT64_C(1000000) / (uint64_t)bt->fps;
+        if (now - bt->frame_start < interval) return 0;
+        // Stay on schedule, unless the frames are falling far behind:
+        bt->frame_start = now - bt->frame_start < 2*interval ? bt->frame_start + interval : now;
+    } else {
+        bt->frame_start = now;
+    }
+    return 1;
+}
+
+/*
+ * End a frame started with btui_frame_begin() and flush its output.
+ */
+int btui_frame_end(btui_t *bt)
+{
+    return btui_flush(bt);
+}
+
+/*
+ * Return how many milliseconds until btui_frame_begin() will want a frame
+ * drawn (0 if it already does). This is a good timeout for btui_getkeys().
+ */
+int btui_frame_timeout(btui_t *bt)
+{
+    int interval = bt->fps > 0 ? 1000 / bt->fps : 0;
+    // There's no telling when the terminal will catch up, so check back soon:
+    if (bt->pending > 0) return interval > 10 ? interval : 10;
+    if (bt->fps <= 0) return 0;
+    uint64_t next = bt->frame_start + UINT64_C(1000000) / (uint64_t)bt->fps, now = btui_now();
+    return next > now ? (int)((next - now + 999) / 1000) : 0;
+}
+
+/*
+ * Close BTUI files and prevent cleaning up (useful for fork/exec). A BTUI from
+ * btui_create_fd() or btui_create_headless() is freed, without saving its
+ * trace.
+ */
+void btui_force_close(btui_t *bt)
+{
+    if (bt->vt) {
+        btui_set_trace(bt, 0);
+        btui_set_hud(bt, 0);
+        btui_vt_free(bt->vt);
+        fclose(bt->in);
+        btui_screen_free(bt);
+        free(bt->outbuf);
+        free(bt);
+        return;
+    }
+    if (!bt->out) return;
+#ifndef BTUI_NO_THREADS
+    if (bt->writer) btui_writer_stop(bt->writer);
+#endif
+    btui_set_trace(bt, 0);
+    btui_set_hud(bt, 0);
+    fclose(bt->in);
+    fclose(bt->out);
+    btui_screen_free(bt);
+    free(bt->outbuf);
+    if (bt != &current_bt) {
+        free(bt);
+        return;
+    }
+    btui_close_resize_pipe();
+    memset(bt, 0, sizeof(btui_t));
+}
+
+/*
+ * Parse a key from the input, given its first character `c`. Returns -1 on
+ * failure. (Helper method for btui_getkey() and btui_getkeys())
+ */
+static int btui_parse_key(btui_t *bt, int c, int *mouse_x, int *mouse_y)
+{
+    int numcode = 0, modifiers = 0;
+    if (c != '\x1b')
+        return c;
+
+    c = nextchar(bt);
+    // Actual escape key:
+    if (c < 0)
+        return KEY_ESC;
+
+    switch (c) {
+        case '\x1b': return KEY_ESC;
+        case '[': c = nextchar(bt); goto CSI_start;
+        case 'P': goto DCS;
+        case 'O': goto SS3;
+        default: return MOD_ALT | c;
+    }
+
+  CSI_start:
+    if (c == -1)
+        return MOD_ALT | '[';
+
+    switch (c) {
+        case 'A': return modifiers | KEY_ARROW_UP;
+        case 'B': return modifiers | KEY_ARROW_DOWN;
         case 'C': return modifiers | KEY_ARROW_RIGHT;
         case 'D': return modifiers | KEY_ARROW_LEFT;
         case 'F': return modifiers | KEY_END;
@@ -586,11 +4055,11 @@ int btui_getkey(btui_t *bt, int timeout, int *mouse_x, int *mouse_y)
             }
             return -1;
         case '<': { // Mouse clicks
-            int buttons = nextnum(fd, &c);
+            int buttons = nextnum(bt, &c);
             if (c != ';') return -1;
-            int x = nextnum(fd, &c);
+            int x = nextnum(bt, &c);
             if (c != ';') return -1;
-            int y = nextnum(fd, &c);
+            int y = nextnum(bt, &c);
             if (c != 'm' && c != 'M') return -1;
 
             if (mouse_x) *mouse_x = x - 1;
@@ -612,14 +4081,10 @@ int btui_getkey(btui_t *bt, int timeout, int *mouse_x, int *mouse_y)
                 default: return -1;
             }
             if (key == MOUSE_LEFT_RELEASE || key == MOUSE_RIGHT_RELEASE || key == MOUSE_MIDDLE_RELEASE) {
-                static int lastclick = -1;
-                static struct timespec lastclicktime = {0, 0};
-                struct timespec clicktime;
-                clock_gettime(CLOCK_MONOTONIC, &clicktime);
-                if (key == lastclick) {
-                    double dt_ms = 1e3*(double)(clicktime.tv_sec - lastclicktime.tv_sec)
-                        + 1e-6*(double)(clicktime.tv_nsec - lastclicktime.tv_nsec);
-                    if (dt_ms < BTUI_DOUBLECLICK_THRESHOLD) {
+                // Clicks are timed by when they arrived, not when they're parsed:
+                uint64_t clicktime = bt->intime;
+                if (key == bt->lastclick) {
+                    if (clicktime - bt->lastclicktime < UINT64_C(1000) * BTUI_DOUBLECLICK_THRESHOLD) {
                         switch (key) {
                             case MOUSE_LEFT_RELEASE: key = MOUSE_LEFT_DOUBLE; break;
                             case MOUSE_RIGHT_RELEASE: key = MOUSE_RIGHT_DOUBLE; break;
@@ -628,84 +4093,454 @@ int btui_getkey(btui_t *bt, int timeout, int *mouse_x, int *mouse_y)
                         }
                     }
                 }
-                lastclicktime = clicktime;
-                lastclick = key;
+                bt->lastclicktime = clicktime;
+                bt->lastclick = key;
+            }
+            return modifiers | key;
+        }
+        default:
+            if ('0' <= c && c <= '9') {
+                // Ps prefix
+                for (numcode = 0; '0' <= c && c <= '9'; c = nextchar(bt))
+                    numcode = 10*numcode + (c - '0') < BTUI_MAX_PARAM ? 10*numcode + (c - '0') : BTUI_MAX_PARAM;
+                if (c == ';') {
+                    modifiers = nextnum(bt, &c);
+                    modifiers = ((modifiers >> 1) << MOD_BITSHIFT) & (MOD_META | MOD_CTRL | MOD_ALT | MOD_SHIFT);
+                }
+                goto CSI_start;
+            }
+    }
+    return -1;
+
+  DCS:
+    return -1;
+
+  SS3:
+    switch (nextchar(bt)) {
+        case 'P': return KEY_F1;
+        case 'Q': return KEY_F2;
+        case 'R': return KEY_F3;
+        case 'S': return KEY_F4;
+        default: break;
+    }
+    return -1;
+}
+
+/*
+ * Get one key of input from the given file, waiting up to `timeout` tenths of a
+ * second (or forever, if negative). Returns -1 on failure.
+ * If mouse_x or mouse_y are non-null and a mouse event occurs, they will be
+ * set to the position of the mouse (0-indexed).
+ */
+int btui_getkey(btui_t *bt, int timeout, int *mouse_x, int *mouse_y)
+{
+    if (mouse_x) *mouse_x = -1;
+    if (mouse_y) *mouse_y = -1;
+    // Only the first character waits for the requested timeout:
+    int c = -1;
+    if (bt->inpos < bt->inlen || btui_read_input(bt, timeout < 0 ? -1 : 100*timeout) > 0)
+        c = (unsigned char)bt->inbuf[bt->inpos++];
+    if (c == -1 && bt->size_changed) {
+        bt->size_changed = 0;
+        bt->keytime = btui_now();
+        if (!bt->unanswered) bt->unanswered = bt->keytime;
+        return RESIZE_EVENT;
+    }
+    // A key arrived when its first byte did:
+    uint64_t time = bt->intime;
+    int key = btui_parse_key(bt, c, mouse_x, mouse_y);
+    if (key == -1) return -1;
+    BTUI_COUNT(bt, events, 1);
+    bt->keytime = time;
+    if (!bt->unanswered) bt->unanswered = time;
+    return key;
+}
+
+/*
+ * Return true if event `b` is the same kind of event as `a` and can be merged
+ * into it (mouse drags and wheel scrolls with the same buttons and modifiers).
+ */
+static int btui_can_coalesce(const btui_event_t *a, const btui_event_t *b)
+{
+    if (a->key != b->key || a->modifiers != b->modifiers) return 0;
+    switch (a->key) {
+        case MOUSE_LEFT_DRAG: case MOUSE_RIGHT_DRAG: case MOUSE_MIDDLE_DRAG:
+        case MOUSE_WHEEL_RELEASE: case MOUSE_WHEEL_PRESS:
+            return 1;
+        default: return 0;
+    }
+}
+
+/*
+ * Get all the input events that are available (up to `max` of them) and store
+ * them in `events`, waiting up to `timeout_ms` milliseconds (or forever, if
+ * negative) for the first one. Returns the number of events stored, which may
+ * be 0 if the timeout expired. If coalescing is enabled (see
+ * btui_set_coalescing()), consecutive mouse drag or wheel events are merged
+ * into a single event with the most recent position and a `count`.
+ */
+int btui_getkeys(btui_t *bt, btui_event_t *events, size_t max, int timeout_ms)
+{
+    const int modmask = MOD_META | MOD_CTRL | MOD_ALT | MOD_SHIFT;
+    size_t n = 0;
+    if (max == 0) return 0;
+    if (bt->inpos >= bt->inlen && !bt->size_changed
+        && btui_read_input(bt, timeout_ms) < 0 && !bt->size_changed)
+        return 0;
+    if (bt->size_changed) {
+        bt->size_changed = 0;
+        events[n++] = (btui_event_t){.key = RESIZE_EVENT, .x = -1, .y = -1, .count = 1, .timestamp = btui_now()};
+        if (!bt->unanswered) bt->unanswered = events[0].timestamp;
+    }
+
+    while (n < max) {
+        // Pick up any more input that has already arrived, but don't wait:
+        if (bt->inpos >= bt->inlen && btui_read_input(bt, 0) < 0)
+            break;
+        int x = -1, y = -1;
+        // An event arrived when its first byte did:
+        uint64_t time = bt->intime;
+        int key = btui_parse_key(bt, (unsigned char)bt->inbuf[bt->inpos++], &x, &y);
+        if (key == -1) continue;
+        BTUI_COUNT(bt, events, 1);
+        if (!bt->unanswered) bt->unanswered = time;
+        btui_event_t event = {.key = key & ~modmask, .modifiers = key & modmask,
+            .x = x, .y = y, .count = 1, .timestamp = time};
+        if (bt->coalesce && n > 0 && btui_can_coalesce(&events[n-1], &event)) {
+            event.count += events[n-1].count;
+            events[n-1] = event;
+        } else {
+            events[n++] = event;
+        }
+    }
+    return (int)n;
+}
+
+/*
+ * Populate `buf` with the name of a key.
+ */
+char *btui_keyname(int key, char *buf)
+{
+    if (key == -1) return buf + sprintf(buf, "<none>");
+    if (key & MOD_META) buf = stpcpy(buf, "Super-");
+    if (key & MOD_CTRL) buf = stpcpy(buf, "Ctrl-");
+    if (key & MOD_ALT) buf = stpcpy(buf, "Alt-");
+    if (key & MOD_SHIFT) buf = stpcpy(buf, "Shift-");
+    key &= ~(MOD_META | MOD_CTRL | MOD_ALT | MOD_SHIFT);
+    if (0 <= key && key <= RESIZE_EVENT && key_code_names[key])
+        return stpcpy(buf, key_code_names[key]);
+    if (' ' < key && key <= '~') {
+        *buf++ = (char)key;
+        *buf = '\0';
+        return buf;
+    } else {
+        return buf + sprintf(buf, "\\x%02X", (unsigned int)key);
+    }
+}
+
+/*
+ * Return the key with the given name, if one exists, otherwise -1.
+ * (i.e. btui_keynamed("Space") == ' ', btui_keynamed("x") == 'x', btui_keynamed("F1") == KEY_F1, btui_keynamed("???") == -1)
+ */
+int btui_keynamed(const char *name)
+{
+    int modifiers = 0;
+    static const struct { const char *prefix; int modifier; } modnames[] = {
+        {"Super-", MOD_META}, {"Ctrl-", MOD_CTRL}, {"Alt-", MOD_ALT}, {"Shift-", MOD_SHIFT}
+    };
+  check_names: {
+        int slot = key_name_slots[btui_keyname_hash(name)];
+        if (slot && strcmp(key_names[slot-1].name, name) == 0)
+            return modifiers | key_names[slot-1].key;
+    }
+    for (size_t i = 0; i < sizeof(modnames)/sizeof(modnames[0]); i++) {
+        if (strncmp(name, modnames[i].prefix, strlen(modnames[i].prefix)) == 0) {
+            modifiers |= modnames[i].modifier;
+            name += strlen(modnames[i].prefix);
+            goto check_names;
+        }
+    }
+    return strlen(name) == 1 ? name[0] : -1;
+}
+
+/*
+ * Return the given percentile (0-100) of the latencies between input being
+ * read and the next completed btui_flush(), in microseconds, accurate to
+ * within 12.5%. For example, btui_latency(bt, 99) is how long the slowest 1% of
+ * responses took. Returns 0 if nothing has been measured yet (or if BTUI was
+ * compiled with BTUI_NO_STATS).
+ */
+uint64_t btui_latency(btui_t *bt, double percentile)
+{
+    const btui_latency_t *h = &bt->latency;
+    if (h->count == 0) return 0;
+    double rank = percentile / 100.0 * (double)h->count;
+    uint64_t seen = 0;
+    for (int i = 0; i < BTUI_LATENCY_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen > 0 && (double)seen >= rank) {
+            uint64_t upper = btui_latency_floor(i + 1) - 1;
+            return upper < h->max ? upper : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * Pass on the key, mouse and resize events from a BTUI to a callback whenever
+ * they arrive in btui_loop_run(). The BTUI has to be removed from the loop
+ * with btui_loop_remove_btui() before it's disabled. Returns 0 on success and
+ * -1 on failure.
+ */
+int btui_loop_add_btui(btui_loop_t *loop, btui_t *bt, btui_key_callback_t callback, void *data)
+{
+    if (!bt->in || !callback) return -1;
+    int fd = fileno(bt->in);
+    if (btui_loop_find(loop, fd)) return -1;
+    btui_watch_t *w = btui_loop_watch(loop, fd, BTUI_LOOP_READ);
+    if (!w) return -1;
+    w->bt = bt, w->key_callback = callback, w->data = data;
+    // Resizes of the controlling terminal come through the signal handler's
+    // pipe:
+    if (bt->controlling && resize_pipe[0] >= 0 && !btui_loop_find(loop, resize_pipe[0])) {
+        btui_watch_t *resize = btui_loop_watch(loop, resize_pipe[0], BTUI_LOOP_READ);
+        if (!resize) {
+            btui_loop_unwatch(loop, w);
+            return -1;
+        }
+        resize->bt = bt, resize->key_callback = callback, resize->data = data;
+    }
+    return 0;
+}
+
+/*
+ * Call `callback` whenever the file descriptor is ready for any of the given
+ * events (BTUI_LOOP_READ and/or BTUI_LOOP_WRITE) in btui_loop_run(). Adding a
+ * file descriptor that's already in the loop replaces its events, callback
+ * and data. Returns 0 on success and -1 on failure.
+ */
+int btui_loop_add_fd(btui_loop_t *loop, int fd, int events, btui_fd_callback_t callback, void *data)
+{
+    if (!callback || !(events & (BTUI_LOOP_READ | BTUI_LOOP_WRITE))) return -1;
+    btui_watch_t *w = btui_loop_find(loop, fd);
+    if (w) {
+        if (w->bt) return -1;
+#ifdef BTUI_EPOLL
+        struct epoll_event ev = {
+            .events = ((events & BTUI_LOOP_READ) ? EPOLLIN : 0u) | ((events & BTUI_LOOP_WRITE) ? EPOLLOUT : 0u),
+            .data.ptr = w,
+        };
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev)) return -1;
+#endif
+        w->events = events;
+    } else if (!(w = btui_loop_watch(loop, fd, events))) {
+        return -1;
+    }
+    w->fd_callback = callback, w->data = data;
+    return 0;
+}
+
+/*
+ * Call `callback` after `delay_ms` milliseconds, and then every `interval_ms`
+ * milliseconds if that's positive, until the timer is cancelled. If a
+ * repeating timer falls behind, the missed intervals are skipped. One-shot
+ * timers are freed after their callback, and repeating timers when they're
+ * cancelled. Returns NULL on failure.
+ */
+btui_timer_t *btui_loop_add_timer(btui_loop_t *loop, int delay_ms, int interval_ms,
+                                  btui_timer_callback_t callback, void *data)
+{
+    if (!callback) return NULL;
+    btui_timer_t *t = calloc(1, sizeof(btui_timer_t));
+    if (!t) return NULL;
+    uint64_t now = btui_now();
+    if (loop->ntimers == 0 && now / 1000 > loop->tick) loop->tick = now / 1000;
+    // Rounded up to the next tick, so the timer never goes off early:
+    t->expires = (now + 999) / 1000 + (delay_ms > 0 ? (uint64_t)delay_ms : 0);
+    if (t->expires <= loop->tick) t->expires = loop->tick + 1;
+    t->interval = interval_ms > 0 ? (uint64_t)interval_ms : 0;
+    t->callback = callback, t->data = data;
+    btui_wheel_insert(loop, t);
+    ++loop->ntimers;
+    return t;
+}
+
+/*
+ * Cancel a timer (which is safe to do from its own callback) and free it.
+ */
+void btui_loop_cancel_timer(btui_loop_t *loop, btui_timer_t *timer)
+{
+    if (!timer) return;
+    if (timer == loop->firing) {
+        timer->cancelled = 1;
+        return;
+    }
+    btui_wheel_remove(loop, timer);
+    free(timer);
+    --loop->ntimers;
+}
+
+/*
+ * Create an event loop, which waits on BTUIs, file descriptors and timers
+ * all at once (with epoll on Linux, and poll() elsewhere) and calls back when
+ * any of them are ready, so a program that's idle uses no CPU at all. Returns
+ * NULL on failure.
+ */
+btui_loop_t *btui_loop_create(void)
+{
+    btui_loop_t *loop = calloc(1, sizeof(btui_loop_t));
+    if (!loop) return NULL;
+#ifdef BTUI_EPOLL
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        free(loop);
+        return NULL;
+    }
+#endif
+    loop->tick = btui_now() / 1000;
+    return loop;
+}
+
+/*
+ * Free an event loop along with any timers that are still pending. The file
+ * descriptors and BTUIs in it are left open.
+ */
+void btui_loop_free(btui_loop_t *loop)
+{
+    if (!loop) return;
+    for (int level = 0; level < BTUI_WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < BTUI_WHEEL_SLOTS; slot++) {
+            for (struct btui_timer_s *t = loop->wheel[level][slot], *next; t; t = next) {
+                next = t->next;
+                free(t);
             }
-            return modifiers | key;
         }
-        default:
-            if ('0' <= c && c <= '9') {
-                // Ps prefix
-                for (numcode = 0; '0' <= c && c <= '9'; c = nextchar(fd))
-                    numcode = 10*numcode + (c - '0');
-                if (c == ';') {
-                    modifiers = nextnum(fd, &c);
-                    modifiers = (modifiers >> 1) << MOD_BITSHIFT;
-                }
-                goto CSI_start;
-            }
     }
-    return -1;
-
-  DCS:
-    return -1;
+    for (size_t i = 0; i < loop->nwatches; i++)
+        free(loop->watches[i]);
+    free(loop->watches);
+#ifdef BTUI_EPOLL
+    close(loop->epoll_fd);
+#else
+    free(loop->pollfds);
+#endif
+    free(loop);
+}
 
-  SS3:
-    switch (nextchar(fd)) {
-        case 'P': return KEY_F1;
-        case 'Q': return KEY_F2;
-        case 'R': return KEY_F3;
-        case 'S': return KEY_F4;
-        default: break;
+/*
+ * Stop passing on a BTUI's events. Returns 0 on success and -1 if the BTUI
+ * wasn't in the loop.
+ */
+int btui_loop_remove_btui(btui_loop_t *loop, btui_t *bt)
+{
+    int found = 0;
+    for (size_t i = 0; i < loop->nwatches; i++) {
+        if (loop->watches[i]->bt == bt && !loop->watches[i]->removed) {
+            btui_loop_unwatch(loop, loop->watches[i]);
+            found = 1;
+        }
     }
-    return -1;
+    return found ? 0 : -1;
 }
 
 /*
- * Populate `buf` with the name of a key.
+ * Stop waiting on a file descriptor (which should be done before closing it).
+ * Returns 0 on success and -1 if it wasn't in the loop.
  */
-char *btui_keyname(int key, char *buf)
+int btui_loop_remove_fd(btui_loop_t *loop, int fd)
 {
-    if (key == -1) return buf + sprintf(buf, "<none>");
-    if (key & MOD_META) buf = stpcpy(buf, "Super-");
-    if (key & MOD_CTRL) buf = stpcpy(buf, "Ctrl-");
-    if (key & MOD_ALT) buf = stpcpy(buf, "Alt-");
-    if (key & MOD_SHIFT) buf = stpcpy(buf, "Shift-");
-    key &= ~(MOD_META | MOD_CTRL | MOD_ALT | MOD_SHIFT);
-    for (size_t i = 0; i < sizeof(key_names)/sizeof(key_names[0]); i++) {
-        if (key_names[i].key == key) {
-            return stpcpy(buf, key_names[i].name);
+    btui_watch_t *w = btui_loop_find(loop, fd);
+    if (!w || w->bt) return -1;
+    btui_loop_unwatch(loop, w);
+    return 0;
+}
+
+/*
+ * Run the event loop until btui_loop_stop() is called or there's nothing left
+ * to wait on. Returns 0 when it's done and -1 on failure.
+ */
+int btui_loop_run(btui_loop_t *loop)
+{
+    loop->running = 1;
+    while (loop->running && (loop->active > 0 || loop->ntimers > 0)) {
+        if (btui_loop_run_once(loop, -1)) {
+            loop->running = 0;
+            return -1;
         }
     }
-    if (' ' < key && key <= '~')
-        return buf + sprintf(buf, "%c", key);
-    else
-        return buf + sprintf(buf, "\\x%02X", (unsigned int)key);
+    loop->running = 0;
+    return 0;
 }
 
 /*
- * Return the key with the given name, if one exists, otherwise -1.
- * (i.e. btui_keynamed("Space") == ' ', btui_keynamed("x") == 'x', btui_keynamed("F1") == KEY_F1, btui_keynamed("???") == -1)
+ * Wait until something in the event loop is ready, or the next timer is due,
+ * or `timeout_ms` milliseconds have passed (forever if it's negative), and
+ * run the callbacks for everything that's ready. Returns 0 on success and -1
+ * on failure.
  */
-int btui_keynamed(const char *name)
+int btui_loop_run_once(btui_loop_t *loop, int timeout_ms)
 {
-    int modifiers = 0;
-    static const struct { const char *prefix; int modifier; } modnames[] = {
-        {"Super-", MOD_META}, {"Ctrl-", MOD_CTRL}, {"Alt-", MOD_ALT}, {"Shift-", MOD_SHIFT}
-    };
-  check_names:
-    for (size_t i = 0; i < sizeof(key_names)/sizeof(key_names[0]); i++) {
-        if (strcmp(key_names[i].name, name) == 0)
-            return modifiers | key_names[i].key;
+    if (btui_loop_pending(loop)) timeout_ms = 0;
+    uint64_t next = btui_wheel_next(loop);
+    if (next != UINT64_MAX && timeout_ms != 0) {
+        // Round up, so timers never wake up early and have to wait again:
+        uint64_t now = btui_now(), wait = next * 1000 > now ? (next * 1000 - now + 999) / 1000 : 0;
+        if (wait > (1u << 30)) wait = 1u << 30;
+        if (timeout_ms < 0 || wait < (uint64_t)timeout_ms) timeout_ms = (int)wait;
     }
-    for (size_t i = 0; i < sizeof(modnames)/sizeof(modnames[0]); i++) {
-        if (strncmp(name, modnames[i].prefix, strlen(modnames[i].prefix)) == 0) {
-            modifiers |= modnames[i].modifier;
-            name += strlen(modnames[i].prefix);
-            goto check_names;
-        }
+
+#ifdef BTUI_EPOLL
+    struct epoll_event ready[64];
+    int n = epoll_wait(loop->epoll_fd, ready, sizeof(ready)/sizeof(ready[0]), timeout_ms);
+    if (n < 0 && errno != EINTR) return -1;
+    for (int i = 0; i < n; i++) {
+        uint32_t e = ready[i].events;
+        btui_loop_dispatch(loop, ready[i].data.ptr, ((e & (EPOLLIN | EPOLLHUP | EPOLLERR)) ? BTUI_LOOP_READ : 0)
+                           | ((e & EPOLLOUT) ? BTUI_LOOP_WRITE : 0));
     }
-    return strlen(name) == 1 ? name[0] : -1;
+#else
+    size_t nfds = loop->nwatches;
+    for (size_t i = 0; i < nfds; i++) {
+        btui_watch_t *w = loop->watches[i];
+        loop->pollfds[i].fd = w->removed ? -1 : w->fd;
+        loop->pollfds[i].events = (short)(((w->events & BTUI_LOOP_READ) ? POLLIN : 0)
+                                          | ((w->events & BTUI_LOOP_WRITE) ? POLLOUT : 0));
+        loop->pollfds[i].revents = 0;
+    }
+    int n = poll(loop->pollfds, (nfds_t)nfds, timeout_ms);
+    if (n < 0 && errno != EINTR) return -1;
+    for (size_t i = 0; n > 0 && i < nfds; i++) {
+        short e = loop->pollfds[i].revents;
+        if (!e) continue;
+        btui_loop_dispatch(loop, loop->watches[i], ((e & (POLLIN | POLLHUP | POLLERR)) ? BTUI_LOOP_READ : 0)
+                           | ((e & POLLOUT) ? BTUI_LOOP_WRITE : 0));
+    }
+#endif
+
+    btui_wheel_advance(loop, btui_now() / 1000);
+
+    // Input that was read along with earlier events, and resizes:
+    for (size_t i = 0; i < loop->nwatches; i++) {
+        btui_watch_t *w = loop->watches[i];
+        if (w->bt && !w->removed && (w->bt->inpos < w->bt->inlen || w->bt->size_changed))
+            btui_loop_dispatch(loop, w, BTUI_LOOP_READ);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < loop->nwatches; i++) {
+        if (loop->watches[i]->removed) free(loop->watches[i]);
+        else loop->watches[kept++] = loop->watches[i];
+    }
+    loop->nwatches = kept;
+    return 0;
+}
+
+/*
+ * Make btui_loop_run() return once the current callback is done.
+ */
+void btui_loop_stop(btui_loop_t *loop)
+{
+    loop->running = 0;
 }
 
 /*
@@ -713,7 +4548,29 @@ int btui_keynamed(const char *name)
  */
 int btui_move_cursor(btui_t *bt, int x, int y)
 {
-    return fprintf(bt->out, "\033[%d;%dH", y+1, x+1);
+    if (bt->retained) {
+        bt->screen.x = x;
+        bt->screen.y = y;
+        return 0;
+    }
+    return btui_emit_move(bt, x, y);
+}
+
+/*
+ * Try to write output that the terminal couldn't take yet (in non-blocking
+ * mode) and return how many bytes are still waiting to be written, including
+ * any the writer thread hasn't written yet.
+ */
+int btui_output_pending(btui_t *bt)
+{
+    if (bt->pending > 0)
+        btui_flush_output_nonblocking(bt);
+    size_t pending = bt->pending;
+#ifndef BTUI_NO_THREADS
+    if (bt->writer)
+        pending += bt->writer->head - __atomic_load_n(&bt->writer->tail, __ATOMIC_ACQUIRE);
+#endif
+    return (int)pending;
 }
 
 /*
@@ -721,7 +4578,32 @@ int btui_move_cursor(btui_t *bt, int x, int y)
  */
 int btui_hide_cursor(btui_t *bt)
 {
-    return fputs(T_OFF(T_SHOW_CURSOR), bt->out);
+    return btui_out_literal(bt, T_OFF(T_SHOW_CURSOR));
+}
+
+/*
+ * Output a formatted string to the terminal.
+ */
+int btui_printf(btui_t *bt, const char *fmt, ...)
+{
+    char buf[256];
+    va_list args, args2;
+    va_start(args, fmt);
+    va_copy(args2, args);
+    int printed = vsnprintf(buf, sizeof(buf), fmt, args);
+    if (printed >= (int)sizeof(buf)) {
+        char *big = malloc((size_t)printed + 1);
+        if (big) {
+            vsnprintf(big, (size_t)printed + 1, fmt, args2);
+            btui_write(bt, big, (size_t)printed);
+            free(big);
+        }
+    } else if (printed > 0) {
+        btui_write(bt, buf, (size_t)printed);
+    }
+    va_end(args2);
+    va_end(args);
+    return printed;
 }
 
 /*
@@ -729,8 +4611,7 @@ int btui_hide_cursor(btui_t *bt)
  */
 int btui_puts(btui_t *bt, const char *s)
 {
-    int ret = fputs(s, bt->out);
-    return ret;
+    return btui_write(bt, s, strlen(s));
 }
 
 /*
@@ -739,14 +4620,11 @@ int btui_puts(btui_t *bt, const char *s)
  */
 int btui_scroll(btui_t *bt, int firstline, int lastline, int scroll_amount)
 {
-    if (scroll_amount > 0) {
-        return fprintf(bt->out, "\033[%d;%dr\033[%dS\033[r",
-                       firstline+1, lastline+1, scroll_amount);
-    } else if (scroll_amount < 0) {
-        return fprintf(bt->out, "\033[%d;%dr\033[%dT\033[r",
-                       firstline+1, lastline+1, -scroll_amount);
+    if (bt->retained) {
+        btui_screen_scroll(bt, firstline, lastline, scroll_amount);
+        return 0;
     }
-    return 0;
+    return btui_emit_scroll(bt, firstline, lastline, scroll_amount);
 }
 
 /*
@@ -754,18 +4632,25 @@ int btui_scroll(btui_t *bt, int firstline, int lastline, int scroll_amount)
  */
 int btui_set_attributes(btui_t *bt, attr_t attrs)
 {
-    int printed = fputs("\033[", bt->out);
-    for (int i = 0; i < 64; i++) {
-        if (attrs & (1ul << i)) {
-            attrs ^= (1ul << i);
-            if (attrs)
-                printed += fprintf(bt->out, "%d;", i);
-            else
-                printed += fprintf(bt->out, "%d", i);
-        }
+    if (bt->retained) {
+        btui_pen_apply(&bt->screen.pen, attrs);
+        return 0;
     }
-    printed += fputs("m", bt->out);
-    return printed;
+    if ((bt->pen.attrs & BTUI_NORMAL) && !(attrs & BTUI_NORMAL)) {
+        // The terminal's state is unknown, so the attributes can only be
+        // passed along as-is:
+        char params[256];
+        return btui_emit_sgr(bt, params, btui_enc_codes(params, attrs));
+    }
+    // Codes for things like alternative fonts aren't tracked by btui_pen_t:
+    attr_t untracked = attrs & ~(0x3FEul | (3ul << 20) | (7ul << 51) | (0xFFul << 30) | (0xFFul << 40)
+                                 | BTUI_NORMAL | BTUI_NO_BOLD_OR_FAINT | BTUI_NO_ITALIC_OR_FRAKTUR
+                                 | BTUI_NO_UNDERLINE | BTUI_NO_BLINK | BTUI_NO_REVERSE | BTUI_NO_CONCEAL
+                                 | BTUI_NO_STRIKETHROUGH | BTUI_FG_NORMAL | BTUI_BG_NORMAL
+                                 | BTUI_NO_FRAMED_OR_ENCIRCLED | BTUI_NO_OVERLINED);
+    btui_pen_t pen = bt->pen;
+    btui_pen_apply(&pen, attrs);
+    return btui_emit_pen(bt, &pen, untracked);
 }
 
 /*
@@ -773,7 +4658,7 @@ int btui_set_attributes(btui_t *bt, attr_t attrs)
  */
 int btui_set_bg(btui_t *bt, unsigned char r, unsigned char g, unsigned char b)
 {
-    return fprintf(bt->out, "\033[48;2;%d;%d;%dm", r, g, b);
+    return btui_set_rgb(bt, 40, ((uint32_t)r << 16) | ((uint32_t)g << 8) | b);
 }
 
 /*
@@ -781,8 +4666,49 @@ int btui_set_bg(btui_t *bt, unsigned char r, unsigned char g, unsigned char b)
  */
 int btui_set_bg_hex(btui_t *bt, int hex)
 {
-    return fprintf(bt->out, "\033[48;2;%d;%d;%dm",
-                   (hex >> 16) & 0xFF, (hex >> 8) & 0xFF, hex & 0xFF);
+    return btui_set_rgb(bt, 40, (uint32_t)hex);
+}
+
+/*
+ * Set which optional escape sequences (BTUI_CAP_ECH, BTUI_CAP_REP and
+ * BTUI_CAP_RECT) btui_fill_box(), btui_draw_linebox(), btui_draw_shadow() and
+ * retained mode flushes may use to output fewer bytes. BTUI_CAP_AUTO guesses
+ * based on the TERM, XTERM_VERSION and VTE_VERSION environment variables.
+ * Returns 0 on success.
+ */
+int btui_set_capabilities(btui_t *bt, int capabilities)
+{
+    if (capabilities == BTUI_CAP_AUTO)
+        capabilities = btui_detect_capabilities();
+    bt->capabilities = capabilities;
+    return 0;
+}
+
+/*
+ * Enable or disable merging consecutive mouse drag events (and consecutive
+ * mouse wheel events) into one event in btui_getkeys(). Returns 0 on success.
+ */
+int btui_set_coalescing(btui_t *bt, int coalesce)
+{
+    bt->coalesce = coalesce;
+    return 0;
+}
+
+/*
+ * Set how many colors the terminal supports. RGB colors from btui_set_fg(),
+ * btui_set_bg() and friends will be converted to the nearest color in the 256
+ * or 16 color palette if the terminal doesn't support truecolor.
+ * BTUI_COLORS_AUTO guesses based on the COLORTERM and TERM environment
+ * variables. Returns 0 on success.
+ */
+int btui_set_color_depth(btui_t *bt, btui_color_depth_t depth)
+{
+    if (depth == BTUI_COLORS_AUTO)
+        depth = btui_detect_color_depth();
+    if (depth != BTUI_COLORS_TRUECOLOR)
+        btui_init_color_tables();
+    bt->color_depth = depth;
+    return 0;
 }
 
 /*
@@ -790,7 +4716,14 @@ int btui_set_bg_hex(btui_t *bt, int hex)
  */
 int btui_set_cursor(btui_t *bt, cursor_t cur)
 {
-    return fprintf(bt->out, "\033[%u q", cur);
+    char *p = btui_reserve(bt, 8);
+    if (!p) return 0;
+    *p++ = '\033';
+    *p++ = '[';
+    p = btui_enc_u8(p, (unsigned int)cur);
+    *p++ = ' ';
+    *p++ = 'q';
+    return btui_commit(bt, p);
 }
 
 /*
@@ -798,7 +4731,7 @@ int btui_set_cursor(btui_t *bt, cursor_t cur)
  */
 int btui_set_fg(btui_t *bt, unsigned char r, unsigned char g, unsigned char b)
 {
-    return fprintf(bt->out, "\033[38;2;%d;%d;%dm", r, g, b);
+    return btui_set_rgb(bt, 30, ((uint32_t)r << 16) | ((uint32_t)g << 8) | b);
 }
 
 /*
@@ -806,8 +4739,183 @@ int btui_set_fg(btui_t *bt, unsigned char r, unsigned char g, unsigned char b)
  */
 int btui_set_fg_hex(btui_t *bt, int hex)
 {
-    return fprintf(bt->out, "\033[38;2;%d;%d;%dm",
-                   (hex >> 16) & 0xFF, (hex >> 8) & 0xFF, hex & 0xFF);
+    return btui_set_rgb(bt, 30, (uint32_t)hex);
+}
+
+/*
+ * Limit how many frames per second btui_frame_begin() will allow (0 for no
+ * limit). Returns 0 on success.
+ */
+int btui_set_fps(btui_t *bt, int fps)
+{
+    bt->fps = fps > 0 ? fps : 0;
+    return 0;
+}
+
+/*
+ * Enable or disable the performance overlay: a box in the top right corner
+ * that btui_flush() draws on top of each frame, showing the time between
+ * frames, frames per second, bytes and write() calls per frame, how much input
+ * is waiting, and what the overlay itself took to draw (which isn't counted in
+ * the rest). The measurements are also kept in `bt->hud`. It can be turned on
+ * for any program by setting the BTUI_HUD environment variable. In retained
+ * mode, what was under the overlay comes back when it's disabled, otherwise
+ * the program has to redraw it. Returns 0 on success, or -1 on failure or if
+ * BTUI was compiled with BTUI_NO_STATS.
+ */
+int btui_set_hud(btui_t *bt, int enabled)
+{
+#ifdef BTUI_NO_STATS
+    // There's nothing to measure with, so it's always off:
+    bt->hud = NULL;
+    return enabled ? -1 : 0;
+#else
+    if (enabled && !bt->hud) {
+        bt->hud = calloc(1, sizeof(btui_hud_t));
+        if (!bt->hud) return -1;
+        bt->hud->x = bt->hud->y = -1;
+    } else if (!enabled && bt->hud) {
+        free(bt->hud);
+        bt->hud = NULL;
+    }
+    return 0;
+#endif
+}
+
+/*
+ * Enable or disable non-blocking output. When enabled, btui_flush() writes
+ * only what the terminal will take without waiting and keeps the rest for
+ * later, so a slow connection never stalls the program. Returns 0 on success.
+ */
+int btui_set_nonblocking(btui_t *bt, int nonblocking)
+{
+    if (bt->vt) {
+        bt->nonblocking = nonblocking;
+        return 0;
+    }
+    int fd = fileno(bt->out), flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || fcntl(fd, F_SETFL, nonblocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK)) == -1)
+        return -1;
+    bt->nonblocking = nonblocking;
+    // Anything left over has to be written before going back to blocking:
+    return nonblocking ? 0 : btui_flush_output(bt);
+}
+
+/*
+ * Enable or disable retained mode. In retained mode, the drawing functions
+ * draw into an off-screen buffer instead of writing to the terminal, and
+ * btui_flush() only outputs the cells that have changed since the last flush.
+ * Returns 0 on success and -1 on failure.
+ */
+int btui_set_retained(btui_t *bt, int retained)
+{
+    if (!retained) {
+        if (bt->retained) {
+            btui_flush(bt);
+            btui_screen_free(bt);
+            bt->retained = 0;
+        }
+        return 0;
+    }
+    if (bt->retained) return 0;
+    if (btui_screen_resize(bt)) return -1;
+    bt->retained = 1;
+    return 0;
+}
+
+/*
+ * Set the size of the terminal, for a BTUI from btui_create_fd() whose
+ * terminal can't report its own size (e.g. when a remote client says its
+ * window changed). If the size is different, the next btui_getkey() or
+ * btui_getkeys() returns a RESIZE_EVENT. Returns 0 on success.
+ */
+int btui_set_size(btui_t *bt, int width, int height)
+{
+    if (width <= 0 || height <= 0) return -1;
+    if (width == bt->width && height == bt->height) return 0;
+    bt->width = width, bt->height = height;
+    bt->size_changed = 1;
+    bt->cursor_x = bt->cursor_y = -1;
+    if (bt->trace) {
+        char size[32];
+        btui_trace_record(bt->trace, 'r', size, (size_t)sprintf(size, "%dx%d", width, height));
+    }
+    return 0;
+}
+
+/*
+ * Enable or disable synchronized output. When enabled, each flush is wrapped
+ * in DEC synchronized update mode (2026), so terminals that support it will
+ * hold off on drawing until the whole frame has arrived. Terminals that don't
+ * support it will ignore it. Returns 0 on success.
+ */
+int btui_set_synchronized(btui_t *bt, int synchronized)
+{
+    if (btui_flush_output(bt)) return -1;
+    bt->synchronized = synchronized;
+    return 0;
+}
+
+/*
+ * Enable or disable tracing. While tracing, every chunk of output written to
+ * the terminal and every chunk of input read from it is recorded with a
+ * timestamp in a ring of BTUI_TRACE_BUFSIZE bytes (so only the most recent
+ * part of a long session is kept), which can be saved with btui_trace_dump().
+ * Tracing can also be turned on by setting the BTUI_TRACE environment variable
+ * to a filename, and the trace is then saved there when BTUI is disabled.
+ * Returns 0 on success.
+ */
+int btui_set_trace(btui_t *bt, int enabled)
+{
+    if (enabled && !bt->trace) {
+        btui_trace_t *t = calloc(1, sizeof(btui_trace_t));
+        if (!t || !(t->buf = malloc(BTUI_TRACE_BUFSIZE))) {
+            free(t);
+            return -1;
+        }
+        t->size = BTUI_TRACE_BUFSIZE;
+        t->start = btui_now();
+        t->started = time(NULL);
+        t->width = bt->width;
+        t->height = bt->height;
+        bt->trace = t;
+    } else if (!enabled && bt->trace) {
+        free(bt->trace->buf);
+        free(bt->trace->path);
+        free(bt->trace);
+        bt->trace = NULL;
+    }
+    return 0;
+}
+
+/*
+ * Enable or disable the writer thread. When enabled, btui_flush() hands the
+ * output off to a background thread that writes it to the terminal, so drawing
+ * can carry on while the terminal is busy. Up to BTUI_WRITER_BUFSIZE bytes can
+ * be waiting to be written, and past that btui_flush() waits for room (or, in
+ * non-blocking mode, keeps the rest for later). Disabling it waits until
+ * everything has been written. Returns 0 on success, or -1 if the thread
+ * couldn't be started (or BTUI was compiled with BTUI_NO_THREADS).
+ */
+int btui_set_writer_thread(btui_t *bt, int enabled)
+{
+#ifdef BTUI_NO_THREADS
+    // Output is always written directly:
+    bt->writer = NULL;
+    return enabled ? -1 : 0;
+#else
+    if (enabled && !bt->writer) {
+        if (bt->vt) return -1;
+        bt->writer = btui_writer_start(fileno(bt->out));
+        if (!bt->writer) return -1;
+    } else if (!enabled && bt->writer) {
+        uint64_t writes = btui_writer_stop(bt->writer);
+        BTUI_COUNT(bt, writes, writes);
+        (void)writes;
+        bt->writer = NULL;
+    }
+    return 0;
+#endif
 }
 
 /*
@@ -815,19 +4923,342 @@ int btui_set_fg_hex(btui_t *bt, int hex)
  */
 int btui_show_cursor(btui_t *bt)
 {
-    return fputs(T_ON(T_SHOW_CURSOR), bt->out);
+    return btui_out_literal(bt, T_ON(T_SHOW_CURSOR));
+}
+
+/*
+ * Copy the runtime counters (how much output was written, how many escape
+ * sequences of each kind, how much input was read, etc.) into `stats`. Returns
+ * 0 on success, or -1 if BTUI was compiled with BTUI_NO_STATS.
+ */
+int btui_stats(btui_t *bt, btui_stats_t *stats)
+{
+#ifdef BTUI_NO_STATS
+    (void)bt;
+    memset(stats, 0, sizeof(btui_stats_t));
+    return -1;
+#else
+    *stats = bt->stats;
+#ifndef BTUI_NO_THREADS
+    if (bt->writer)
+        stats->writes += __atomic_load_n(&bt->writer->writes, __ATOMIC_RELAXED);
+#endif
+    return 0;
+#endif
+}
+
+/*
+ * Reset the runtime counters and the latency histogram to zero. Returns 0 on
+ * success, or -1 if BTUI was compiled with BTUI_NO_STATS.
+ */
+int btui_stats_reset(btui_t *bt)
+{
+    memset(&bt->stats, 0, sizeof(btui_stats_t));
+    memset(&bt->latency, 0, sizeof(btui_latency_t));
+#ifdef BTUI_NO_STATS
+    return -1;
+#else
+#ifndef BTUI_NO_THREADS
+    if (bt->writer)
+        __atomic_store_n(&bt->writer->writes, 0, __ATOMIC_RELAXED);
+#endif
+    return 0;
+#endif
+}
+
+/*
+ * Return the number of columns that the first `len` bytes of a UTF-8 string
+ * take up in the terminal. Control characters count as 0 columns, and so do
+ * combining characters. Wide characters (like CJK ideographs) count as 2.
+ * Printable ASCII text is measured 16-32 bytes at a time.
+ */
+int btui_strnwidth(const char *str, size_t len)
+{
+    const unsigned char *p = (const unsigned char*)str, *end = p + len;
+    size_t width = 0;
+    while (p < end) {
+#if defined(__AVX2__)
+        while (end - p >= 32) {
+            __m256i chunk = _mm256_loadu_si256((const void*)p);
+            // Signed comparisons, so bytes >= 0x80 are not > 0x1F:
+            uint32_t printable = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+                _mm256_cmpgt_epi8(chunk, _mm256_set1_epi8(0x1F)),
+                _mm256_cmpgt_epi8(_mm256_set1_epi8(0x7F), chunk)));
+            if (printable != 0xFFFFFFFFu) {
+                int n = __builtin_ctz(~printable);
+                width += (size_t)n;
+                p += n;
+                break;
+            }
+            width += 32;
+            p += 32;
+        }
+#elif defined(__SSE2__)
+        while (end - p >= 16) {
+            __m128i chunk = _mm_loadu_si128((const void*)p);
+            // Signed comparisons, so bytes >= 0x80 are not > 0x1F:
+            uint32_t printable = (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+                _mm_cmpgt_epi8(chunk, _mm_set1_epi8(0x1F)),
+                _mm_cmpgt_epi8(_mm_set1_epi8(0x7F), chunk)));
+            if (printable != 0xFFFFu) {
+                int n = __builtin_ctz(~printable);
+                width += (size_t)n;
+                p += n;
+                break;
+            }
+            width += 16;
+            p += 16;
+        }
+#endif
+        if (p >= end) break;
+        if (*p < 0x80) {
+            width += (*p >= 0x20 && *p != 0x7F);
+            ++p;
+        } else {
+            uint32_t codepoint;
+            p += btui_utf8_decode(p, end, &codepoint);
+            width += (size_t)btui_codepoint_width(codepoint);
+        }
+    }
+    return (int)width;
+}
+
+/*
+ * Return the number of columns that a UTF-8 string takes up in the terminal
+ * (see btui_strnwidth()).
+ */
+int btui_strwidth(const char *str)
+{
+    return btui_strnwidth(str, strlen(str));
 }
 
 /*
  * Suspend the current application. This will leave TUI mode and typically drop
  * to the console. Normally, this would be caused by Ctrl-z, but BTUI
- * intercepts Ctrl-z and requires you to handle it manually.
+ * intercepts Ctrl-z and requires you to handle it manually. Only the terminal
+ * from btui_create() can be suspended (otherwise, this returns -1).
  */
 int btui_suspend(btui_t *bt)
 {
-    (void)bt;
+    if (bt != &current_bt) return -1;
     return kill(getpid(), SIGTSTP);
 }
 
+/*
+ * Save what has been traced so far (see btui_set_trace()) to a file in
+ * asciicast v2 format, which can be played back with `asciinema play` or
+ * replayed through a headless BTUI with bench/replay. Returns 0 on success.
+ */
+int btui_trace_dump(btui_t *bt, const char *path)
+{
+    btui_trace_t *t = bt->trace;
+    if (!t) return -1;
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+    fprintf(f, "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %ld}\n",
+            t->width, t->height, (long)t->started);
+    unsigned char *data = NULL;
+    unsigned char carry[3][4];
+    int carry_len[3] = {0, 0, 0};
+    for (size_t pos = t->tail; pos < t->head; ) {
+        btui_trace_record_t record;
+        btui_trace_get(t, pos, &record, sizeof(record));
+        pos += sizeof(record);
+        unsigned char *buf = realloc(data, record.len + 4);
+        if (!buf) break;
+        data = buf;
+        // Anything left over from the last chunk of the same kind goes first:
+        int k = record.kind == 'o' ? 0 : (record.kind == 'i' ? 1 : 2);
+        memcpy(data, carry[k], (size_t)carry_len[k]);
+        btui_trace_get(t, pos, &data[carry_len[k]], record.len);
+        pos += record.len;
+        size_t len = (size_t)carry_len[k] + record.len;
+        carry_len[k] = 0;
+        fprintf(f, "[%.6f, \"%c\", ", (double)record.time / 1e6, record.kind);
+        btui_trace_write_string(f, data, data + len, carry[k], &carry_len[k]);
+        fputs("]\n", f);
+    }
+    free(data);
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/*
+ * Create a virtual terminal of the given size. Returns NULL on failure.
+ */
+btui_vt_t *btui_vt_create(int width, int height)
+{
+    if (width <= 0 || height <= 0) return NULL;
+    btui_vt_t *vt = calloc(1, sizeof(btui_vt_t));
+    if (!vt) return NULL;
+    vt->cells = calloc((size_t)width * (size_t)height, sizeof(btui_cell_t));
+    if (!vt->cells) {
+        free(vt);
+        return NULL;
+    }
+    vt->width = width;
+    vt->height = height;
+    vt->input_fd = -1;
+    btui_vt_esc(vt, 'c');
+    return vt;
+}
+
+/*
+ * Feed output to a virtual terminal, updating its cells, cursor, and pen the
+ * same way a real terminal would.
+ */
+void btui_vt_feed(btui_vt_t *vt, const char *buf, size_t len)
+{
+    vt->bytes += len;
+    ++vt->writes;
+    for (const unsigned char *p = (const unsigned char*)buf, *end = p + len; p < end; p++) {
+        unsigned char c = *p;
+        switch (vt->state) {
+            case VT_GROUND:
+                if (vt->utf8_need > 0) {
+                    if ((c & 0xC0) == 0x80) {
+                        vt->utf8[vt->utf8_len++] = c;
+                        if (vt->utf8_len < vt->utf8_need) continue;
+                        uint32_t codepoint, glyph = 0;
+                        btui_utf8_decode(vt->utf8, vt->utf8 + vt->utf8_len, &codepoint);
+                        for (int i = 0; i < vt->utf8_len; i++)
+                            glyph |= (uint32_t)vt->utf8[i] << (8*i);
+                        vt->utf8_need = 0;
+                        btui_vt_print(vt, glyph, btui_codepoint_width(codepoint));
+                        continue;
+                    }
+                    vt->utf8_need = 0;
+                }
+                if (c == '\033') {
+                    vt->state = VT_ESC;
+                } else if (c < ' ' || c == 0x7F) {
+                    btui_vt_control(vt, c);
+                } else if (c >= 0xC0 && c < 0xF8) {
+                    vt->utf8[0] = c;
+                    vt->utf8_len = 1;
+                    vt->utf8_need = c >= 0xF0 ? 4 : (c >= 0xE0 ? 3 : 2);
+                } else if (c >= 0x80) {
+                    btui_vt_print(vt, 0xBDBFEF, 1); // U+FFFD
+                } else if (vt->line_drawing && '_' <= c && c <= '~') {
+                    const char *utf8 = dec_line_drawing[c - '_'];
+                    uint32_t glyph = 0;
+                    for (int i = 0; utf8[i]; i++)
+                        glyph |= (uint32_t)(unsigned char)utf8[i] << (8*i);
+                    btui_vt_print(vt, glyph, 1);
+                } else {
+                    btui_vt_print(vt, c, 1);
+                }
+                break;
+            case VT_ESC:
+                vt->state = VT_GROUND;
+                if (c == '[') {
+                    vt->state = VT_CSI;
+                    memset(vt->params, 0, sizeof(vt->params));
+                    vt->nparams = 1;
+                    vt->prefix = vt->intermediate = 0;
+                } else if (c == '(') {
+                    vt->state = VT_CHARSET;
+                } else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X') {
+                    vt->state = VT_STRING;
+                } else {
+                    ++vt->sequences;
+                    btui_vt_esc(vt, c);
+                }
+                break;
+            case VT_CHARSET:
+                vt->line_drawing = c == '0';
+                vt->state = VT_GROUND;
+                ++vt->sequences;
+                break;
+            case VT_CSI:
+                if ('0' <= c && c <= '9') {
+                    int *param = &vt->params[vt->nparams - 1];
+                    if (*param < 100000) *param = *param * 10 + (c - '0');
+                } else if (c == ';' || c == ':') {
+                    if (vt->nparams < (int)(sizeof(vt->params)/sizeof(vt->params[0])))
+                        ++vt->nparams;
+                } else if ('<' <= c && c <= '?') {
+                    vt->prefix = c;
+                } else if (' ' <= c && c <= '/') {
+                    vt->intermediate = c;
+                } else if ('@' <= c && c <= '~') {
+                    vt->state = VT_GROUND;
+                    ++vt->sequences;
+                    btui_vt_csi(vt, c);
+                } else if (c == '\033') {
+                    vt->state = VT_ESC;
+                } else if (c < ' ') {
+                    btui_vt_control(vt, c);
+                }
+                break;
+            case VT_STRING:
+                if (c == '\a') {
+                    vt->state = VT_GROUND;
+                    ++vt->sequences;
+                } else if (c == '\033') {
+                    vt->state = VT_STRING_ESC;
+                }
+                break;
+            case VT_STRING_ESC:
+                vt->state = c == '\\' ? VT_GROUND : VT_STRING;
+                if (c == '\\') ++vt->sequences;
+                break;
+            default: vt->state = VT_GROUND; break;
+        }
+    }
+}
+
+/*
+ * Free a virtual terminal.
+ */
+void btui_vt_free(btui_vt_t *vt)
+{
+    if (vt->input_fd >= 0) close(vt->input_fd);
+    free(vt->cells);
+    free(vt);
+}
+
+/*
+ * Put the text of row `y` of a virtual terminal into `buf` (as UTF-8, without
+ * trailing spaces, and truncated to fit `size` bytes including the
+ * terminating NUL). Returns the length of the text, or -1 if `y` is out of
+ * range.
+ */
+int btui_vt_line(btui_vt_t *vt, int y, char *buf, size_t size)
+{
+    if (y < 0 || y >= vt->height || size == 0) return -1;
+    size_t len = 0, end = 0;
+    for (const btui_cell_t *cell = &vt->cells[y*vt->width], *last = cell + vt->width; cell < last; cell++) {
+        // Characters are never split, so the text is always valid UTF-8:
+        size_t n = 0;
+        for (uint32_t g = cell->glyph; g; g >>= 8)
+            ++n;
+        if (len + n + 1 > size) break;
+        for (uint32_t g = cell->glyph; g; g >>= 8)
+            buf[len++] = (char)(g & 0xFF);
+        if (cell->glyph != ' ' && cell->width > 0) end = len;
+    }
+    buf[end] = '\0';
+    return (int)end;
+}
+
+/*
+ * Send input to the program through a headless BTUI's virtual terminal, as if
+ * it had been typed. Returns the number of bytes sent, or -1 on failure.
+ */
+int btui_vt_type(btui_vt_t *vt, const char *keys, size_t len)
+{
+    if (vt->input_fd < 0) return -1;
+    size_t sent = 0;
+    while (sent < len) {
+        ssize_t written = write(vt->input_fd, keys + sent, len - sent);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return sent > 0 ? (int)sent : -1;
+        }
+        sent += (size_t)written;
+    }
+    return (int)sent;
+}
+
 #endif
 // vim: ts=4 sw=0 et cino=L2,l1,(0,W4,m1
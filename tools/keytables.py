@@ -0,0 +1,91 @@
+#!/usr/bin/env python3
+"""
+Generate BTUI's key name lookup tables from the key_names[] table in btui.h and
+write them back into btui.h (between the BEGIN/END GENERATED KEY TABLES
+markers). Run this (or `make keytables`) after editing key_names[].
+
+Two tables are generated:
+  - key_code_names[]: the canonical name for each key code (the first entry in
+    key_names[] with that code), indexed directly by code.
+  - key_name_slots[]: a perfect hash table from key name to index in
+    key_names[] (plus one), using the FNV-1a hash seeded with
+    KEY_NAME_HASH_SEED and truncated to KEY_NAME_HASH_BITS bits.
+"""
+import os.path
+import re
+import sys
+
+HASH_BITS = 10
+BEGIN = "// BEGIN GENERATED KEY TABLES\n"
+END = "// END GENERATED KEY TABLES\n"
+
+def fnv1a(name, seed):
+    h = seed
+    for c in name.encode('ascii'):
+        h = ((h ^ c) * 16777619) & 0xFFFFFFFF
+    return h >> (32 - HASH_BITS)
+
+def parse_keys(src):
+    table = re.search(r"static const keyname_t key_names\[\] = \{(.*?)\n\};", src, re.S).group(1)
+    keys = [(code, name.encode('ascii').decode('unicode_escape'))
+            for code, name in re.findall(r'\{(\w+),\s*"((?:[^"\\]|\\.)*)"\}', table)]
+    # Constants like KEY_TAB are aliases of enum values, and C needs the enum
+    # value itself as an array index:
+    aliases = dict(re.findall(r"^const btui_key_t (\w+)\s*= (\w+);", src, re.M))
+    return [(aliases.get(code, code), name) for code, name in keys]
+
+def c_string(s):
+    return '"' + s.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+def generate(keys):
+    out = ["// Generated by tools/keytables.py from key_names[] (do not edit by hand):\n",
+           "// Canonical name of each key code, indexed by code:\n",
+           "static const char *const key_code_names[RESIZE_EVENT+1] = {\n"]
+    seen_codes = set()
+    for code, name in keys:
+        if code not in seen_codes:
+            seen_codes.add(code)
+            out.append(f"    [{code}] = {c_string(name)},\n")
+    out.append("};\n\n")
+
+    # Only the first entry with a given name is reachable:
+    names = {}
+    for i, (code, name) in enumerate(keys):
+        names.setdefault(name, i)
+    assert len(keys) < 255, "Too many key names for uint8_t slots"
+    for seed in range(0x811C9DC5, 0x811C9DC5 + 1000000):
+        slots = {}
+        for name, i in names.items():
+            h = fnv1a(name, seed)
+            if h in slots: break
+            slots[h] = i
+        else:
+            break
+    else:
+        sys.exit("Couldn't find a perfect hash seed")
+
+    out.append("// Perfect hash table from key name to 1 + index in key_names[] (0 for none):\n")
+    out.append(f"#define KEY_NAME_HASH_SEED 0x{seed:08X}u\n")
+    out.append(f"#define KEY_NAME_HASH_BITS {HASH_BITS}\n")
+    out.append("static const uint8_t key_name_slots[1 << KEY_NAME_HASH_BITS] = {\n")
+    entries = [f"[{h}] = {i+1}," for h, i in sorted(slots.items())]
+    line = "   "
+    for e in entries:
+        if len(line) + 1 + len(e) > 80:
+            out.append(line + "\n")
+            line = "   "
+        line += " " + e
+    out.append(line + "\n};\n")
+    return "".join(out)
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), "..", "btui.h")
+    with open(path) as f:
+        src = f.read()
+    start, end = src.index(BEGIN) + len(BEGIN), src.index(END)
+    src = src[:start] + generate(parse_keys(src)) + src[end:]
+    with open(path, "w") as f:
+        f.write(src)
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""
+Generate BTUI's Unicode character width table from Python's unicodedata module
+and write it into btui.h (between the BEGIN/END GENERATED WIDTH TABLES
+markers). Run this (or `make widthtables`) to update to a newer version of
+Unicode.
+
+The table has two levels: width_blocks[] maps each 256-codepoint block (below
+U+40000) to one of the unique blocks in width_block_data[], which stores the
+width (0, 1 or 2 columns) of each codepoint in the block in 2 bits.
+"""
+import os.path
+import sys
+import unicodedata
+
+LIMIT = 0x40000
+BEGIN = "// BEGIN GENERATED WIDTH TABLES\n"
+END = "// END GENERATED WIDTH TABLES\n"
+
+def width(cp):
+    c = chr(cp)
+    category = unicodedata.category(c)
+    if cp == 0x00AD: return 1 # Soft hyphen is usually displayed
+    if category in ('Mn', 'Me', 'Cf', 'Cc', 'Zl', 'Zp'): return 0
+    if 0x1160 <= cp <= 0x11FF or cp == 0x200B: return 0 # Hangul medial vowels/final consonants
+    if unicodedata.east_asian_width(c) in ('W', 'F'): return 2
+    # Unassigned codepoints in the CJK ideograph planes are wide:
+    if category == 'Cn' and 0x20000 <= cp <= 0x3FFFD: return 2
+    return 1
+
+def generate():
+    blocks, block_ids, index = [], {}, []
+    for start in range(0, LIMIT, 256):
+        packed = bytearray(64)
+        for i in range(256):
+            packed[i // 4] |= width(start + i) << (2 * (i % 4))
+        packed = bytes(packed)
+        if packed not in block_ids:
+            block_ids[packed] = len(blocks)
+            blocks.append(packed)
+        index.append(block_ids[packed])
+    assert len(blocks) <= 256, "Too many unique blocks for uint8_t indices"
+
+    out = [f"// Generated by tools/widthtable.py from Unicode {unicodedata.unidata_version} (do not edit by hand):\n",
+           "// Which block of width_block_data[] holds each 256-codepoint block's widths:\n",
+           f"static const uint8_t width_blocks[0x{LIMIT:X} >> 8] = {{\n"]
+    for i in range(0, len(index), 24):
+        out.append("    " + " ".join(f"{b}," for b in index[i:i+24]) + "\n")
+    out.append("};\n")
+    out.append("// The width of each codepoint in a block, packed 4 per byte (2 bits each):\n")
+    out.append(f"static const uint8_t width_block_data[{len(blocks)}][64] = {{\n")
+    for block in blocks:
+        out.append("    {" + ",".join(f"0x{b:02X}" for b in block[:32]) + ",\n")
+        out.append("     " + ",".join(f"0x{b:02X}" for b in block[32:]) + "},\n")
+    out.append("};\n")
+    return "".join(out)
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else os.path.join(os.path.dirname(__file__), "..", "btui.h")
+    with open(path) as f:
+        src = f.read()
+    start, end = src.index(BEGIN) + len(BEGIN), src.index(END)
+    src = src[:start] + generate() + src[end:]
+    with open(path, "w") as f:
+        f.write(src)
+
+if __name__ == "__main__":
+    main()